@@ -0,0 +1,72 @@
+#!/usr/bin/env bash
+# Times `pixi run <task>` on the `examples/cpp-sdl` project in three scenarios:
+#
+#   cold:  empty package and repodata caches, no `.pixi` directory and no build directory.
+#   warm:  populated caches, but the environment and the build directory are removed.
+#   no-op: everything is up to date, nothing has to be installed or rebuilt.
+#
+# Usage: benches/e2e_cpp_sdl.sh [task]
+#
+# The task defaults to `bench`, which builds the example and renders a fixed number of frames
+# with SDL's headless video driver, so the harness also finishes on a machine without a display.
+# `start` opens a window and only returns once it is closed.
+#
+# Environment variables:
+#   PIXI  the pixi executable to benchmark (default: target/release/pixi)
+#   RUNS  the number of times every scenario is repeated (default: 3)
+set -euo pipefail
+
+repo_root="$(cd "$(dirname "${BASH_SOURCE[0]}")/.." && pwd)"
+task="${1:-bench}"
+pixi="${PIXI:-$repo_root/target/release/pixi}"
+runs="${RUNS:-3}"
+
+if [ ! -x "$pixi" ]; then
+    echo "pixi executable not found at $pixi, build it with 'cargo build --release' or set PIXI" >&2
+    exit 1
+fi
+
+work_dir="$(mktemp -d)"
+trap 'rm -rf "$work_dir"' EXIT
+
+# Copy the example so the benchmark does not touch the checkout.
+project="$work_dir/cpp-sdl"
+cp -r "$repo_root/examples/cpp-sdl" "$project"
+rm -rf "$project/.pixi" "$project/.build"
+
+# The package and repodata caches are stored in the user cache directory (XDG_CACHE_HOME on Linux),
+# point it to a directory we control so the cold scenario really starts from nothing.
+export XDG_CACHE_HOME="$work_dir/cache"
+
+# Runs the task and prints the wall-clock time it took in seconds.
+time_task() {
+    local start end
+    start="$(date +%s.%N)"
+    (cd "$project" && "$pixi" run "$task" >/dev/null)
+    end="$(date +%s.%N)"
+    echo "$end - $start" | bc
+}
+
+report() {
+    local scenario="$1"
+    shift
+    printf "%-6s %s\n" "$scenario" "$*"
+}
+
+cold=()
+warm=()
+noop=()
+for _ in $(seq "$runs"); do
+    rm -rf "$XDG_CACHE_HOME" "$project/.pixi" "$project/.build"
+    cold+=("$(time_task)")
+
+    rm -rf "$project/.pixi" "$project/.build"
+    warm+=("$(time_task)")
+
+    noop+=("$(time_task)")
+done
+
+echo "pixi run $task on examples/cpp-sdl ($runs runs, seconds)"
+report cold "${cold[@]}"
+report warm "${warm[@]}"
+report no-op "${noop[@]}"
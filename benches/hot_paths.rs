@@ -0,0 +1,301 @@
+//! Benchmarks for the code paths that are executed on every invocation of pixi, e.g. when running a
+//! task in an environment that is already up to date. The benchmarks use synthetic lock-files,
+//! prefixes and repodata that are much larger than those of a typical project so regressions stand
+//! out.
+//!
+//! Run them with `cargo bench --bench hot_paths`. Pass a filter to only run the benchmarks whose
+//! name contains it, e.g. `cargo bench --bench hot_paths -- lock_file`.
+
+#[path = "../tests/common/package_database.rs"]
+mod package_database;
+
+use itertools::Itertools;
+use package_database::{Package, PackageDatabase};
+use pixi::{
+    cli::run::order_tasks,
+    environment::{get_required_packages, lock_file_up_to_date},
+    prefix::{conda_meta_file_name, Prefix},
+    repodata::IndexedRepoData,
+    Project,
+};
+use rattler_conda_types::{
+    conda_lock::{
+        self,
+        builder::{LockFileBuilder, LockedPackage, LockedPackages},
+        CondaLock,
+    },
+    Channel, ChannelConfig, PackageRecord, Platform, PrefixRecord, RepoDataRecord,
+};
+use rattler_repodata_gateway::sparse::SparseRepoData;
+use std::fmt::Write;
+use std::hint::black_box;
+use std::path::Path;
+use std::time::{Duration, Instant};
+
+/// The number of packages in the synthetic lock-files, prefixes and repodata.
+const PACKAGE_COUNT: usize = 2000;
+
+/// The number of packages the synthetic project directly depends on.
+const DIRECT_DEPENDENCY_COUNT: usize = 100;
+
+/// The number of layers of tasks in the synthetic task graph.
+const TASK_LAYERS: usize = 20;
+
+/// The number of tasks per layer in the synthetic task graph.
+const TASKS_PER_LAYER: usize = 20;
+
+/// Runs a single benchmark and prints the timings.
+struct Bencher {
+    filter: Option<String>,
+}
+
+impl Bencher {
+    fn bench<T>(&self, name: &str, mut f: impl FnMut() -> T) {
+        if let Some(filter) = &self.filter {
+            if !name.contains(filter.as_str()) {
+                return;
+            }
+        }
+
+        // Warm up and determine how many iterations fit in roughly a second.
+        let start = Instant::now();
+        black_box(f());
+        let first = start.elapsed();
+        let iterations =
+            (Duration::from_secs(1).as_nanos() / first.as_nanos().max(1)).clamp(5, 1000);
+
+        let mut samples = Vec::with_capacity(iterations as usize);
+        for _ in 0..iterations {
+            let start = Instant::now();
+            black_box(f());
+            samples.push(start.elapsed());
+        }
+
+        samples.sort();
+        let mean = samples.iter().sum::<Duration>() / samples.len() as u32;
+        println!(
+            "{name:<40} mean {mean:>12?}   median {:>12?}   min {:>12?}   ({} iterations)",
+            samples[samples.len() / 2],
+            samples[0],
+            samples.len()
+        );
+    }
+}
+
+/// Returns the name of the i-th synthetic package.
+fn package_name(i: usize) -> String {
+    format!("package-{i}")
+}
+
+/// Returns a database with the synthetic packages. Every package depends on two other packages so
+/// the packages form a binary tree.
+fn synthetic_database(platform: Platform) -> PackageDatabase {
+    let mut database = PackageDatabase::default();
+    for i in 0..PACKAGE_COUNT {
+        let mut package = Package::build(package_name(i), "1.0").with_subdir(platform);
+        for dependency in [2 * i + 1, 2 * i + 2] {
+            if dependency < PACKAGE_COUNT {
+                package = package.with_dependency(format!("{} >=1.0", package_name(dependency)));
+            }
+        }
+        database.add_package(package.finish());
+    }
+    database
+}
+
+/// Returns the synthetic repodata records.
+fn repodata_records(channel: &Channel, platform: Platform) -> Vec<RepoDataRecord> {
+    synthetic_database(platform)
+        .packages_by_platform(platform)
+        .map(|package| {
+            let package_record = AsRef::<PackageRecord>::as_ref(package).clone();
+            let file_name = format!(
+                "{}-{}-{}.conda",
+                package_record.name, package_record.version, package_record.build
+            );
+            RepoDataRecord {
+                url: channel.platform_url(platform).join(&file_name).unwrap(),
+                channel: channel.base_url().to_string(),
+                file_name,
+                package_record,
+            }
+        })
+        .collect()
+}
+
+/// Constructs a project that depends on the first synthetic packages and has a task graph with
+/// many dependencies between tasks.
+fn synthetic_project(root: &Path) -> Project {
+    let mut manifest = format!(
+        r#"
+        [project]
+        name = "benchmark"
+        version = "0.1.0"
+        channels = ["conda-forge"]
+        platforms = ["{}"]
+
+        [dependencies]
+        "#,
+        Platform::current()
+    );
+    for i in 0..DIRECT_DEPENDENCY_COUNT {
+        writeln!(manifest, "{} = \">=1.0\"", package_name(i)).unwrap();
+    }
+
+    // Every task depends on all tasks of the previous layer.
+    writeln!(manifest, "[tasks]").unwrap();
+    for layer in 0..TASK_LAYERS {
+        for task in 0..TASKS_PER_LAYER {
+            let depends_on = if layer == 0 {
+                Vec::new()
+            } else {
+                (0..TASKS_PER_LAYER)
+                    .map(|dependency| format!("\"task-{}-{dependency}\"", layer - 1))
+                    .collect()
+            };
+            writeln!(
+                manifest,
+                "task-{layer}-{task} = {{ cmd = \"echo {layer} {task}\", depends_on = [{}] }}",
+                depends_on.join(", ")
+            )
+            .unwrap();
+        }
+    }
+    writeln!(
+        manifest,
+        "all = {{ depends_on = [{}] }}",
+        (0..TASKS_PER_LAYER)
+            .map(|task| format!("\"task-{}-{task}\"", TASK_LAYERS - 1))
+            .join(", ")
+    )
+    .unwrap();
+
+    Project::from_manifest_str(root, manifest).unwrap()
+}
+
+/// Constructs a lock-file that locks all the synthetic packages.
+fn synthetic_lock_file(project: &Project, records: &[RepoDataRecord]) -> CondaLock {
+    let channels = project
+        .channels()
+        .iter()
+        .map(|channel| conda_lock::Channel::from(channel.base_url().to_string()));
+    let mut locked_packages = LockedPackages::new(Platform::current());
+    for record in records {
+        locked_packages =
+            locked_packages.add_locked_package(LockedPackage::try_from(record.clone()).unwrap());
+    }
+    LockFileBuilder::new(channels, project.platforms().iter().cloned(), vec![])
+        .add_locked_packages(locked_packages)
+        .build()
+        .unwrap()
+}
+
+/// Writes the `conda-meta` files of all the synthetic packages into the given prefix.
+fn synthetic_prefix(root: &Path, records: &[RepoDataRecord]) -> Prefix {
+    let conda_meta = root.join("conda-meta");
+    std::fs::create_dir_all(&conda_meta).unwrap();
+    for record in records {
+        let prefix_record = PrefixRecord {
+            repodata_record: record.clone(),
+            package_tarball_full_path: None,
+            extracted_package_dir: None,
+            files: (0..50)
+                .map(|file| {
+                    Path::new("lib").join(format!("{}-{file}.so", record.package_record.name))
+                })
+                .collect(),
+            paths_data: Default::default(),
+            requested_spec: None,
+            link: None,
+        };
+        prefix_record
+            .write_to_path(
+                conda_meta.join(conda_meta_file_name(&record.package_record)),
+                true,
+            )
+            .unwrap();
+    }
+    Prefix::new(root).unwrap()
+}
+
+fn main() {
+    let bencher = Bencher {
+        filter: std::env::args().skip(1).find(|arg| !arg.starts_with('-')),
+    };
+
+    let runtime = tokio::runtime::Builder::new_multi_thread()
+        .enable_all()
+        .build()
+        .unwrap();
+
+    let dir = tempfile::tempdir().unwrap();
+    let project = synthetic_project(dir.path());
+    let channel = Channel::from_str("conda-forge", &ChannelConfig::default()).unwrap();
+    let records = repodata_records(&channel, Platform::current());
+    let lock_file = synthetic_lock_file(&project, &records);
+
+    bencher.bench("lock_file_up_to_date", || {
+        assert!(lock_file_up_to_date(&project, &lock_file).unwrap())
+    });
+
+    bencher.bench("get_required_packages", || {
+        get_required_packages(&lock_file, Platform::current()).unwrap()
+    });
+
+    bencher.bench("order_tasks", || {
+        order_tasks(vec![String::from("all")], &project).unwrap()
+    });
+
+    let prefix = synthetic_prefix(&dir.path().join("prefix"), &records);
+    bencher.bench("Prefix::find_installed_packages", || {
+        runtime
+            .block_on(prefix.find_installed_packages(None))
+            .unwrap()
+    });
+    bencher.bench("Prefix::installed_packages", || {
+        runtime.block_on(prefix.installed_packages()).unwrap()
+    });
+
+    // Write the synthetic repodata in a channel directory
+    let channel_dir = dir.path().join("channel");
+    runtime
+        .block_on(synthetic_database(Platform::current()).write_repodata(&channel_dir))
+        .unwrap();
+    let repodata_path = channel_dir
+        .join(Platform::current().as_str())
+        .join("repodata.json");
+
+    bencher.bench("SparseRepoData::new", || {
+        SparseRepoData::new(
+            channel.clone(),
+            Platform::current().to_string(),
+            &repodata_path,
+            None,
+        )
+        .unwrap()
+    });
+
+    let sparse_repo_data = SparseRepoData::new(
+        channel.clone(),
+        Platform::current().to_string(),
+        &repodata_path,
+        None,
+    )
+    .unwrap();
+    let package_names = (0..DIRECT_DEPENDENCY_COUNT).map(package_name).collect_vec();
+    bencher.bench("SparseRepoData::load_records_recursive", || {
+        SparseRepoData::load_records_recursive([&sparse_repo_data], package_names.clone(), None)
+            .unwrap()
+    });
+
+    bencher.bench("IndexedRepoData::new", || {
+        IndexedRepoData::new(channel.clone(), Platform::current(), &repodata_path).unwrap()
+    });
+
+    let indexed_repo_data =
+        IndexedRepoData::new(channel.clone(), Platform::current(), &repodata_path).unwrap();
+    bencher.bench("IndexedRepoData::load_records_recursive", || {
+        IndexedRepoData::load_records_recursive([&indexed_repo_data], package_names.clone())
+            .unwrap()
+    });
+}
@@ -1,8 +1,146 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
 #include <iostream>
+#include <vector>
 #include <SDL.h>
 
+// Command line options
+struct Options {
+    // Run without a visible window, using SDL's dummy video driver and the software renderer
+    bool headless = false;
+
+    // Only redraw when the window contents were damaged instead of on every event
+    bool damage_only = false;
+
+    // Render this many frames as fast as possible and print timing statistics (0 = run until quit)
+    int frames = 0;
+};
+
+// The time spent in each step of rendering a single frame, in microseconds
+struct FrameTime {
+    double clear;
+    double fill;
+    double present;
+    double total;
+};
+
+static bool parse_options(int argc, char* args[], Options& options) {
+    for(int i = 1; i < argc; ++i) {
+        if(std::strcmp(args[i], "--headless") == 0) {
+            options.headless = true;
+        } else if(std::strcmp(args[i], "--damage-only") == 0) {
+            options.damage_only = true;
+        } else if(std::strcmp(args[i], "--frames") == 0 && i + 1 < argc) {
+            options.frames = std::atoi(args[++i]);
+        } else {
+            std::cout << "Usage: " << args[0] << " [--headless] [--damage-only] [--frames N]" << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Draws a single frame and returns how long each step took
+static FrameTime render_frame(SDL_Renderer *renderer, const SDL_Rect &squareRect) {
+    using clock = std::chrono::steady_clock;
+    auto micros = [](clock::time_point start, clock::time_point end) {
+        return std::chrono::duration<double, std::micro>(end - start).count();
+    };
+
+    auto start = clock::now();
+
+    // Initialize renderer color white for the background
+    SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+
+    // Clear screen
+    SDL_RenderClear(renderer);
+    auto cleared = clock::now();
+
+    // Set renderer color red to draw the square
+    SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF);
+
+    // Draw a rectangle
+    SDL_RenderFillRect(renderer, &squareRect);
+    auto filled = clock::now();
+
+    // Update screen
+    SDL_RenderPresent(renderer);
+    auto presented = clock::now();
+
+    return FrameTime{
+        micros(start, cleared),
+        micros(cleared, filled),
+        micros(filled, presented),
+        micros(start, presented),
+    };
+}
+
+// Returns the value below which the given fraction of the sorted values fall
+static double percentile(const std::vector<double> &sorted, double fraction) {
+    size_t index = static_cast<size_t>(fraction * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+static void print_statistics(const std::vector<FrameTime> &frames) {
+    if(frames.empty()) {
+        return;
+    }
+
+    std::cout << std::left << std::setw(10) << "step"
+              << std::right << std::setw(10) << "mean"
+              << std::setw(10) << "p50"
+              << std::setw(10) << "p90"
+              << std::setw(10) << "p99"
+              << std::setw(10) << "max" << "   (us, " << frames.size() << " frames)" << std::endl;
+
+    auto print_step = [&](const char *name, double FrameTime::*step) {
+        std::vector<double> values;
+        values.reserve(frames.size());
+        for(const auto &frame : frames) {
+            values.push_back(frame.*step);
+        }
+        std::sort(values.begin(), values.end());
+
+        double sum = 0;
+        for(double value : values) {
+            sum += value;
+        }
+
+        std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1)
+                  << std::setw(10) << sum / values.size()
+                  << std::setw(10) << percentile(values, 0.50)
+                  << std::setw(10) << percentile(values, 0.90)
+                  << std::setw(10) << percentile(values, 0.99)
+                  << std::setw(10) << values.back() << std::endl;
+    };
+    print_step("clear", &FrameTime::clear);
+    print_step("fill", &FrameTime::fill);
+    print_step("present", &FrameTime::present);
+    print_step("total", &FrameTime::total);
+}
+
+// Returns true if the event means the contents of the window have to be drawn again
+static bool is_damage(const SDL_Event &e) {
+    return e.type == SDL_WINDOWEVENT && (e.window.event == SDL_WINDOWEVENT_EXPOSED ||
+                                         e.window.event == SDL_WINDOWEVENT_SIZE_CHANGED ||
+                                         e.window.event == SDL_WINDOWEVENT_RESTORED);
+}
+
 int main( int argc, char* args[] ) {
 
+    Options options;
+    if(!parse_options(argc, args, options)) {
+        return 1;
+    }
+
+    // Without a display SDL can still render into an offscreen window surface
+    if(options.headless) {
+        SDL_setenv("SDL_VIDEODRIVER", "dummy", 1);
+    }
+
     // Initialize SDL
     if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
     {
@@ -15,14 +153,15 @@ int main( int argc, char* args[] ) {
                                           SDL_WINDOWPOS_UNDEFINED,
                                           SDL_WINDOWPOS_UNDEFINED,
                                           800, 600,
-                                          SDL_WINDOW_SHOWN);
+                                          options.headless ? SDL_WINDOW_HIDDEN : SDL_WINDOW_SHOWN);
     if(window == nullptr) {
         std::cout << "Failed to create SDL window (error" << SDL_GetError() << ")" << std::endl;
         SDL_Quit();
         return 1;
     }
 
-    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+    SDL_Renderer *renderer = SDL_CreateRenderer(window, -1,
+                                                options.headless ? SDL_RENDERER_SOFTWARE : SDL_RENDERER_ACCELERATED);
     if(renderer == nullptr) {
         std::cout << "Failed to create SDL renderer (error" << SDL_GetError() << ")" << std::endl;
         SDL_DestroyWindow(window);
@@ -41,39 +180,56 @@ int main( int argc, char* args[] ) {
     squareRect.x = 400 - squareRect.w / 2;
     squareRect.y = 300 - squareRect.h / 2;
 
-    // Event loop exit flag
-    bool quit = false;
-
-    // Event loop
-    while(!quit)
-    {
-        SDL_Event e;
+    // The time it took to draw every frame
+    std::vector<FrameTime> frameTimes;
+    frameTimes.reserve(options.frames > 0 ? options.frames : 1024);
+
+    if(options.frames > 0) {
+        // Benchmark: render a fixed number of frames as fast as possible
+        bool quit = false;
+        for(int frame = 0; frame < options.frames && !quit; ++frame) {
+            SDL_Event e;
+            while(SDL_PollEvent(&e)) {
+                if(e.type == SDL_QUIT) {
+                    quit = true;
+                }
+            }
+            frameTimes.push_back(render_frame(renderer, squareRect));
+        }
+    } else {
+        // Event loop exit flag
+        bool quit = false;
 
-        // Wait indefinitely for the next available event
-        SDL_WaitEvent(&e);
+        // The window has to be drawn at least once
+        bool damaged = true;
 
-        // User requests quit
-        if(e.type == SDL_QUIT)
+        // Event loop
+        while(!quit)
         {
-            quit = true;
-        }
-
-        // Initialize renderer color white for the background
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0xFF, 0xFF, 0xFF);
+            SDL_Event e;
 
-        // Clear screen
-        SDL_RenderClear(renderer);
+            // Wait indefinitely for the next available event, unless there is something to draw
+            if(!damaged || !options.damage_only) {
+                SDL_WaitEvent(&e);
 
-        // Set renderer color red to draw the square
-        SDL_SetRenderDrawColor(renderer, 0xFF, 0x00, 0x00, 0xFF);
+                // User requests quit
+                if(e.type == SDL_QUIT)
+                {
+                    quit = true;
+                }
 
-        // Draw a rectangle
-        SDL_RenderFillRect(renderer, &squareRect);
+                damaged = damaged || !options.damage_only || is_damage(e);
+            }
 
-        // Update screen
-        SDL_RenderPresent(renderer);
+            if(damaged) {
+                frameTimes.push_back(render_frame(renderer, squareRect));
+                damaged = false;
+            }
+        }
     }
 
+    print_statistics(frameTimes);
+
     SDL_DestroyRenderer(renderer);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -0,0 +1,68 @@
+//! Bounds-checked reading of the binary files pixi writes: the repodata index, the lock-file cache
+//! and offline bundles. Each of these files starts with 8 magic bytes, the last of which is the
+//! version of the format, and stores its integers little-endian.
+//!
+//! The readers return `None` instead of panicking when the data is too short or an offset does not
+//! fit in memory, so a truncated or corrupt file can be treated like a missing one.
+
+use std::ops::Range;
+
+/// The number of magic bytes at the start of a file.
+pub const MAGIC_LEN: usize = 8;
+
+/// Returns true if the bytes start with the given magic bytes.
+pub fn has_magic(bytes: &[u8], magic: &[u8; MAGIC_LEN]) -> bool {
+    bytes.get(..MAGIC_LEN) == Some(magic.as_slice())
+}
+
+/// Reads a `u32` at the given offset.
+pub fn read_u32(bytes: &[u8], offset: usize) -> Option<u32> {
+    let bytes = bytes.get(offset..offset.checked_add(4)?)?;
+    Some(u32::from_le_bytes(bytes.try_into().ok()?))
+}
+
+/// Reads a `u64` at the given offset.
+pub fn read_u64(bytes: &[u8], offset: usize) -> Option<u64> {
+    let bytes = bytes.get(offset..offset.checked_add(8)?)?;
+    Some(u64::from_le_bytes(bytes.try_into().ok()?))
+}
+
+/// Reads a `u64` at the given offset that is used as a size or an offset.
+pub fn read_usize(bytes: &[u8], offset: usize) -> Option<usize> {
+    usize::try_from(read_u64(bytes, offset)?).ok()
+}
+
+/// Returns the range described by an offset and a length stored as `u64`s at the given offset.
+/// The range itself is not checked against the bytes.
+pub fn read_range(bytes: &[u8], offset: usize) -> Option<Range<usize>> {
+    let start = read_usize(bytes, offset)?;
+    let len = read_usize(bytes, offset.checked_add(8)?)?;
+    Some(start..start.checked_add(len)?)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_read() {
+        let mut bytes = b"PIXITST\x01".to_vec();
+        bytes.extend_from_slice(&7u32.to_le_bytes());
+        for value in [3u64, 5, u64::MAX] {
+            bytes.extend_from_slice(&value.to_le_bytes());
+        }
+
+        assert!(has_magic(&bytes, b"PIXITST\x01"));
+        assert!(!has_magic(&bytes, b"PIXITST\x02"));
+        assert!(!has_magic(&bytes[..4], b"PIXITST\x01"));
+
+        assert_eq!(read_u32(&bytes, 8), Some(7));
+        assert_eq!(read_u64(&bytes, 28), Some(u64::MAX));
+        assert_eq!(read_u64(&bytes, 32), None);
+        assert_eq!(read_u64(&bytes, usize::MAX), None);
+
+        assert_eq!(read_range(&bytes, 12), Some(3..8));
+        // The end of the range overflows
+        assert_eq!(read_range(&bytes, 20), None);
+    }
+}
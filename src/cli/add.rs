@@ -1,17 +1,17 @@
 use crate::{
-    environment::{load_lock_file, update_lock_file},
+    environment::{
+        get_required_packages, load_lock_file, solve_platform, update_lock_file_with_solutions,
+    },
     project::Project,
-    virtual_packages::get_minimal_virtual_packages,
+    repodata::IndexedRepoData,
 };
 use clap::Parser;
-use indexmap::IndexMap;
 use itertools::Itertools;
-use miette::{IntoDiagnostic, WrapErr};
+use miette::WrapErr;
 use rattler_conda_types::{
-    version_spec::VersionOperator, MatchSpec, NamelessMatchSpec, Platform, Version, VersionSpec,
+    conda_lock::CondaLock, version_spec::VersionOperator, MatchSpec, NamelessMatchSpec, Platform,
+    RepoDataRecord, Version, VersionSpec,
 };
-use rattler_repodata_gateway::sparse::SparseRepoData;
-use rattler_solve::{libsolv_rs, SolverImpl};
 use std::collections::HashMap;
 use std::path::PathBuf;
 
@@ -89,27 +89,26 @@ pub async fn add_specs_to_project(
         })
         .collect::<miette::Result<HashMap<String, NamelessMatchSpec>>>()?;
 
-    // Get the current specs
-
     // Fetch the repodata for the project
     let sparse_repo_data = project.fetch_sparse_repodata().await?;
 
-    // Determine the best version per platform
+    // The packages in the existing lock file are passed to the solver so it favors them.
+    let lock_file = load_lock_file(project).await?;
+
+    // Determine the best version per platform. The solution of every platform is also used to
+    // update the lock-file so the platforms dont have to be solved again.
     let mut best_versions = HashMap::new();
-    for platform in project.platforms() {
-        let current_specs = match spec_type {
-            SpecType::Host => project.host_dependencies(*platform)?,
-            SpecType::Build => project.build_dependencies(*platform)?,
-            SpecType::Run => project.dependencies(*platform)?,
-        };
+    let mut solutions = HashMap::new();
+    for platform in project.platforms().iter().cloned() {
         // Solve the environment with the new specs added
-        let solved_versions = match determine_best_version(
+        let records = match solve_with_new_specs(
+            project,
             &new_specs,
-            &current_specs,
+            &lock_file,
             &sparse_repo_data,
-            *platform,
+            platform,
         ) {
-            Ok(versions) => versions,
+            Ok(records) => records,
             Err(err) => {
                 return Err(err).wrap_err_with(||miette::miette!(
                         "could not determine any available versions for {} on {platform}. Either the package could not be found or version constraints on other dependencies result in a conflict.",
@@ -119,7 +118,7 @@ pub async fn add_specs_to_project(
         };
 
         // Determine the minimum compatible constraining version.
-        for (name, version) in solved_versions {
+        for (name, version) in best_versions_of_new_specs(&new_specs, &records) {
             match best_versions.get_mut(&name) {
                 Some(prev) => {
                     if *prev > version {
@@ -131,6 +130,8 @@ pub async fn add_specs_to_project(
                 }
             }
         }
+
+        solutions.insert(platform, records);
     }
 
     // Update the specs passed on the command line with the best available versions.
@@ -159,13 +160,26 @@ pub async fn add_specs_to_project(
         added_specs.push(spec);
     }
 
+    // The version of a new package might be constrained to a lower version than the one that was
+    // selected for a platform because another platform selected a lower version. Those platforms
+    // (and any platform for which the added specs differ from what was solved) are solved again.
+    for platform in project.platforms().iter().cloned() {
+        let dependencies = project.all_dependencies(platform)?;
+        let satisfied = solutions.get(&platform).map_or(false, |records| {
+            dependencies.iter().all(|(name, spec)| {
+                let spec = MatchSpec::from_nameless(spec.clone(), Some(name.clone()));
+                records
+                    .iter()
+                    .any(|record| spec.matches(&record.package_record))
+            })
+        });
+        if !satisfied {
+            solutions.remove(&platform);
+        }
+    }
+
     // Update the lock file and write to disk
-    update_lock_file(
-        project,
-        load_lock_file(project).await?,
-        Some(sparse_repo_data),
-    )
-    .await?;
+    update_lock_file_with_solutions(project, lock_file, Some(sparse_repo_data), solutions).await?;
     project.save()?;
 
     for spec in added_specs {
@@ -178,66 +192,45 @@ pub async fn add_specs_to_project(
     Ok(())
 }
 
-/// Given several specs determines the highest installable version for them.
-pub fn determine_best_version(
+/// Solves the dependencies of the project for the given platform with the new specs added.
+pub fn solve_with_new_specs(
+    project: &Project,
     new_specs: &HashMap<String, NamelessMatchSpec>,
-    current_specs: &IndexMap<String, NamelessMatchSpec>,
-    sparse_repo_data: &[SparseRepoData],
+    lock_file: &CondaLock,
+    sparse_repo_data: &[IndexedRepoData],
     platform: Platform,
-) -> miette::Result<HashMap<String, Version>> {
-    let combined_specs = current_specs
-        .iter()
-        .chain(new_specs.iter())
-        .map(|(name, spec)| (name.clone(), spec.clone()))
-        .collect::<HashMap<_, _>>();
-
-    // Extract the package names from all the dependencies
-    let package_names = combined_specs.keys().cloned().collect_vec();
-
-    // Get the repodata for the current platform and for NoArch
-    let platform_sparse_repo_data = sparse_repo_data.iter().filter(|sparse| {
-        sparse.subdir() == platform.as_str() || sparse.subdir() == Platform::NoArch.as_str()
-    });
-
-    // Load only records we need for this platform
-    let available_packages = SparseRepoData::load_records_recursive(
-        platform_sparse_repo_data,
-        package_names.iter().cloned(),
-        None,
-    )
-    .into_diagnostic()?;
+) -> miette::Result<Vec<RepoDataRecord>> {
+    let mut dependencies = project.all_dependencies(platform)?;
+    for (name, spec) in new_specs {
+        dependencies.insert(name.clone(), spec.clone());
+    }
 
-    // Construct a solver task to start solving.
-    let task = rattler_solve::SolverTask {
-        specs: combined_specs
+    solve_platform(
+        platform,
+        sparse_repo_data,
+        dependencies
             .iter()
             .map(|(name, spec)| MatchSpec::from_nameless(spec.clone(), Some(name.clone())))
             .collect(),
+        dependencies.into_keys().collect(),
+        project.virtual_packages(platform)?,
+        get_required_packages(lock_file, platform)?,
+    )
+}
 
-        available_packages: &available_packages,
-
-        virtual_packages: get_minimal_virtual_packages(platform)
-            .into_iter()
-            .map(Into::into)
-            .collect(),
-
-        // TODO: Add the information from the current lock file here.
-        locked_packages: vec![],
-
-        pinned_packages: vec![],
-    };
-
-    let records = libsolv_rs::Solver.solve(task).into_diagnostic()?;
-
-    // Determine the versions of the new packages
-    Ok(records
-        .into_iter()
+/// Returns the versions of the new packages in the solution of a platform.
+fn best_versions_of_new_specs(
+    new_specs: &HashMap<String, NamelessMatchSpec>,
+    records: &[RepoDataRecord],
+) -> HashMap<String, Version> {
+    records
+        .iter()
         .filter(|record| new_specs.contains_key(&record.package_record.name))
         .map(|record| {
             (
-                record.package_record.name,
-                record.package_record.version.into(),
+                record.package_record.name.clone(),
+                record.package_record.version.clone().into(),
             )
         })
-        .collect())
+        .collect()
 }
@@ -0,0 +1,374 @@
+use crate::cli::run::get_activated_env;
+use crate::environment::LockFileUsage;
+use crate::prefix::Prefix;
+use crate::Project;
+use clap::Parser;
+use rattler_digest::{compute_file_digest, Sha256};
+use serde::{Deserialize, Serialize};
+use std::collections::HashMap;
+use std::path::{Path, PathBuf};
+use std::time::{Duration, SystemTime};
+
+/// The name of the socket in the `.pixi` directory on which a running daemon listens.
+const DAEMON_SOCKET: &str = "daemon.sock";
+
+/// How long `pixi run` waits for the response of the daemon before it activates the environment
+/// itself. Updating the environment can take longer than this, in that case the run does not wait
+/// for the daemon.
+const RESPONSE_TIMEOUT: Duration = Duration::from_secs(10);
+
+/// How long the daemon waits for a client to send its request or to receive the response.
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(5);
+
+/// Runs a background server that keeps the environment of the project verified and activated, so
+/// repeated invocations of `pixi run` can start their tasks right away.
+#[derive(Parser, Debug)]
+pub struct Args {
+    /// The path to 'pixi.toml'
+    #[arg(long)]
+    pub manifest_path: Option<PathBuf>,
+}
+
+/// A request sent by `pixi run` to the daemon.
+#[derive(Debug, Serialize, Deserialize)]
+struct DaemonRequest {
+    /// The version of pixi that sent the request.
+    version: String,
+
+    /// The `PATH` of the process that sent the request, the activation prepends to it.
+    path: Option<String>,
+}
+
+/// The response of the daemon to a [`DaemonRequest`].
+#[derive(Debug, Serialize, Deserialize)]
+#[serde(rename_all = "snake_case")]
+enum DaemonResponse {
+    /// The environment variables to set on top of the environment of the client, see
+    /// [`get_activated_env`].
+    Env(HashMap<String, String>),
+
+    /// The daemon could not provide the environment.
+    Error(String),
+}
+
+/// Describes the files that influence the environment of a project. The environment cached by the
+/// daemon is only reused as long as none of them changed.
+#[derive(Debug, PartialEq, Eq)]
+struct ProjectStamp {
+    /// The hash of the manifest
+    manifest: String,
+
+    /// The size and modification time of the lock-file
+    lock_file: (u64, SystemTime),
+
+    /// The hash of the installed packages, see [`Prefix::installed_packages_hash`].
+    installed_packages: String,
+}
+
+impl ProjectStamp {
+    /// Computes the stamp of the current state of the project. Returns `None` if the lock-file or
+    /// the prefix do not exist.
+    fn current(manifest_path: &Path) -> Option<Self> {
+        let root = manifest_path.parent()?;
+        let lock_file = std::fs::metadata(root.join(crate::consts::PROJECT_LOCK_FILE)).ok()?;
+        let prefix = Prefix::new(root.join(crate::consts::PIXI_DIR).join("env")).ok()?;
+        Some(Self {
+            manifest: format!("{:x}", compute_file_digest::<Sha256>(manifest_path).ok()?),
+            lock_file: (lock_file.len(), lock_file.modified().ok()?),
+            installed_packages: prefix.installed_packages_hash()?,
+        })
+    }
+}
+
+/// The state the daemon keeps between requests.
+struct DaemonState {
+    manifest_path: PathBuf,
+    cached: Option<(ProjectStamp, HashMap<String, String>)>,
+}
+
+impl DaemonState {
+    /// Returns the activated environment of the project. The environment is only recomputed if the
+    /// manifest, the lock-file or the installed packages changed since the previous request.
+    async fn handle(&mut self, request: DaemonRequest) -> DaemonResponse {
+        if request.version != env!("CARGO_PKG_VERSION") {
+            return DaemonResponse::Error(format!(
+                "the daemon runs pixi {} but the request was made by pixi {}",
+                env!("CARGO_PKG_VERSION"),
+                request.version
+            ));
+        }
+
+        // The activation builds on the PATH of the daemon.
+        if request.path != std::env::var("PATH").ok() {
+            return DaemonResponse::Error(String::from(
+                "the PATH of the daemon differs from the PATH of the request",
+            ));
+        }
+
+        if let Some((stamp, env)) = &self.cached {
+            if ProjectStamp::current(&self.manifest_path).as_ref() == Some(stamp) {
+                tracing::debug!("the project did not change, reusing the environment");
+                return DaemonResponse::Env(env.clone());
+            }
+        }
+
+        // Reload the project, this brings the environment up to date if required.
+        self.cached = None;
+        let env = match Project::load(&self.manifest_path) {
+            Ok(project) => get_activated_env(&project, LockFileUsage::Update).await,
+            Err(err) => Err(err),
+        };
+        match env {
+            Ok(env) => {
+                if let Some(stamp) = ProjectStamp::current(&self.manifest_path) {
+                    self.cached = Some((stamp, env.clone()));
+                }
+                DaemonResponse::Env(env)
+            }
+            Err(err) => DaemonResponse::Error(format!("{err:?}")),
+        }
+    }
+}
+
+/// Asks a running daemon of the project for the environment to run tasks in. Returns `None` if no
+/// daemon is running or it could not provide the environment, in which case the caller has to
+/// determine the environment itself.
+pub fn request_task_env(project: &Project) -> Option<HashMap<String, String>> {
+    let socket_path = project.pixi_dir().join(DAEMON_SOCKET);
+    if !socket_path.exists() {
+        return None;
+    }
+
+    match request_activated_env(&socket_path) {
+        Ok(env) => Some(std::env::vars().chain(env.into_iter()).collect()),
+        Err(err) => {
+            tracing::debug!("could not get the environment from the daemon: {err}");
+            None
+        }
+    }
+}
+
+/// Sends a [`DaemonRequest`] to the daemon listening on the given socket.
+#[cfg(unix)]
+fn request_activated_env(socket_path: &Path) -> miette::Result<HashMap<String, String>> {
+    use miette::IntoDiagnostic;
+    use std::io::{BufRead, BufReader, ErrorKind, Write};
+    use std::os::unix::net::UnixStream;
+
+    let _span = tracing::info_span!("daemon").entered();
+    let mut stream = UnixStream::connect(socket_path).into_diagnostic()?;
+    stream
+        .set_read_timeout(Some(RESPONSE_TIMEOUT))
+        .into_diagnostic()?;
+    stream
+        .set_write_timeout(Some(REQUEST_TIMEOUT))
+        .into_diagnostic()?;
+    let mut request = serde_json::to_vec(&DaemonRequest {
+        version: env!("CARGO_PKG_VERSION").to_string(),
+        path: std::env::var("PATH").ok(),
+    })
+    .into_diagnostic()?;
+    request.push(b'\n');
+    stream.write_all(&request).into_diagnostic()?;
+
+    let mut response = String::new();
+    match BufReader::new(stream).read_line(&mut response) {
+        Ok(_) => {}
+        Err(err) if matches!(err.kind(), ErrorKind::WouldBlock | ErrorKind::TimedOut) => {
+            miette::bail!(
+                "the daemon did not respond within {}s",
+                RESPONSE_TIMEOUT.as_secs()
+            )
+        }
+        Err(err) => return Err(err).into_diagnostic(),
+    }
+    match serde_json::from_str(&response).into_diagnostic()? {
+        DaemonResponse::Env(env) => Ok(env),
+        DaemonResponse::Error(err) => Err(miette::miette!("{err}")),
+    }
+}
+
+#[cfg(not(unix))]
+fn request_activated_env(_socket_path: &Path) -> miette::Result<HashMap<String, String>> {
+    miette::bail!("the daemon is only supported on unix platforms")
+}
+
+/// CLI entry point for `pixi daemon`
+#[cfg(unix)]
+pub async fn execute(args: Args) -> miette::Result<()> {
+    use miette::{Context, IntoDiagnostic};
+    use tokio::net::UnixListener;
+
+    let project = Project::load_or_else_discover(args.manifest_path.as_deref())?;
+    let socket_path = project.pixi_dir().join(DAEMON_SOCKET);
+
+    // A socket that is left behind by a daemon that was killed can be replaced.
+    if socket_path.exists() {
+        if std::os::unix::net::UnixStream::connect(&socket_path).is_ok() {
+            miette::bail!(
+                "a daemon is already running for this project ({})",
+                socket_path.display()
+            );
+        }
+        std::fs::remove_file(&socket_path).into_diagnostic()?;
+    }
+    std::fs::create_dir_all(project.pixi_dir()).into_diagnostic()?;
+    let listener = UnixListener::bind(&socket_path)
+        .into_diagnostic()
+        .wrap_err_with(|| format!("failed to listen on {}", socket_path.display()))?;
+
+    let mut state = DaemonState {
+        manifest_path: project.manifest_path(),
+        cached: None,
+    };
+
+    // Prepare the environment before the first request comes in.
+    let _ = state
+        .handle(DaemonRequest {
+            version: env!("CARGO_PKG_VERSION").to_string(),
+            path: std::env::var("PATH").ok(),
+        })
+        .await;
+
+    eprintln!(
+        "{}Listening on {}, press CTRL+C to stop",
+        console::style(console::Emoji("✔ ", "")).green(),
+        socket_path.display()
+    );
+
+    // Every connection is read and written by its own task, so a client that does not send its
+    // request can't hold up the others. The requests themselves are handled one at a time, they
+    // are cheap unless the environment has to be updated in which case concurrent requests would
+    // have to wait anyway.
+    let (request_tx, mut request_rx) = tokio::sync::mpsc::unbounded_channel();
+    let result = loop {
+        tokio::select! {
+            accepted = listener.accept() => match accepted {
+                Ok((stream, _)) => {
+                    tokio::spawn(read_request(stream, request_tx.clone()));
+                }
+                Err(err) => break Err(err).into_diagnostic(),
+            },
+            Some((request, writer)) = request_rx.recv() => {
+                let response = match request {
+                    Ok(request) => state.handle(request).await,
+                    Err(err) => DaemonResponse::Error(format!("invalid request: {err}")),
+                };
+                tokio::spawn(write_response(writer, response));
+            }
+            _ = tokio::signal::ctrl_c() => break Ok(()),
+        }
+    };
+
+    let _ = std::fs::remove_file(&socket_path);
+    result
+}
+
+/// A request read from a connection together with the half of the connection to respond on.
+#[cfg(unix)]
+type PendingRequest = (
+    Result<DaemonRequest, serde_json::Error>,
+    tokio::net::unix::OwnedWriteHalf,
+);
+
+/// Reads the request of a client and passes it on to be handled. Clients that don't send a request
+/// within [`REQUEST_TIMEOUT`] are disconnected.
+#[cfg(unix)]
+async fn read_request(
+    stream: tokio::net::UnixStream,
+    requests: tokio::sync::mpsc::UnboundedSender<PendingRequest>,
+) {
+    use tokio::io::{AsyncBufReadExt, BufReader};
+
+    let (reader, writer) = stream.into_split();
+    let mut line = String::new();
+    match tokio::time::timeout(REQUEST_TIMEOUT, BufReader::new(reader).read_line(&mut line)).await {
+        Ok(Ok(_)) => {
+            let _ = requests.send((serde_json::from_str(&line), writer));
+        }
+        Ok(Err(err)) => tracing::warn!("failed to read the request: {err}"),
+        Err(_) => tracing::warn!("the client did not send a request in time"),
+    }
+}
+
+/// Sends the response to a client, clients that don't receive it within [`REQUEST_TIMEOUT`] are
+/// disconnected.
+#[cfg(unix)]
+async fn write_response(mut writer: tokio::net::unix::OwnedWriteHalf, response: DaemonResponse) {
+    use tokio::io::AsyncWriteExt;
+
+    let mut response = match serde_json::to_vec(&response) {
+        Ok(response) => response,
+        Err(err) => {
+            tracing::warn!("failed to serialize the response: {err}");
+            return;
+        }
+    };
+    response.push(b'\n');
+    match tokio::time::timeout(REQUEST_TIMEOUT, writer.write_all(&response)).await {
+        Ok(Ok(())) => {}
+        Ok(Err(err)) => tracing::warn!("failed to write the response: {err}"),
+        Err(_) => tracing::warn!("the client did not receive the response in time"),
+    }
+}
+
+/// CLI entry point for `pixi daemon`
+#[cfg(not(unix))]
+pub async fn execute(_args: Args) -> miette::Result<()> {
+    miette::bail!("`pixi daemon` is only supported on unix platforms")
+}
+
+#[cfg(all(test, unix))]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_project_stamp() {
+        let dir = tempfile::tempdir().unwrap();
+        let manifest_path = dir.path().join(crate::consts::PROJECT_MANIFEST);
+        std::fs::write(&manifest_path, "[project]").unwrap();
+
+        // Without a lock-file and an environment there is nothing to compare.
+        assert_eq!(ProjectStamp::current(&manifest_path), None);
+
+        std::fs::write(dir.path().join(crate::consts::PROJECT_LOCK_FILE), "lock").unwrap();
+        std::fs::create_dir_all(dir.path().join(".pixi/env/conda-meta")).unwrap();
+        let stamp = ProjectStamp::current(&manifest_path).unwrap();
+        assert_eq!(ProjectStamp::current(&manifest_path).as_ref(), Some(&stamp));
+
+        // Modifying the manifest or installing a package changes the stamp
+        std::fs::write(&manifest_path, "[project]\nname = \"foo\"").unwrap();
+        let modified_stamp = ProjectStamp::current(&manifest_path).unwrap();
+        assert_ne!(modified_stamp, stamp);
+
+        std::fs::write(dir.path().join(".pixi/env/conda-meta/foo.json"), "{}").unwrap();
+        assert_ne!(
+            ProjectStamp::current(&manifest_path).unwrap(),
+            modified_stamp
+        );
+    }
+
+    #[tokio::test]
+    async fn test_read_request() {
+        use tokio::io::{AsyncReadExt, AsyncWriteExt};
+
+        // A client that does not send its request does not block the request of another client.
+        let (_silent, silent_server) = tokio::net::UnixStream::pair().unwrap();
+        let (mut client, server) = tokio::net::UnixStream::pair().unwrap();
+        let (request_tx, mut request_rx) = tokio::sync::mpsc::unbounded_channel();
+        tokio::spawn(read_request(silent_server, request_tx.clone()));
+        tokio::spawn(read_request(server, request_tx));
+
+        client
+            .write_all(b"{\"version\":\"1.0\",\"path\":null}\n")
+            .await
+            .unwrap();
+        let (request, writer) = request_rx.recv().await.unwrap();
+        assert_eq!(request.unwrap().version, "1.0");
+
+        write_response(writer, DaemonResponse::Error(String::from("error"))).await;
+        let mut response = String::new();
+        client.read_to_string(&mut response).await.unwrap();
+        assert_eq!(response, "{\"error\":\"error\"}\n");
+    }
+}
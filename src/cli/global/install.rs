@@ -1,25 +1,29 @@
 use crate::repodata::friendly_channel_name;
 use crate::{
-    environment::execute_transaction, prefix::Prefix, progress::await_in_progress,
+    environment::{execute_transaction, solve_platform},
+    network,
+    prefix::Prefix,
+    progress::await_in_progress,
     repodata::fetch_sparse_repodata,
+    virtual_packages::current_virtual_packages,
 };
 use clap::Parser;
 use dirs::home_dir;
 use itertools::Itertools;
 use miette::IntoDiagnostic;
 use rattler::install::Transaction;
-use rattler_conda_types::{Channel, ChannelConfig, MatchSpec, Platform, PrefixRecord};
-use rattler_networking::AuthenticatedClient;
-use rattler_repodata_gateway::sparse::SparseRepoData;
+use rattler_conda_types::{
+    Channel, ChannelConfig, MatchSpec, Platform, PrefixRecord, RepoDataRecord,
+};
 use rattler_shell::{
     activation::{ActivationVariables, Activator, PathModificationBehaviour},
     shell::Shell,
     shell::ShellEnum,
 };
-use rattler_solve::{libsolv_rs, SolverImpl};
 use std::{
     path::{Path, PathBuf},
     str::FromStr,
+    sync::Arc,
 };
 
 const BIN_DIR: &str = ".pixi/bin";
@@ -29,8 +33,10 @@ const BIN_ENVS_DIR: &str = ".pixi/envs";
 #[derive(Parser, Debug)]
 #[clap(arg_required_else_help = true)]
 pub struct Args {
-    /// Specifies the package that is to be installed.
-    package: String,
+    /// Specifies the packages that are to be installed. Every package is installed in its own
+    /// environment.
+    #[arg(num_args = 1..)]
+    package: Vec<String>,
 
     /// Represents the channels from which the package will be installed.
     /// Multiple channels can be specified by using this field multiple times.
@@ -89,11 +95,13 @@ async fn find_designated_package(
     prefix: &Prefix,
     package_name: &str,
 ) -> miette::Result<PrefixRecord> {
-    let prefix_records = prefix.find_installed_packages(None).await?;
-    prefix_records
+    let installed_packages = prefix.installed_packages().await?;
+    installed_packages
         .into_iter()
         .find(|r| r.repodata_record.package_record.name == package_name)
-        .ok_or_else(|| miette::miette!("could not find {} in prefix", package_name))
+        .ok_or_else(|| miette::miette!("could not find {} in prefix", package_name))?
+        .load_prefix_record(prefix)
+        .await
 }
 
 /// Create the environment activation script
@@ -198,7 +206,7 @@ async fn create_executable_scripts(
     Ok(scripts)
 }
 
-/// Install a global command
+/// Install global commands
 pub async fn execute(args: Args) -> miette::Result<()> {
     // Figure out what channels we are using
     let channel_config = ChannelConfig::default();
@@ -209,78 +217,112 @@ pub async fn execute(args: Args) -> miette::Result<()> {
         .collect::<Result<Vec<Channel>, _>>()
         .into_diagnostic()?;
 
-    // Find the MatchSpec we want to install
-    let package_matchspec = MatchSpec::from_str(&args.package).into_diagnostic()?;
-    let package_name = package_matchspec.name.clone().ok_or_else(|| {
-        miette::miette!(
-            "could not find package name in MatchSpec {}",
-            package_matchspec
-        )
-    })?;
+    // Find the MatchSpecs we want to install
+    let mut packages: Vec<(String, MatchSpec)> = Vec::with_capacity(args.package.len());
+    for package in args.package.iter() {
+        let package_matchspec = MatchSpec::from_str(package).into_diagnostic()?;
+        let package_name = package_matchspec.name.clone().ok_or_else(|| {
+            miette::miette!(
+                "could not find package name in MatchSpec {}",
+                package_matchspec
+            )
+        })?;
+        if packages.iter().any(|(name, _)| name == &package_name) {
+            miette::bail!("package {package_name} is specified more than once");
+        }
+        packages.push((package_name, package_matchspec));
+    }
     let platform = Platform::current();
 
-    // Fetch sparse repodata
-    let platform_sparse_repodata = fetch_sparse_repodata(&channels, &[platform]).await?;
-
-    let available_packages = SparseRepoData::load_records_recursive(
-        platform_sparse_repodata.iter(),
-        vec![package_name.clone()],
-        None,
-    )
-    .into_diagnostic()?;
-
-    // Solve for environment
-    // Construct a solver task that we can start solving.
-    let task = rattler_solve::SolverTask {
-        specs: vec![package_matchspec],
-        available_packages: &available_packages,
-
-        virtual_packages: rattler_virtual_packages::VirtualPackage::current()
-            .into_diagnostic()?
-            .iter()
-            .cloned()
-            .map(Into::into)
-            .collect(),
-
-        locked_packages: vec![],
-        pinned_packages: vec![],
-    };
+    // Fetch sparse repodata once for all packages
+    let platform_sparse_repodata = Arc::new(fetch_sparse_repodata(&channels, &[platform]).await?);
+
+    let virtual_packages = current_virtual_packages()?;
+
+    // Solve the environments of all packages at the same time. Loading the records and solving
+    // are both blocking operations so each package is solved on a separate blocking thread.
+    let solve_handles = packages
+        .iter()
+        .map(|(package_name, package_matchspec)| {
+            let sparse_repo_data = platform_sparse_repodata.clone();
+            let match_specs = vec![package_matchspec.clone()];
+            let package_names = vec![package_name.clone()];
+            let virtual_packages = virtual_packages.clone();
+            tokio::task::spawn_blocking(move || {
+                solve_platform(
+                    platform,
+                    sparse_repo_data.iter(),
+                    match_specs,
+                    package_names,
+                    virtual_packages,
+                    vec![],
+                )
+            })
+        })
+        .collect_vec();
+
+    let mut solutions = Vec::with_capacity(solve_handles.len());
+    for handle in solve_handles {
+        let records = match handle.await {
+            Ok(result) => result?,
+            Err(err) => {
+                if let Ok(panic) = err.try_into_panic() {
+                    std::panic::resume_unwind(panic);
+                }
+                miette::bail!("solving was cancelled");
+            }
+        };
+        solutions.push(records);
+    }
 
-    // Solve it
-    let records = libsolv_rs::Solver.solve(task).into_diagnostic()?;
+    // Install the environments one after the other. Packages shared by multiple environments are
+    // only downloaded once into the package cache and every environment hardlinks them from there.
+    for ((package_name, _), records) in packages.into_iter().zip(solutions) {
+        install_package(&channel_config, &package_name, records, platform).await?;
+    }
 
+    Ok(())
+}
+
+/// Installs the solved environment of a single global package and creates the scripts for the
+/// executables of the package.
+async fn install_package(
+    channel_config: &ChannelConfig,
+    package_name: &str,
+    records: Vec<RepoDataRecord>,
+    platform: Platform,
+) -> miette::Result<()> {
     // Create the binary environment prefix where we install or update the package
-    let bin_prefix = BinEnvDir::create(&package_name).await?;
+    let bin_prefix = BinEnvDir::create(package_name).await?;
     let prefix = Prefix::new(bin_prefix.0)?;
-    let prefix_records = prefix.find_installed_packages(None).await?;
+    let installed_packages = prefix.installed_packages().await?;
 
     // Create the transaction that we need
     let transaction =
-        Transaction::from_current_and_desired(prefix_records, records.iter().cloned(), platform)
+        Transaction::from_current_and_desired(installed_packages, records.into_iter(), platform)
             .into_diagnostic()?;
 
     // Execute the transaction if there is work to do
     if !transaction.operations.is_empty() {
         // Execute the operations that are returned by the solver.
         await_in_progress(
-            "creating virtual environment",
+            format!("creating virtual environment for {package_name}"),
             execute_transaction(
                 transaction,
                 prefix.root().to_path_buf(),
                 rattler::default_cache_dir()
                     .map_err(|_| miette::miette!("could not determine default cache directory"))?,
-                AuthenticatedClient::default(),
+                network::authenticated_client(),
             ),
         )
         .await?;
     }
 
     // Find the installed package in the environment
-    let prefix_package = find_designated_package(&prefix, &package_name).await?;
-    let channel = Channel::from_str(&prefix_package.repodata_record.channel, &channel_config)
+    let prefix_package = find_designated_package(&prefix, package_name).await?;
+    let channel = Channel::from_str(&prefix_package.repodata_record.channel, channel_config)
         .map(|ch| friendly_channel_name(&ch))
         .unwrap_or_else(|_| prefix_package.repodata_record.channel.clone());
-
     // Determine the shell to use for the invocation script
     let shell: ShellEnum = if cfg!(windows) {
         rattler_shell::shell::CmdExe.into()
@@ -3,11 +3,11 @@ use std::{fmt::Display, path::PathBuf};
 use clap::Parser;
 use miette::IntoDiagnostic;
 use rattler_conda_types::{GenericVirtualPackage, Platform};
-use rattler_virtual_packages::VirtualPackage;
 use serde::Serialize;
 use serde_with::serde_as;
 use serde_with::DisplayFromStr;
 
+use crate::virtual_packages::current_virtual_packages;
 use crate::Project;
 
 #[derive(Parser, Debug)]
@@ -86,12 +86,7 @@ pub async fn execute(args: Args) -> miette::Result<()> {
         tasks: p.manifest.tasks.keys().cloned().collect(),
     });
 
-    let virtual_packages = VirtualPackage::current()
-        .into_diagnostic()?
-        .iter()
-        .cloned()
-        .map(GenericVirtualPackage::from)
-        .collect::<Vec<_>>();
+    let virtual_packages = current_virtual_packages()?;
 
     let info = Info {
         platform: Platform::current().to_string(),
@@ -1,5 +1,8 @@
-use crate::environment::get_up_to_date_prefix;
-use crate::Project;
+use crate::environment::{
+    export_bundle, get_up_to_date_prefix, import_bundle, load_lock_file, prefetch_packages,
+    LockFileUsage,
+};
+use crate::{network, Project};
 use clap::Parser;
 use std::path::PathBuf;
 
@@ -9,12 +12,64 @@ pub struct Args {
     /// The path to 'pixi.toml'
     #[arg(long)]
     pub manifest_path: Option<PathBuf>,
+
+    /// Install the environment exactly as specified in the lock-file, without checking whether the
+    /// lock-file is up to date with the manifest and without updating it.
+    #[arg(long)]
+    pub frozen: bool,
+
+    /// Also download the packages of all platforms in the lock-file into the package cache
+    #[arg(long)]
+    pub prefetch: bool,
+
+    /// Fill the package cache with the packages in a bundle before installing
+    #[arg(long, value_name = "FILE")]
+    pub import_bundle: Option<PathBuf>,
+
+    /// Write the packages of all platforms in the lock-file to a bundle after installing
+    #[arg(long, value_name = "FILE")]
+    pub export_bundle: Option<PathBuf>,
 }
 
 pub async fn execute(args: Args) -> miette::Result<()> {
     let project = Project::load_or_else_discover(args.manifest_path.as_deref())?;
+    let cache_dir = rattler::default_cache_dir()
+        .map_err(|_| miette::miette!("could not determine default cache directory"))?;
+
+    if let Some(bundle_path) = &args.import_bundle {
+        let count = import_bundle(bundle_path, cache_dir.clone()).await?;
+        eprintln!(
+            "{}Imported {count} packages from {}",
+            console::style(console::Emoji("✔ ", "")).green(),
+            bundle_path.display()
+        );
+    }
+
+    let usage = LockFileUsage::from_frozen(args.frozen);
+    get_up_to_date_prefix(&project, usage).await?;
 
-    get_up_to_date_prefix(&project).await?;
+    // The lock-file contains the packages of all platforms.
+    if args.prefetch || args.export_bundle.is_some() {
+        let lock_file = load_lock_file(&project).await?;
+        if args.prefetch {
+            let count =
+                prefetch_packages(&lock_file, cache_dir, network::authenticated_client()).await?;
+            eprintln!(
+                "{}Prefetched {count} packages for {} platforms",
+                console::style(console::Emoji("✔ ", "")).green(),
+                lock_file.metadata.platforms.len()
+            );
+        }
+        if let Some(bundle_path) = &args.export_bundle {
+            let count =
+                export_bundle(&lock_file, bundle_path, network::authenticated_client()).await?;
+            eprintln!(
+                "{}Exported {count} packages to {}",
+                console::style(console::Emoji("✔ ", "")).green(),
+                bundle_path.display()
+            );
+        }
+    }
 
     // Emit success
     eprintln!(
@@ -4,11 +4,15 @@ use clap_complete::Shell;
 use clap_verbosity_flag::Verbosity;
 use miette::IntoDiagnostic;
 
-use crate::progress;
-use tracing_subscriber::{filter::LevelFilter, util::SubscriberInitExt, EnvFilter};
+use crate::{progress, timings, virtual_packages};
+use std::path::PathBuf;
+use tracing_subscriber::{
+    filter::LevelFilter, layer::SubscriberExt, util::SubscriberInitExt, EnvFilter, Layer,
+};
 
 pub mod add;
 pub mod auth;
+pub mod daemon;
 pub mod global;
 pub mod info;
 pub mod init;
@@ -28,6 +32,15 @@ struct Args {
     /// (-v for verbose, -vv for debug, -vvv for trace, -q for quiet)
     #[command(flatten)]
     verbose: Verbosity,
+
+    /// Record how long every phase of the command takes. Without a file a summary is printed when
+    /// the command finishes, otherwise a Chrome trace is written to the file.
+    #[arg(long, global = true, value_name = "FILE", num_args = 0..=1, require_equals = true)]
+    timings: Option<Option<PathBuf>>,
+
+    /// Detect the virtual packages of the system again instead of using the cached ones.
+    #[arg(long, global = true)]
+    refresh_virtual_packages: bool,
 }
 
 /// Generates a completion script for a shell.
@@ -55,6 +68,7 @@ pub enum Command {
     Install(install::Args),
     Task(task::Args),
     Info(info::Args),
+    Daemon(daemon::Args),
 }
 
 fn completion(args: CompletionCommand) -> miette::Result<()> {
@@ -87,17 +101,35 @@ pub async fn execute() -> miette::Result<()> {
         // filter logs from apple codesign because they are very noisy
         .add_directive("apple_codesign=off".parse().into_diagnostic()?);
 
+    // Record the timings of all spans if requested
+    let timings_layer = args.timings.map(|file| {
+        let output = match file {
+            Some(path) => timings::TimingsOutput::ChromeTrace(path),
+            None => timings::TimingsOutput::Summary,
+        };
+        timings::init(output).with_filter(LevelFilter::DEBUG)
+    });
+
     // Setup the tracing subscriber
-    tracing_subscriber::fmt()
-        .with_env_filter(env_filter)
-        .with_writer(IndicatifWriter::new(progress::global_multi_progress()))
-        .without_time()
-        .finish()
+    tracing_subscriber::registry()
+        .with(
+            tracing_subscriber::fmt::layer()
+                .with_writer(IndicatifWriter::new(progress::global_multi_progress()))
+                .without_time()
+                .with_filter(env_filter),
+        )
+        .with(timings_layer)
         .try_init()
         .into_diagnostic()?;
 
+    if args.refresh_virtual_packages {
+        virtual_packages::clear_virtual_packages_cache()?;
+    }
+
     // Execute the command
-    execute_command(args.command).await
+    let result = execute_command(args.command).await;
+    timings::finish()?;
+    result
 }
 
 /// Execute the actual command
@@ -113,5 +145,6 @@ pub async fn execute_command(command: Command) -> miette::Result<()> {
         Command::Shell(cmd) => shell::execute(cmd).await,
         Command::Task(cmd) => task::execute(cmd),
         Command::Info(cmd) => info::execute(cmd).await,
+        Command::Daemon(cmd) => daemon::execute(cmd).await,
     }
 }
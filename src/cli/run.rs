@@ -1,25 +1,40 @@
-use std::collections::{HashMap, HashSet, VecDeque};
-use std::path::PathBuf;
+use std::collections::{BTreeSet, HashMap, VecDeque};
+use std::fmt::Write as _;
+use std::io::{self, Write};
+use std::num::NonZeroUsize;
+use std::path::{Path, PathBuf};
 use std::string::String;
+use std::time::Duration;
 
 use clap::Parser;
 use deno_task_shell::parser::SequentialList;
-use deno_task_shell::{execute_with_pipes, get_output_writer_and_handle, pipe, ShellState};
+use deno_task_shell::{execute_with_pipes, pipe, ShellPipeReader, ShellState};
+use futures::stream::FuturesUnordered;
+use futures::{FutureExt, StreamExt};
 use itertools::Itertools;
 use miette::{miette, Context, IntoDiagnostic};
 use rattler_conda_types::Platform;
+use rattler_digest::{compute_bytes_digest, compute_file_digest, Sha256};
+use serde::{Deserialize, Serialize};
 
+use crate::config::NO_JOBSERVER_ENV;
 use crate::prefix::Prefix;
 use crate::progress::await_in_progress;
-use crate::project::environment::get_metadata_env;
-use crate::task::{CmdArgs, Execute, Task};
-use crate::{environment::get_up_to_date_prefix, Project};
+use crate::project::environment::{get_compiler_cache_env, get_metadata_env};
+use crate::task::{
+    fingerprint_env, has_inputs, terminate_child_processes, CmdArgs, Execute, InputsSnapshot,
+    JobSlots, Jobserver, Task, TaskCache, TaskGraph, TaskId, TaskNode,
+};
+use crate::{
+    environment::{get_up_to_date_prefix, LockFileUsage},
+    Project,
+};
 use rattler_shell::{
     activation::{ActivationVariables, Activator, PathModificationBehaviour},
     shell::ShellEnum,
 };
 
-/// Runs task in project.
+/// The exit code and the output of a script executed with [`execute_script_with_output`].
 #[derive(Default)]
 pub struct RunOutput {
     pub exit_code: i32,
@@ -37,84 +52,56 @@ pub struct Args {
     /// The path to 'pixi.toml'
     #[arg(long)]
     pub manifest_path: Option<PathBuf>,
-}
-
-pub fn order_tasks(
-    tasks: Vec<String>,
-    project: &Project,
-) -> miette::Result<VecDeque<(Task, Vec<String>)>> {
-    let tasks: Vec<_> = tasks.iter().map(|c| c.to_string()).collect();
-
-    // Find the command in the project.
-    let (task_name, task, additional_args) = tasks
-        .first()
-        .and_then(|cmd_name| {
-            project.task_opt(cmd_name).map(|cmd| {
-                (
-                    Some(cmd_name.clone()),
-                    cmd.clone(),
-                    tasks[1..].iter().cloned().collect_vec(),
-                )
-            })
-        })
-        .unwrap_or_else(|| {
-            (
-                None,
-                Task::Execute(Execute {
-                    cmd: CmdArgs::Multiple(tasks),
-                    depends_on: vec![],
-                }),
-                Vec::new(),
-            )
-        });
-
-    // Perform post order traversal of the tasks and their `depends_on` to make sure they are
-    // executed in the right order.
-    let mut s1 = VecDeque::new();
-    let mut s2 = VecDeque::new();
-    let mut added = HashSet::new();
 
-    // Add the command specified on the command line first
-    s1.push_back((task, additional_args));
-    if let Some(task_name) = task_name {
-        added.insert(task_name);
-    }
+    /// The maximum number of tasks to run at the same time. Tasks that do not depend on each other
+    /// are executed concurrently. Defaults to the number of available CPU cores.
+    #[arg(short = 'j', long)]
+    pub jobs: Option<usize>,
 
-    while let Some((task, additional_args)) = s1.pop_back() {
-        // Get the dependencies of the command
-        let depends_on = match &task {
-            Task::Execute(process) => process.depends_on.as_slice(),
-            Task::Alias(alias) => &alias.depends_on,
-            _ => &[],
-        };
-
-        // Locate the dependencies in the project and add them to the stack
-        for dependency in depends_on.iter() {
-            if !added.contains(dependency) {
-                let cmd = project
-                    .task_opt(dependency)
-                    .ok_or_else(|| miette::miette!("failed to find dependency {}", dependency))?
-                    .clone();
+    /// Keep running and execute the tasks again when their `inputs` change. Only the tasks whose
+    /// inputs changed and the tasks that depend on them are executed again.
+    #[arg(long)]
+    pub watch: bool,
 
-                s1.push_back((cmd, Vec::new()));
-                added.insert(dependency.clone());
-            }
-        }
+    /// Install the environment exactly as specified in the lock-file, without checking whether the
+    /// lock-file is up to date with the manifest and without updating it.
+    #[arg(long)]
+    pub frozen: bool,
+}
 
-        s2.push_back((task, additional_args))
+impl Args {
+    /// Returns how the lock-file is used to bring the environment up to date.
+    pub fn lock_file_usage(&self) -> LockFileUsage {
+        LockFileUsage::from_frozen(self.frozen)
     }
+}
 
-    Ok(s2)
+/// Returns the tasks to run for the given command line arguments together with the additional
+/// arguments to pass to them. The tasks are returned in reverse order: popping from the back yields
+/// every task after all of the tasks it depends on.
+pub fn order_tasks(
+    tasks: Vec<String>,
+    project: &Project,
+) -> miette::Result<VecDeque<(Task, Vec<String>)>> {
+    let graph = TaskGraph::from_cmd_args(project, tasks)?;
+    Ok(graph
+        .topological_order()?
+        .into_iter()
+        .rev()
+        .map(|id| (graph[id].task.clone(), graph[id].additional_args.clone()))
+        .collect())
 }
 
-pub async fn create_script(task: Task, args: Vec<String>) -> miette::Result<SequentialList> {
+/// Returns the source of the shell script that executes the task with the given additional command
+/// line arguments.
+fn script_source(task: &Task, args: &[String]) -> miette::Result<String> {
     // Construct the script from the task
     let task = match task {
         Task::Execute(Execute {
             cmd: CmdArgs::Single(cmd),
             ..
         })
-        | Task::Plain(cmd) => cmd,
+        | Task::Plain(cmd) => cmd.clone(),
         Task::Execute(Execute {
             cmd: CmdArgs::Multiple(args),
             ..
@@ -126,10 +113,14 @@ pub async fn create_script(task: Task, args: Vec<String>) -> miette::Result<Sequ
 
     // Append the command line arguments
     let cli_args = quote_arguments(args);
-    let full_script = format!("{task} {cli_args}");
+    Ok(format!("{task} {cli_args}").trim().to_string())
+}
+
+pub async fn create_script(task: Task, args: Vec<String>) -> miette::Result<SequentialList> {
+    let full_script = script_source(&task, &args)?;
 
     // Parse the shell command
-    deno_task_shell::parser::parse(full_script.trim()).map_err(|e| miette!("{e}"))
+    deno_task_shell::parser::parse(&full_script).map_err(|e| miette!("{e}"))
 }
 
 /// Executes the given command withing the specified project and with the given environment.
@@ -148,6 +139,8 @@ pub async fn execute_script(
     .await)
 }
 
+/// Executes the script and returns everything it wrote to stdout and stderr. This buffers all the
+/// output in memory, use [`execute_script_with_writers`] for scripts that produce a lot of output.
 pub async fn execute_script_with_output(
     script: SequentialList,
     project: &Project,
@@ -159,14 +152,148 @@ pub async fn execute_script_with_output(
         stdin_writer.write_all(stdin).unwrap();
     }
     drop(stdin_writer); // prevent a deadlock by dropping the writer
-    let (stdout, stdout_handle) = get_output_writer_and_handle();
-    let (stderr, stderr_handle) = get_output_writer_and_handle();
-    let state = ShellState::new(command_env.clone(), project.root(), Default::default());
-    let code = execute_with_pipes(script, state, stdin, stdout, stderr).await;
+    let (exit_code, stdout, stderr) =
+        execute_script_with_writers(script, project, command_env, stdin, Vec::new(), Vec::new())
+            .await
+            .expect("failed to capture the output of the script");
     RunOutput {
-        exit_code: code,
-        stdout: stdout_handle.await.unwrap(),
-        stderr: stderr_handle.await.unwrap(),
+        exit_code,
+        stdout: String::from_utf8_lossy(&stdout).into_owned(),
+        stderr: String::from_utf8_lossy(&stderr).into_owned(),
+    }
+}
+
+/// Executes the script and forwards everything it writes to stdout and stderr to the given writers
+/// while it runs. The output passes through pipes with a fixed capacity so it is never buffered
+/// completely in memory; the script blocks while the writers cannot keep up. Returns the exit code
+/// of the script together with the writers.
+///
+/// Combine the writers with [`PrefixedLineWriter`] and [`TeeWriter`] to prefix the output or to
+/// also write it to a file.
+pub async fn execute_script_with_writers<O, E>(
+    script: SequentialList,
+    project: &Project,
+    command_env: &HashMap<String, String>,
+    stdin: ShellPipeReader,
+    stdout: O,
+    stderr: E,
+) -> miette::Result<(i32, O, E)>
+where
+    O: Write + Send + 'static,
+    E: Write + Send + 'static,
+{
+    let (stdout_reader, stdout_writer) = pipe();
+    let (stderr_reader, stderr_writer) = pipe();
+
+    // Forward the output of the script on background threads.
+    let stdout_handle = forward_output(stdout_reader, stdout);
+    let stderr_handle = forward_output(stderr_reader, stderr);
+
+    let state = ShellState::new(command_env.clone(), project.root(), Default::default());
+    let code = execute_with_pipes(script, state, stdin, stdout_writer, stderr_writer).await;
+
+    let stdout = stdout_handle.await.into_diagnostic()??;
+    let stderr = stderr_handle.await.into_diagnostic()??;
+    Ok((code, stdout, stderr))
+}
+
+/// Copies everything from the reader to the writer on a blocking thread until the reader is closed
+/// and returns the writer.
+fn forward_output<W: Write + Send + 'static>(
+    reader: ShellPipeReader,
+    mut writer: W,
+) -> tokio::task::JoinHandle<miette::Result<W>> {
+    tokio::task::spawn_blocking(move || {
+        reader
+            .pipe_to(&mut writer)
+            .map_err(|e| miette!("{e}"))
+            .wrap_err("failed to forward the output of the script")?;
+        writer.flush().into_diagnostic()?;
+        Ok(writer)
+    })
+}
+
+/// A [`Write`] implementation that prefixes every line that is written to it. Complete lines are
+/// written to the inner writer in a single call so output of concurrent writers does not interleave
+/// within a line. Call [`PrefixedLineWriter::finish`] to write a trailing incomplete line.
+pub struct PrefixedLineWriter<W: Write> {
+    prefix: String,
+    inner: W,
+    buffer: Vec<u8>,
+}
+
+impl<W: Write> PrefixedLineWriter<W> {
+    pub fn new(prefix: String, inner: W) -> Self {
+        Self {
+            prefix,
+            inner,
+            buffer: Vec::new(),
+        }
+    }
+
+    /// Writes any remaining incomplete line to the inner writer.
+    pub fn finish(mut self) -> io::Result<()> {
+        if !self.buffer.is_empty() {
+            self.buffer.push(b'\n');
+            self.write_line(self.buffer.len())?;
+        }
+        self.inner.flush()
+    }
+
+    /// Writes the first `len` bytes of the buffer to the inner writer, prefixed with the prefix.
+    fn write_line(&mut self, len: usize) -> io::Result<()> {
+        let mut line = Vec::with_capacity(self.prefix.len() + len);
+        line.extend_from_slice(self.prefix.as_bytes());
+        line.extend(self.buffer.drain(..len));
+        self.inner.write_all(&line)
+    }
+}
+
+impl<W: Write> Write for PrefixedLineWriter<W> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let start = self.buffer.len();
+        self.buffer.extend_from_slice(buf);
+        let mut searched = start;
+        while let Some(pos) = self.buffer[searched..].iter().position(|&b| b == b'\n') {
+            self.write_line(searched + pos + 1)?;
+            searched = 0;
+        }
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.inner.flush()
+    }
+}
+
+/// A [`Write`] implementation that writes everything to two writers, e.g. to the terminal and to a
+/// log file.
+pub struct TeeWriter<A: Write, B: Write> {
+    first: A,
+    second: B,
+}
+
+impl<A: Write, B: Write> TeeWriter<A, B> {
+    pub fn new(first: A, second: B) -> Self {
+        Self { first, second }
+    }
+
+    /// Returns the two writers.
+    pub fn into_inner(self) -> (A, B) {
+        (self.first, self.second)
+    }
+}
+
+impl<A: Write, B: Write> Write for TeeWriter<A, B> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        self.first.write_all(buf)?;
+        self.second.write_all(buf)?;
+        Ok(buf.len())
+    }
+
+    fn flush(&mut self) -> io::Result<()> {
+        self.first.flush()?;
+        self.second.flush()
     }
 }
 
@@ -178,35 +305,435 @@ fn quote_arguments(args: impl IntoIterator<Item = impl AsRef<str>>) -> String {
         .join(" ")
 }
 
+/// Executes the given script and prefixes every line it writes to stdout and stderr with `prefix`.
+/// This is used when multiple tasks run concurrently to be able to tell their output apart.
+async fn execute_script_with_prefix(
+    script: SequentialList,
+    project: &Project,
+    command_env: &HashMap<String, String>,
+    prefix: String,
+) -> miette::Result<i32> {
+    let (code, stdout, stderr) = execute_script_with_writers(
+        script,
+        project,
+        command_env,
+        ShellPipeReader::stdin(),
+        PrefixedLineWriter::new(prefix.clone(), io::stdout()),
+        PrefixedLineWriter::new(prefix, io::stderr()),
+    )
+    .await?;
+
+    for writer in [stdout.finish(), stderr.finish()] {
+        writer
+            .into_diagnostic()
+            .wrap_err("failed to forward the output of the task")?;
+    }
+
+    Ok(code)
+}
+
+/// Executes a single task of a [`TaskGraph`]. If a prefix is specified every line of output of the
+/// task is prefixed with it. Tasks that define `inputs` or `outputs` are skipped if nothing changed
+/// since they last ran successfully. The task runs in `execution_env`, only the variables in
+/// `fingerprint_env` are part of the fingerprint of the task (see [`fingerprint_env`]).
+#[tracing::instrument(name = "task", skip_all, fields(task = %node.display_name()))]
+async fn execute_task(
+    node: &TaskNode,
+    project: &Project,
+    fingerprint_env: &HashMap<String, String>,
+    execution_env: &HashMap<String, String>,
+    prefix: Option<String>,
+) -> miette::Result<i32> {
+    // An alias only has dependencies, there is nothing to execute.
+    if matches!(node.task, Task::Alias(_)) {
+        return Ok(0);
+    }
+
+    let source = script_source(&node.task, &node.additional_args)?;
+
+    // Check if the task has to run at all.
+    let fingerprint = match (&node.name, &node.task) {
+        (Some(name), Task::Execute(execute)) if execute.is_cacheable() => {
+            let cache = TaskCache::new(project);
+            let (name, execute, source, env) = (
+                name.clone(),
+                execute.clone(),
+                source.clone(),
+                fingerprint_env.clone(),
+            );
+            let (cache, name, execute, inputs_hash, up_to_date) =
+                tokio::task::spawn_blocking(move || {
+                    let inputs_hash = cache.hash_inputs(&execute, &source, &env)?;
+                    let up_to_date = cache.is_up_to_date(&name, &execute, &inputs_hash);
+                    Ok::<_, miette::Report>((cache, name, execute, inputs_hash, up_to_date))
+                })
+                .await
+                .into_diagnostic()??;
+
+            if up_to_date {
+                eprintln!(
+                    "{}Task {} is up-to-date, skipping",
+                    console::style(console::Emoji("✔ ", "")).green(),
+                    console::style(&name).bold()
+                );
+                return Ok(0);
+            }
+
+            Some((cache, name, execute, inputs_hash))
+        }
+        _ => None,
+    };
+
+    let script = deno_task_shell::parser::parse(&source).map_err(|e| miette!("{e}"))?;
+    let code = match prefix {
+        Some(prefix) => execute_script_with_prefix(script, project, execution_env, prefix).await?,
+        None => execute_script(script, project, execution_env).await?,
+    };
+
+    // Remember the state of the task so it can be skipped next time.
+    if code == 0 {
+        if let Some((cache, name, execute, inputs_hash)) = fingerprint {
+            tokio::task::spawn_blocking(move || cache.store(&name, &execute, inputs_hash))
+                .await
+                .into_diagnostic()??;
+        }
+    }
+
+    Ok(code)
+}
+
+/// The interval at which a task that is waiting for job slots checks the jobserver for tokens that
+/// were returned by other processes.
+const JOBSERVER_POLL_INTERVAL: Duration = Duration::from_millis(10);
+
+/// Executes all tasks in the graph. A task is started as soon as all the tasks it depends on have
+/// finished and enough of the `jobs` job slots are free, see [`Task::weight`]. Tasks are started in
+/// order, a task that waits for slots is not overtaken by tasks that need fewer slots. When a task
+/// fails no new tasks are started, the tasks that are already running are allowed to finish and the
+/// exit code of the first failing task is returned.
+///
+/// The tasks share their job slots with the tools they run through a make compatible
+/// [`Jobserver`] when more than one task can run at a time, unless it is disabled with
+/// [`NO_JOBSERVER_ENV`]. Tasks run in `command_env`, except for the tasks that do not require the
+/// environment of the project, those run with the environment variables of the system.
+pub async fn execute_task_graph(
+    graph: &TaskGraph,
+    project: &Project,
+    command_env: &HashMap<String, String>,
+    jobs: usize,
+) -> miette::Result<i32> {
+    let (exit_code, _) = execute_task_graph_with_results(graph, project, command_env, jobs).await?;
+    Ok(exit_code)
+}
+
+/// Like [`execute_task_graph`] but also returns the ids of the tasks that finished successfully.
+async fn execute_task_graph_with_results(
+    graph: &TaskGraph,
+    project: &Project,
+    command_env: &HashMap<String, String>,
+    jobs: usize,
+) -> miette::Result<(i32, BTreeSet<TaskId>)> {
+    let jobs = jobs.max(1);
+
+    // Whether multiple tasks can actually run at the same time, only then the output is prefixed.
+    let parallel = jobs > 1 && !graph.is_sequential();
+
+    // The jobserver is only needed to share the slots between tasks that run at the same time, the
+    // environment of tasks that run one after another is left alone.
+    let jobserver = match std::env::var(NO_JOBSERVER_ENV).as_deref() {
+        _ if !parallel => None,
+        Ok(value) if !value.is_empty() && value != "0" => None,
+        _ => Jobserver::new(jobs)
+            .map_err(|err| tracing::debug!("failed to create a jobserver: {err}"))
+            .ok(),
+    };
+    let system_env = std::env::vars().collect::<HashMap<_, _>>();
+    let project_fingerprint_env = fingerprint_env(command_env, &system_env);
+    let system_fingerprint_env = HashMap::new();
+    let [project_execution_env, system_execution_env] =
+        [command_env, &system_env].map(|env| match &jobserver {
+            Some(jobserver) => jobserver.extend_env(env),
+            None => env.clone(),
+        });
+    let mut slots = JobSlots::new(jobs, jobserver);
+
+    // Keep track of how many dependencies have to finish before a task can start.
+    let dependents = graph.dependents();
+    let mut remaining = graph
+        .nodes()
+        .iter()
+        .map(|node| node.dependencies.len())
+        .collect_vec();
+    let mut ready_tasks = graph
+        .topological_order()?
+        .into_iter()
+        .filter(|&id| remaining[id] == 0)
+        .collect::<VecDeque<_>>();
+
+    let mut running = FuturesUnordered::new();
+    let mut exit_code = 0;
+    let mut succeeded = BTreeSet::new();
+    loop {
+        // Start as many tasks as we are allowed to, unless a task already failed.
+        let mut waiting_for_slots = false;
+        while exit_code == 0 {
+            let Some(&id) = ready_tasks.front() else {
+                break;
+            };
+
+            let node = &graph[id];
+            let weight = node.task.weight(jobs);
+            if !slots.try_occupy(weight).into_diagnostic()? {
+                waiting_for_slots = true;
+                break;
+            }
+            ready_tasks.pop_front();
+
+            let prefix = parallel.then(|| {
+                format!(
+                    "{} ",
+                    console::style(format!("[{}]", node.display_name())).cyan()
+                )
+            });
+            let (env, execution_env) = if node.task.requires_environment() {
+                (&project_fingerprint_env, &project_execution_env)
+            } else {
+                (&system_fingerprint_env, &system_execution_env)
+            };
+            running.push(
+                execute_task(node, project, env, execution_env, prefix)
+                    .map(move |result| (id, weight, result)),
+            );
+        }
+
+        // Hand the tokens the running tasks don't need to the tools they run, unless the tokens
+        // are collected for the next task.
+        if !waiting_for_slots {
+            slots.release_unused().into_diagnostic()?;
+        }
+
+        // Wait for the next task to finish. Tokens of the jobserver can also be returned by other
+        // processes, in that case the jobserver has to be checked again regularly.
+        let finished = if waiting_for_slots && slots.jobserver().is_some() {
+            tokio::select! {
+                finished = running.next(), if !running.is_empty() => finished,
+                _ = tokio::time::sleep(JOBSERVER_POLL_INTERVAL) => continue,
+            }
+        } else {
+            running.next().await
+        };
+        let Some((id, weight, result)) = finished else {
+            break;
+        };
+        slots.free(weight);
+
+        let code = result?;
+        if code != 0 {
+            if exit_code == 0 {
+                exit_code = code;
+            }
+            continue;
+        }
+        succeeded.insert(id);
+
+        // Schedule all the tasks that were waiting for this task.
+        for &dependent in dependents[id].iter() {
+            remaining[dependent] -= 1;
+            if remaining[dependent] == 0 {
+                ready_tasks.push_back(dependent);
+            }
+        }
+    }
+
+    Ok((exit_code, succeeded))
+}
+
+/// The interval at which the inputs of the tasks are checked for changes in watch mode.
+const WATCH_POLL_INTERVAL: Duration = Duration::from_millis(200);
+
+/// The time the inputs have to remain unchanged before the tasks are executed again, so a burst of
+/// changes, e.g. from saving multiple files, only triggers a single execution.
+const WATCH_DEBOUNCE: Duration = Duration::from_millis(100);
+
+/// Executes the tasks in the graph and executes them again whenever their inputs change. The
+/// environment is determined once and reused for every execution. When inputs change while tasks
+/// are still running, the running tasks are cancelled, their processes are terminated and the
+/// affected tasks start over.
+async fn watch_task_graph(
+    graph: &TaskGraph,
+    project: &Project,
+    command_env: &HashMap<String, String>,
+    jobs: usize,
+) -> miette::Result<()> {
+    if !has_inputs(graph) {
+        miette::bail!("none of the tasks define `inputs`, there is nothing to watch");
+    }
+
+    let mut snapshot = snapshot_inputs(project, graph).await?;
+
+    // The ids of the tasks that still have to be executed. After an execution finished they are
+    // only executed again once the inputs changed.
+    let mut pending: BTreeSet<TaskId> = (0..graph.len()).collect();
+    let mut executed = false;
+    loop {
+        let changed = if pending.is_empty() || executed {
+            wait_for_changes(&mut snapshot, project, graph).await?
+        } else {
+            let tasks = graph.subgraph(&pending);
+            let changed = tokio::select! {
+                result = execute_task_graph_with_results(&tasks, project, command_env, jobs) => {
+                    let (code, succeeded) = result?;
+                    if code == 0 {
+                        eprintln!(
+                            "{}Waiting for changes",
+                            console::style(console::Emoji("✔ ", "")).green()
+                        );
+                    } else {
+                        eprintln!(
+                            "{}A task failed, waiting for changes",
+                            console::style(console::Emoji("❌ ", "")).red()
+                        );
+                    }
+                    pending = unfinished_tasks(&pending, &succeeded);
+                    executed = true;
+                    continue;
+                },
+                changed = wait_for_changes(&mut snapshot, project, graph) => {
+                    eprintln!(
+                        "{}Inputs changed, restarting",
+                        console::style(console::Emoji("↻ ", "")).yellow()
+                    );
+                    changed
+                }
+            };
+
+            // The cancelled tasks leave their processes behind.
+            terminate_child_processes().await;
+            changed?
+        };
+
+        // Execute the tasks whose inputs changed and the tasks that depend on them. Tasks of a
+        // cancelled or failed execution stay pending, the ones that already finished are skipped if
+        // their fingerprint did not change.
+        pending.extend(graph.with_dependents(changed));
+        executed = false;
+    }
+}
+
+/// Returns the tasks in `pending` that did not finish successfully, given the ids of the tasks in
+/// the [`TaskGraph::subgraph`] of `pending` that did. These are the tasks that failed and the tasks
+/// that were not started because another task failed.
+fn unfinished_tasks(pending: &BTreeSet<TaskId>, succeeded: &BTreeSet<TaskId>) -> BTreeSet<TaskId> {
+    pending
+        .iter()
+        .enumerate()
+        .filter(|(subgraph_id, _)| !succeeded.contains(subgraph_id))
+        .map(|(_, &id)| id)
+        .collect()
+}
+
+/// Records the state of the inputs of the tasks in the graph.
+async fn snapshot_inputs(project: &Project, graph: &TaskGraph) -> miette::Result<InputsSnapshot> {
+    let root = project.root().to_path_buf();
+    let graph = graph.clone();
+    tokio::task::spawn_blocking(move || InputsSnapshot::new(&root, &graph))
+        .await
+        .into_diagnostic()?
+}
+
+/// Waits until the inputs of tasks in the graph changed and returns the ids of those tasks. The
+/// snapshot is only updated once the changes have settled.
+async fn wait_for_changes(
+    snapshot: &mut InputsSnapshot,
+    project: &Project,
+    graph: &TaskGraph,
+) -> miette::Result<Vec<TaskId>> {
+    loop {
+        tokio::time::sleep(WATCH_POLL_INTERVAL).await;
+        let mut current = snapshot_inputs(project, graph).await?;
+        if current == *snapshot {
+            continue;
+        }
+
+        // Wait for a burst of changes to settle.
+        loop {
+            tokio::time::sleep(WATCH_DEBOUNCE).await;
+            let next = snapshot_inputs(project, graph).await?;
+            if next == current {
+                break;
+            }
+            current = next;
+        }
+
+        let changed = snapshot.changed_tasks(&current);
+        *snapshot = current;
+        return Ok(changed);
+    }
+}
+
 /// CLI entry point for `pixi run`
 /// When running the sigints are ignored and child can react to them. As it pleases.
 pub async fn execute(args: Args) -> miette::Result<()> {
     let project = Project::load_or_else_discover(args.manifest_path.as_deref())?;
 
-    // Get the correctly ordered commands
-    let mut ordered_commands = order_tasks(args.task, &project)?;
-
-    // Get the environment to run the commands in.
-    let command_env = get_task_env(&project).await?;
-
-    // Execute the commands in the correct order
-    while let Some((command, args)) = ordered_commands.pop_back() {
-        // Ignore CTRL+C
-        // Specifically so that the child is responsible for its own signal handling
-        // NOTE: one CTRL+C is registered it will always stay registered for the rest of the runtime of the program
-        // which is fine when using run in isolation, however if we start to use run in conjunction with
-        // some other command we might want to revaluate this.
-        let ctrl_c = tokio::spawn(async { while tokio::signal::ctrl_c().await.is_ok() {} });
-        let script = create_script(command, args).await?;
-        let status_code = tokio::select! {
-            code = execute_script(script, &project, &command_env) => code?,
-            // This should never exit
-            _ = ctrl_c => { unreachable!("Ctrl+C should not be triggered") }
-        };
+    // Construct the graph of tasks to execute
+    let graph = TaskGraph::from_cmd_args(&project, args.task)?;
 
-        if status_code != 0 {
-            std::process::exit(status_code);
+    // Get the environment to run the commands in. A running `pixi daemon` can usually provide it
+    // without having to verify the environment, but it may update the lock-file so it is not used
+    // with a frozen lock-file. If none of the tasks run in the environment there is no need to
+    // verify or activate it at all.
+    let usage = args.lock_file_usage();
+    let command_env = if !graph
+        .nodes()
+        .iter()
+        .any(|node| node.task.requires_environment())
+    {
+        tracing::debug!("none of the tasks require the environment, skipping activation");
+        std::env::vars().collect()
+    } else {
+        let daemon_env = match usage {
+            LockFileUsage::Update => super::daemon::request_task_env(&project),
+            LockFileUsage::Frozen => None,
+        };
+        match daemon_env {
+            Some(command_env) => command_env,
+            None => get_task_env(&project, usage).await?,
         }
+    };
+
+    // Determine the number of tasks that may run at the same time
+    let jobs = args.jobs.unwrap_or_else(|| {
+        std::thread::available_parallelism()
+            .map(NonZeroUsize::get)
+            .unwrap_or(1)
+    });
+
+    // In watch mode CTRL+C stops pixi together with the running tasks.
+    if args.watch {
+        let result = tokio::select! {
+            result = watch_task_graph(&graph, &project, &command_env, jobs) => result,
+            _ = tokio::signal::ctrl_c() => Ok(()),
+        };
+        terminate_child_processes().await;
+        return result;
+    }
+
+    // Ignore CTRL+C
+    // Specifically so that the child is responsible for its own signal handling
+    // NOTE: one CTRL+C is registered it will always stay registered for the rest of the runtime of the program
+    // which is fine when using run in isolation, however if we start to use run in conjunction with
+    // some other command we might want to revaluate this.
+    let ctrl_c = tokio::spawn(async { while tokio::signal::ctrl_c().await.is_ok() {} });
+    let status_code = tokio::select! {
+        code = execute_task_graph(&graph, &project, &command_env, jobs) => code?,
+        // This should never exit
+        _ = ctrl_c => { unreachable!("Ctrl+C should not be triggered") }
+    };
+
+    if status_code != 0 {
+        crate::timings::finish()?;
+        std::process::exit(status_code);
     }
 
     Ok(())
@@ -216,49 +743,339 @@ pub async fn execute(args: Args) -> miette::Result<()> {
 /// activation scripts from the environment and stores the environment variables it added, it adds
 /// environment variables set by the project and merges all of that with the system environment
 /// variables.
-pub async fn get_task_env(project: &Project) -> miette::Result<HashMap<String, String>> {
+pub async fn get_task_env(
+    project: &Project,
+    usage: LockFileUsage,
+) -> miette::Result<HashMap<String, String>> {
+    let activated_env = get_activated_env(project, usage).await?;
+
+    // Construct command environment by concatenating the environments
+    Ok(std::env::vars().chain(activated_env.into_iter()).collect())
+}
+
+/// Returns the environment variables that are set on top of the system environment variables when
+/// executing a command: the variables added by the activation scripts of the environment and the
+/// variables set by the project.
+#[tracing::instrument(name = "activation", skip_all)]
+pub async fn get_activated_env(
+    project: &Project,
+    usage: LockFileUsage,
+) -> miette::Result<HashMap<String, String>> {
     // Get the prefix which we can then activate.
-    let prefix = get_up_to_date_prefix(project).await?;
+    let prefix = get_up_to_date_prefix(project, usage).await?;
+
+    // Get the environment variables that set up the compiler cache
+    let compiler_cache_env = get_compiler_cache_env(project, &prefix).await?;
 
     // Get environment variables from the activation
-    let activation_env = await_in_progress("activating environment", run_activation(prefix))
-        .await
-        .wrap_err("failed to activate environment")?;
+    let activation_env = await_in_progress(
+        "activating environment",
+        run_activation(prefix, project.pixi_dir().join(ACTIVATION_CACHE_FILE)),
+    )
+    .await
+    .wrap_err("failed to activate environment")?;
 
     // Get environment variables from the manifest
     let manifest_env = get_metadata_env(project);
 
-    // Construct command environment by concatenating the environments
-    Ok(std::env::vars()
-        .chain(activation_env.into_iter())
+    Ok(activation_env
+        .into_iter()
         .chain(manifest_env.into_iter())
+        .chain(compiler_cache_env.into_iter())
         .collect())
 }
 
-/// Runs and caches the activation script.
-async fn run_activation(prefix: Prefix) -> miette::Result<HashMap<String, String>> {
+/// The name of the file in the `.pixi` directory that caches the result of the activation.
+const ACTIVATION_CACHE_FILE: &str = "activation-env.json";
+
+/// The environment variables that resulted from running the activation scripts of a prefix.
+#[derive(Serialize, Deserialize)]
+struct ActivationCache {
+    /// A hash of everything that influences the outcome of the activation.
+    key: String,
+
+    /// The environment variables set by the activation.
+    environment: HashMap<String, String>,
+}
+
+/// Runs and caches the activation script. The resulting environment variables are stored in the
+/// `cache_path` and reused as long as the packages in the prefix, the activation scripts and the
+/// `PATH` did not change.
+async fn run_activation(
+    prefix: Prefix,
+    cache_path: PathBuf,
+) -> miette::Result<HashMap<String, String>> {
     let activator_result = tokio::task::spawn_blocking(move || {
         // Run and cache the activation script
         let shell: ShellEnum = ShellEnum::default();
 
+        // Reuse the result of a previous activation if nothing changed in the meantime.
+        let cache_key = activation_cache_key(&prefix, &shell);
+        if let Some(cache_key) = &cache_key {
+            if let Some(environment) = read_activation_cache(&cache_path, cache_key) {
+                return Ok(environment);
+            }
+        }
+
         // Construct an activator for the script
-        let activator = Activator::from_path(prefix.root(), shell, Platform::current())?;
+        let activator =
+            Activator::from_path(prefix.root(), shell, Platform::current()).into_diagnostic()?;
 
         // Run the activation
-        activator.run_activation(ActivationVariables {
-            // Get the current PATH variable
-            path: Default::default(),
+        let environment = activator
+            .run_activation(ActivationVariables {
+                // Get the current PATH variable
+                path: Default::default(),
 
-            // Start from an empty prefix
-            conda_prefix: None,
+                // Start from an empty prefix
+                conda_prefix: None,
 
-            // Prepending environment paths so they get found first.
-            path_modification_behaviour: PathModificationBehaviour::Prepend,
-        })
+                // Prepending environment paths so they get found first.
+                path_modification_behaviour: PathModificationBehaviour::Prepend,
+            })
+            .into_diagnostic()?;
+
+        if let Some(key) = cache_key {
+            if let Err(err) = write_activation_cache(&cache_path, key, &environment) {
+                tracing::warn!("failed to cache the activated environment: {err}");
+            }
+        }
+
+        Ok::<_, miette::Report>(environment)
     })
     .await
-    .into_diagnostic()?
-    .into_diagnostic()?;
+    .into_diagnostic()??;
 
     Ok(activator_result)
 }
+
+/// Computes a hash of everything that influences the outcome of activating the prefix: the
+/// packages installed in the prefix, the contents of the activation scripts, the shell, the
+/// platform and the current `PATH`. Returns `None` if the state of the prefix could not be
+/// determined, in which case the activation should not be cached.
+fn activation_cache_key(prefix: &Prefix, shell: &ShellEnum) -> Option<String> {
+    let mut content = String::new();
+    writeln!(
+        content,
+        "{} {} {} {}",
+        env!("CARGO_PKG_VERSION"),
+        Platform::current(),
+        shell.executable(),
+        prefix.root().display()
+    )
+    .ok()?;
+    writeln!(
+        content,
+        "{}",
+        std::env::var_os("PATH")
+            .unwrap_or_default()
+            .to_string_lossy()
+    )
+    .ok()?;
+
+    // Any change to the installed packages modifies the `conda-meta` directory.
+    writeln!(content, "{}", prefix.installed_packages_hash()?).ok()?;
+
+    // Activation scripts are small, hash their contents.
+    if let Ok(scripts) = std::fs::read_dir(prefix.root().join("etc/conda/activate.d")) {
+        for path in scripts
+            .map(|entry| entry.map(|entry| entry.path()))
+            .collect::<Result<Vec<_>, _>>()
+            .ok()?
+            .into_iter()
+            .sorted()
+        {
+            let hash = compute_file_digest::<Sha256>(&path).ok()?;
+            writeln!(content, "{} {:x}", path.display(), hash).ok()?;
+        }
+    }
+
+    Some(format!("{:x}", compute_bytes_digest::<Sha256>(content)))
+}
+
+/// Reads the cached activation environment if it was stored with the given key.
+fn read_activation_cache(cache_path: &Path, key: &str) -> Option<HashMap<String, String>> {
+    let contents = std::fs::read(cache_path).ok()?;
+    let cache: ActivationCache = serde_json::from_slice(&contents).ok()?;
+    (cache.key == key).then_some(cache.environment)
+}
+
+/// Stores the activation environment on disk. The file is replaced atomically so concurrent
+/// invocations never observe a partially written cache.
+fn write_activation_cache(
+    cache_path: &Path,
+    key: String,
+    environment: &HashMap<String, String>,
+) -> miette::Result<()> {
+    let cache_dir = cache_path
+        .parent()
+        .ok_or_else(|| miette::miette!("invalid cache path {}", cache_path.display()))?;
+    std::fs::create_dir_all(cache_dir).into_diagnostic()?;
+    let mut file = tempfile::NamedTempFile::new_in(cache_dir).into_diagnostic()?;
+    serde_json::to_writer(
+        &mut file,
+        &ActivationCache {
+            key,
+            environment: environment.clone(),
+        },
+    )
+    .into_diagnostic()?;
+    file.persist(cache_path).into_diagnostic()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::{
+        activation_cache_key, execute_script_with_writers, execute_task_graph_with_results,
+        unfinished_tasks, PrefixedLineWriter, TeeWriter,
+    };
+    use crate::prefix::Prefix;
+    use crate::task::TaskGraph;
+    use crate::Project;
+    use deno_task_shell::ShellPipeReader;
+    use rattler_shell::shell::ShellEnum;
+    use std::collections::{BTreeSet, HashMap};
+    use std::io::Write;
+
+    #[test]
+    fn test_prefixed_line_writer() {
+        let mut output = Vec::new();
+        let mut writer = PrefixedLineWriter::new(String::from("[foo] "), &mut output);
+        writer.write_all(b"hello\nwor").unwrap();
+        writer.write_all(b"ld\n\nbye").unwrap();
+        writer.finish().unwrap();
+
+        assert_eq!(
+            String::from_utf8(output).unwrap(),
+            "[foo] hello\n[foo] world\n[foo] \n[foo] bye\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_execute_script_with_writers() {
+        let dir = tempfile::tempdir().unwrap();
+        let project = Project::from_manifest_str(
+            dir.path(),
+            r#"
+            [project]
+            name = "foo"
+            version = "0.1.0"
+            channels = []
+            platforms = []
+            "#,
+        )
+        .unwrap();
+
+        // Tee the prefixed output to a file
+        let log_path = dir.path().join("output.log");
+        let log_file = std::fs::File::create(&log_path).unwrap();
+        let script = deno_task_shell::parser::parse("echo hello && echo world").unwrap();
+        let (code, stdout, stderr) = execute_script_with_writers(
+            script,
+            &project,
+            &HashMap::new(),
+            ShellPipeReader::stdin(),
+            PrefixedLineWriter::new(String::from("[foo] "), TeeWriter::new(Vec::new(), log_file)),
+            Vec::new(),
+        )
+        .await
+        .unwrap();
+        stdout.finish().unwrap();
+
+        assert_eq!(code, 0);
+        assert!(stderr.is_empty());
+        assert_eq!(
+            std::fs::read_to_string(&log_path).unwrap(),
+            "[foo] hello\n[foo] world\n"
+        );
+    }
+
+    #[tokio::test]
+    async fn test_failed_tasks_stay_pending() {
+        let dir = tempfile::tempdir().unwrap();
+        let project = Project::from_manifest_str(
+            dir.path(),
+            r#"
+            [project]
+            name = "foo"
+            version = "0.1.0"
+            channels = []
+            platforms = []
+
+            [tasks]
+            all = { depends_on = ["fail", "succeed"] }
+            fail = "exit 3"
+            succeed = "echo done"
+            "#,
+        )
+        .unwrap();
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("all")]).unwrap();
+        let id = |name: &str| {
+            graph
+                .nodes()
+                .iter()
+                .position(|node| node.display_name() == name)
+                .unwrap()
+        };
+
+        let pending: BTreeSet<_> = (0..graph.len()).collect();
+        let (code, succeeded) = execute_task_graph_with_results(
+            &graph.subgraph(&pending),
+            &project,
+            &HashMap::new(),
+            2,
+        )
+        .await
+        .unwrap();
+        assert_eq!(code, 3);
+        assert_eq!(succeeded, BTreeSet::from([id("succeed")]));
+
+        // The failed task and the task that was not started because of it are executed again.
+        let pending = unfinished_tasks(&pending, &succeeded);
+        assert_eq!(pending, BTreeSet::from([id("all"), id("fail")]));
+
+        // Ids of a subgraph are mapped back to the ids of the graph.
+        let (code, succeeded) = execute_task_graph_with_results(
+            &graph.subgraph(&pending),
+            &project,
+            &HashMap::new(),
+            2,
+        )
+        .await
+        .unwrap();
+        assert_eq!(code, 3);
+        assert!(succeeded.is_empty());
+        assert_eq!(unfinished_tasks(&pending, &succeeded), pending);
+        assert_eq!(
+            unfinished_tasks(&pending, &BTreeSet::from([0, 1])),
+            BTreeSet::new()
+        );
+    }
+
+    #[test]
+    fn test_activation_cache_key() {
+        let dir = tempfile::tempdir().unwrap();
+        let prefix = Prefix::new(dir.path()).unwrap();
+        let shell = ShellEnum::default();
+
+        // Without a conda-meta directory the prefix does not exist and cannot be cached.
+        assert!(activation_cache_key(&prefix, &shell).is_none());
+
+        std::fs::create_dir(dir.path().join("conda-meta")).unwrap();
+        std::fs::write(dir.path().join("conda-meta").join("foo-1-0.json"), "{}").unwrap();
+        let key = activation_cache_key(&prefix, &shell).unwrap();
+        assert_eq!(activation_cache_key(&prefix, &shell).unwrap(), key);
+
+        // Installing a package changes the key
+        std::fs::write(dir.path().join("conda-meta").join("bar-1-0.json"), "{}").unwrap();
+        let key_with_bar = activation_cache_key(&prefix, &shell).unwrap();
+        assert_ne!(key_with_bar, key);
+
+        // Adding an activation script changes the key
+        let activate_dir = dir.path().join("etc/conda/activate.d");
+        std::fs::create_dir_all(&activate_dir).unwrap();
+        std::fs::write(activate_dir.join("foo.sh"), "export FOO=1").unwrap();
+        assert_ne!(activation_cache_key(&prefix, &shell).unwrap(), key_with_bar);
+    }
+}
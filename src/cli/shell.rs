@@ -1,4 +1,4 @@
-use crate::environment::get_up_to_date_prefix;
+use crate::environment::{get_up_to_date_prefix, LockFileUsage};
 use crate::project::environment::add_metadata_as_env_vars;
 use crate::Project;
 use clap::Parser;
@@ -14,6 +14,11 @@ pub struct Args {
     /// The path to 'pixi.toml'
     #[arg(long)]
     manifest_path: Option<PathBuf>,
+
+    /// Install the environment exactly as specified in the lock-file, without checking whether the
+    /// lock-file is up to date with the manifest and without updating it.
+    #[arg(long)]
+    frozen: bool,
 }
 
 pub async fn execute(args: Args) -> miette::Result<()> {
@@ -23,7 +28,8 @@ pub async fn execute(args: Args) -> miette::Result<()> {
     let shell: ShellEnum = ShellEnum::default();
 
     // Construct an activator so we can run commands from the environment
-    let prefix = get_up_to_date_prefix(&project).await?;
+    let usage = LockFileUsage::from_frozen(args.frozen);
+    let prefix = get_up_to_date_prefix(&project, usage).await?;
     let activator = Activator::from_path(prefix.root(), shell.clone(), Platform::current())
         .into_diagnostic()?;
 
@@ -71,5 +77,7 @@ pub async fn execute(args: Args) -> miette::Result<()> {
         .spawn()
         .expect("failed to execute process");
 
-    std::process::exit(command.wait().into_diagnostic()?.code().unwrap_or(1));
+    let status = command.wait().into_diagnostic()?;
+    crate::timings::finish()?;
+    std::process::exit(status.code().unwrap_or(1));
 }
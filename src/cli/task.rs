@@ -71,6 +71,11 @@ impl From<AddArgs> for Task {
                     shlex::join(value.commands.iter().map(AsRef::as_ref))
                 }),
                 depends_on,
+                inputs: vec![],
+                outputs: vec![],
+                weight: None,
+                exclusive: false,
+                env: true,
             })
         }
     }
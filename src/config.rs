@@ -1,4 +1,5 @@
 use std::process::{Command, Stdio};
+use std::str::FromStr;
 
 /// Determines the default author based on the default git author. Both the name and the email
 /// address of the author are returned.
@@ -28,3 +29,223 @@ pub fn get_default_author() -> Option<(String, String)> {
 
     Some((name?, email.unwrap_or_else(|| "".into())))
 }
+
+/// The environment variable that overrides the maximum number of packages downloaded at the same
+/// time.
+pub const CONCURRENT_DOWNLOADS_ENV: &str = "PIXI_CONCURRENT_DOWNLOADS";
+
+/// The environment variable that overrides the maximum number of packages downloaded from a single
+/// host at the same time.
+pub const CONCURRENT_DOWNLOADS_PER_HOST_ENV: &str = "PIXI_CONCURRENT_DOWNLOADS_PER_HOST";
+
+/// The environment variable that overrides the maximum number of packages linked into a prefix at
+/// the same time.
+pub const CONCURRENT_LINKS_ENV: &str = "PIXI_CONCURRENT_LINKS";
+
+/// Limits the number of concurrent operations while installing packages into a prefix. Downloading
+/// is bound by the network while linking is bound by the disk, so both are limited separately.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct InstallConcurrency {
+    /// The maximum number of packages that are downloaded at the same time.
+    pub downloads: usize,
+
+    /// The maximum number of packages that are downloaded from the same host at the same time.
+    pub downloads_per_host: usize,
+
+    /// The maximum number of packages that are linked at the same time.
+    pub links: usize,
+}
+
+impl Default for InstallConcurrency {
+    fn default() -> Self {
+        let cpus = std::thread::available_parallelism()
+            .map(|n| n.get())
+            .unwrap_or(4);
+        Self {
+            downloads: 50,
+            downloads_per_host: 16,
+            // Linking mostly waits on the filesystem so use a few more tasks than there are cpus.
+            links: (cpus * 2).max(4),
+        }
+    }
+}
+
+impl InstallConcurrency {
+    /// Returns the default limits, overridden by any of the environment variables
+    /// [`CONCURRENT_DOWNLOADS_ENV`], [`CONCURRENT_DOWNLOADS_PER_HOST_ENV`] and
+    /// [`CONCURRENT_LINKS_ENV`].
+    pub fn from_env() -> Self {
+        Self::from_vars(|key| std::env::var(key).ok())
+    }
+
+    fn from_vars(var: impl Fn(&str) -> Option<String>) -> Self {
+        let default = Self::default();
+        let limit = |key: &str, default: usize| match var(key) {
+            Some(value) => match value.trim().parse::<usize>() {
+                Ok(limit) if limit > 0 => limit,
+                _ => {
+                    tracing::warn!("ignoring invalid value '{value}' for {key}");
+                    default
+                }
+            },
+            None => default,
+        };
+        Self {
+            downloads: limit(CONCURRENT_DOWNLOADS_ENV, default.downloads),
+            downloads_per_host: limit(
+                CONCURRENT_DOWNLOADS_PER_HOST_ENV,
+                default.downloads_per_host,
+            ),
+            links: limit(CONCURRENT_LINKS_ENV, default.links),
+        }
+    }
+}
+
+/// The environment variable that selects the [`LinkMode`] used to install packages.
+pub const LINK_MODE_ENV: &str = "PIXI_LINK_MODE";
+
+/// Determines how the files of a package in the package cache are placed in a prefix.
+#[derive(Debug, Default, Clone, Copy, PartialEq, Eq)]
+pub enum LinkMode {
+    /// Use the cheapest mode that works for the package cache and the prefix.
+    #[default]
+    Auto,
+
+    /// Hardlink the files. This only works if the package cache and the prefix are on the same
+    /// filesystem.
+    HardLink,
+
+    /// Copy the files, letting the filesystem share the data between the copies (copy-on-write)
+    /// if it supports it.
+    RefLink,
+
+    /// Copy the files.
+    Copy,
+}
+
+impl FromStr for LinkMode {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s.trim().to_lowercase().as_str() {
+            "auto" => Ok(LinkMode::Auto),
+            "hardlink" => Ok(LinkMode::HardLink),
+            "reflink" => Ok(LinkMode::RefLink),
+            "copy" => Ok(LinkMode::Copy),
+            _ => Err(format!(
+                "invalid link mode '{s}', expected one of 'auto', 'hardlink', 'reflink' or 'copy'"
+            )),
+        }
+    }
+}
+
+impl LinkMode {
+    /// Returns the link mode selected through [`LINK_MODE_ENV`] or [`LinkMode::Auto`] if it is not
+    /// set.
+    pub fn from_env() -> miette::Result<Self> {
+        match std::env::var(LINK_MODE_ENV) {
+            Ok(value) => value
+                .parse()
+                .map_err(|err| miette::miette!("{LINK_MODE_ENV}: {err}")),
+            Err(_) => Ok(LinkMode::Auto),
+        }
+    }
+}
+
+/// The environment variable that enables cloning new environments from the shared environment
+/// store in the pixi cache directory.
+pub const ENVIRONMENT_STORE_ENV: &str = "PIXI_ENVIRONMENT_STORE";
+
+/// The environment variable that disables the jobserver `pixi run` provides to the tasks it runs.
+pub const NO_JOBSERVER_ENV: &str = "PIXI_NO_JOBSERVER";
+
+/// The environment variable that disables downloading zstd compressed repodata.
+pub const REPODATA_NO_ZSTD_ENV: &str = "PIXI_REPODATA_NO_ZSTD";
+
+/// The environment variable that disables downloading bz2 compressed repodata.
+pub const REPODATA_NO_BZ2_ENV: &str = "PIXI_REPODATA_NO_BZ2";
+
+/// The environment variable that disables incrementally updating repodata using JLAP.
+pub const REPODATA_NO_JLAP_ENV: &str = "PIXI_REPODATA_NO_JLAP";
+
+/// Determines which of the optional, more efficient, methods are used to download repodata. If a
+/// channel does not support a method the next best method is used.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct RepodataFeatures {
+    /// Download the zstd compressed `repodata.json.zst` if the channel provides it.
+    pub zstd: bool,
+
+    /// Download the bz2 compressed `repodata.json.bz2` if the channel provides it.
+    pub bz2: bool,
+
+    /// Only download the changes since the cached version if the channel provides a
+    /// `repodata.jlap` file.
+    pub jlap: bool,
+}
+
+impl Default for RepodataFeatures {
+    fn default() -> Self {
+        Self {
+            zstd: true,
+            bz2: true,
+            jlap: true,
+        }
+    }
+}
+
+impl RepodataFeatures {
+    /// Returns the features that are not disabled through [`REPODATA_NO_ZSTD_ENV`],
+    /// [`REPODATA_NO_BZ2_ENV`] or [`REPODATA_NO_JLAP_ENV`].
+    pub fn from_env() -> Self {
+        let enabled = |key: &str| !matches!(std::env::var(key).as_deref(), Ok(value) if !value.is_empty() && value != "0");
+        Self {
+            zstd: enabled(REPODATA_NO_ZSTD_ENV),
+            bz2: enabled(REPODATA_NO_BZ2_ENV),
+            jlap: enabled(REPODATA_NO_JLAP_ENV),
+        }
+    }
+
+    /// Returns the features to use to download the full `repodata.json`.
+    pub fn none() -> Self {
+        Self {
+            zstd: false,
+            bz2: false,
+            jlap: false,
+        }
+    }
+
+    /// Returns true if any of the features is enabled.
+    pub fn any(&self) -> bool {
+        self.zstd || self.bz2 || self.jlap
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_install_concurrency_from_vars() {
+        let default = InstallConcurrency::default();
+        assert_eq!(InstallConcurrency::from_vars(|_| None), default);
+
+        let concurrency = InstallConcurrency::from_vars(|key| match key {
+            CONCURRENT_DOWNLOADS_ENV => Some(String::from("8")),
+            CONCURRENT_LINKS_ENV => Some(String::from("0")),
+            CONCURRENT_DOWNLOADS_PER_HOST_ENV => Some(String::from("foo")),
+            _ => None,
+        });
+        assert_eq!(concurrency.downloads, 8);
+        assert_eq!(concurrency.links, default.links);
+        assert_eq!(concurrency.downloads_per_host, default.downloads_per_host);
+    }
+
+    #[test]
+    fn test_parse_link_mode() {
+        assert_eq!("auto".parse(), Ok(LinkMode::Auto));
+        assert_eq!("HardLink".parse(), Ok(LinkMode::HardLink));
+        assert_eq!("reflink".parse(), Ok(LinkMode::RefLink));
+        assert_eq!(" copy ".parse(), Ok(LinkMode::Copy));
+        assert!("symlink".parse::<LinkMode>().is_err());
+    }
+}
@@ -1,2 +1,3 @@
 pub const PROJECT_MANIFEST: &str = "pixi.toml";
 pub const PROJECT_LOCK_FILE: &str = "pixi.lock";
+pub const PIXI_DIR: &str = ".pixi";
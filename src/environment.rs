@@ -1,16 +1,19 @@
 use crate::{
-    prefix::Prefix,
+    config::{InstallConcurrency, LinkMode},
+    network,
+    prefix::{conda_meta_file_name, InstalledPackage, Prefix, PrefixIndex},
     progress::{
         await_in_progress, default_progress_style, finished_progress_style, global_multi_progress,
     },
+    repodata::{IndexedRepoData, RepoDataGateway},
     virtual_packages::verify_current_platform_has_required_virtual_packages,
     Project,
 };
-use futures::future::ready;
-use futures::{stream, FutureExt, StreamExt, TryFutureExt, TryStreamExt};
+use futures::{stream, SinkExt, StreamExt, TryStreamExt};
 use indicatif::ProgressBar;
 use itertools::Itertools;
 use miette::{Context, IntoDiagnostic, LabeledSpan};
+use once_cell::sync::Lazy;
 use rattler::{
     install::{link_package, InstallDriver, InstallOptions, Transaction, TransactionOperation},
     package_cache::PackageCache,
@@ -19,23 +22,66 @@ use rattler_conda_types::{
     conda_lock,
     conda_lock::builder::{LockFileBuilder, LockedPackage, LockedPackages},
     conda_lock::CondaLock,
-    MatchSpec, NamelessMatchSpec, Platform, PrefixRecord, RepoDataRecord, Version,
+    package::{PackageFile, PathsJson},
+    prefix_record::{Link, LinkType},
+    GenericVirtualPackage, MatchSpec, NamelessMatchSpec, Platform, PrefixRecord, RepoDataRecord,
+    Version,
 };
+use rattler_digest::{compute_bytes_digest, compute_file_digest, Sha256};
 use rattler_networking::AuthenticatedClient;
-use rattler_repodata_gateway::sparse::SparseRepoData;
 use rattler_solve::{libsolv_rs, SolverImpl};
+use serde::{Deserialize, Serialize};
 use std::collections::HashMap;
 use std::{
     collections::{HashSet, VecDeque},
+    fmt::Write,
     io::ErrorKind,
+    num::NonZeroUsize,
     path::{Path, PathBuf},
     str::FromStr,
+    sync::Arc,
     time::Duration,
 };
+use tracing::Instrument;
+
+mod bundle;
+mod lock_cache;
+mod store;
+
+pub use bundle::{export_bundle, import_bundle};
+use lock_cache::{LockFileCache, LOCK_CACHE_FILE};
+use store::EnvironmentStore;
+
+/// Determines how the lock-file is used to bring the environment up to date.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum LockFileUsage {
+    /// Update the lock-file if it does not satisfy the manifest.
+    Update,
+
+    /// Install exactly the packages in the lock-file without checking it against the manifest.
+    /// The lock-file is never updated, so no repodata is fetched and nothing is solved. Fails if
+    /// there is no lock-file or it does not contain the current platform.
+    Frozen,
+}
+
+impl LockFileUsage {
+    /// Returns the usage that corresponds to the `--frozen` flag.
+    pub fn from_frozen(frozen: bool) -> Self {
+        if frozen {
+            LockFileUsage::Frozen
+        } else {
+            LockFileUsage::Update
+        }
+    }
+}
 
 /// Returns the prefix associated with the given environment. If the prefix doesnt exist or is not
 /// up to date it is updated.
-pub async fn get_up_to_date_prefix(project: &Project) -> miette::Result<Prefix> {
+#[tracing::instrument(skip_all)]
+pub async fn get_up_to_date_prefix(
+    project: &Project,
+    usage: LockFileUsage,
+) -> miette::Result<Prefix> {
     // Make sure the project supports the current platform
     let platform = Platform::current();
     if !project.platforms().contains(&platform) {
@@ -53,25 +99,97 @@ pub async fn get_up_to_date_prefix(project: &Project) -> miette::Result<Prefix>
     // Make sure the system requirements are met
     verify_current_platform_has_required_virtual_packages(project)?;
 
-    // Start loading the installed packages in the background
+    // If nothing changed since the last time the prefix was updated there is nothing to do. The
+    // lock-file is only hashed once, the hash also validates the lock-file cache.
     let prefix = Prefix::new(project.root().join(".pixi/env"))?;
+    let stamp_path = prefix.root().join(ENVIRONMENT_STAMP_FILE);
+    let lock_file_hash = compute_file_digest::<Sha256>(project.lock_file_path()).ok();
+    let current_stamp = lock_file_hash
+        .as_ref()
+        .and_then(|hash| EnvironmentStamp::new(project, &prefix, hash));
+    let stored_stamp = EnvironmentStamp::from_path(&stamp_path);
+    if current_stamp.is_some() && current_stamp == stored_stamp {
+        tracing::debug!("the environment is up to date with the manifest and the lock-file");
+        return Ok(prefix);
+    }
+
+    // Start loading the installed packages in the background
     let installed_packages_future = {
         let prefix = prefix.clone();
-        tokio::spawn(async move { prefix.find_installed_packages(None).await })
+        tokio::spawn(async move { prefix.installed_packages().await })
     };
 
-    // Update the lock-file if it is out of date.
-    let lock_file = load_lock_file(project).await?;
-    let lock_file = if !lock_file_up_to_date(project, &lock_file)? {
-        update_lock_file(project, lock_file, None).await?
-    } else {
-        lock_file
+    // If only the installed packages changed since the prefix was updated, the lock-file is known
+    // to satisfy the manifest. A frozen lock-file is never verified at all. In both cases only the
+    // records of the current platform are needed and they are read from the cache without decoding
+    // the rest of the lock-file.
+    let lock_file_verified = match (&current_stamp, &stored_stamp) {
+        (Some(current), Some(stored)) => {
+            current.manifest == stored.manifest && current.lock_file == stored.lock_file
+        }
+        _ => false,
+    };
+    let cache = open_lock_file_cache(project, lock_file_hash).await?;
+    let cached_packages = match &cache {
+        Some(cache) if lock_file_verified || usage == LockFileUsage::Frozen => {
+            load_cached_packages(cache.clone(), platform).await?
+        }
+        _ => None,
+    };
+    let required_packages = match cached_packages {
+        Some(records) => records,
+        None => {
+            // Update the lock-file if it is out of date, which also replaces the cache.
+            let lock_file = load_lock_file_with_cache(project, cache.clone()).await?;
+            match usage {
+                LockFileUsage::Update if !lock_file_up_to_date(project, &lock_file)? => {
+                    let lock_file = update_lock_file(project, lock_file, None).await?;
+                    get_required_packages(&lock_file, platform)?
+                }
+                LockFileUsage::Update => {
+                    load_required_packages(&lock_file, platform, cache).await?
+                }
+                LockFileUsage::Frozen => {
+                    if !project.lock_file_path().is_file() {
+                        miette::bail!(
+                            help = "run `pixi install` to create the lock-file",
+                            "{} does not exist, it is required to install a frozen environment",
+                            project.lock_file_path().display()
+                        );
+                    }
+                    if !lock_file.metadata.platforms.contains(&platform) {
+                        miette::bail!(
+                            help = "run `pixi install` to update the lock-file",
+                            "the lock-file does not contain any packages for the current platform ({platform})"
+                        );
+                    }
+                    load_required_packages(&lock_file, platform, cache).await?
+                }
+            }
+        }
     };
+    let mut installed_packages = installed_packages_future.await.into_diagnostic()??;
+
+    // A new environment is cloned from a similar environment in the store, if enabled, so only the
+    // difference has to be installed. The store is only a cache, if cloning fails the environment
+    // is installed as usual.
+    let store = EnvironmentStore::from_env()?;
+    if let Some(store) = &store {
+        if installed_packages.is_empty() {
+            match store.materialize(&required_packages, &prefix).await {
+                Ok(0) => {}
+                Ok(_) => installed_packages = prefix.installed_packages().await?,
+                Err(err) => {
+                    tracing::warn!("failed to clone the environment from the store: {err}")
+                }
+            }
+        }
+    }
 
     // Construct a transaction to bring the environment up to date with the lock-file content
     let transaction = Transaction::from_current_and_desired(
-        installed_packages_future.await.into_diagnostic()??,
-        get_required_packages(&lock_file, platform)?,
+        installed_packages,
+        required_packages.clone(),
         platform,
     )
     .into_diagnostic()?;
@@ -86,35 +204,185 @@ pub async fn get_up_to_date_prefix(project: &Project) -> miette::Result<Prefix>
                 prefix.root().to_path_buf(),
                 rattler::default_cache_dir()
                     .map_err(|_| miette::miette!("could not determine default cache directory"))?,
-                AuthenticatedClient::default(),
+                network::authenticated_client(),
             ),
         )
         .await?;
+
+        // Share the updated environment with other checkouts of the project.
+        if let Some(store) = &store {
+            if let Err(err) = store.insert(&required_packages, &prefix).await {
+                tracing::warn!("failed to add the environment to the store: {err}");
+            }
+        }
+    }
+
+    // Record the state of the project so the next invocation can skip all of the above. A frozen
+    // lock-file was not verified against the manifest, so there is nothing to record.
+    if usage == LockFileUsage::Frozen {
+        return Ok(prefix);
+    }
+    match EnvironmentStamp::current(project, &prefix) {
+        Some(stamp) => {
+            if let Err(err) = stamp.write_to_path(&stamp_path) {
+                tracing::warn!("failed to write {}: {err}", stamp_path.display());
+            }
+        }
+        None => tracing::debug!("could not determine the state of the environment"),
     }
 
     Ok(prefix)
 }
 
+/// The name of the file in the prefix that stores the [`EnvironmentStamp`].
+const ENVIRONMENT_STAMP_FILE: &str = "pixi-stamp.json";
+
+/// Describes the state of the project the last time the prefix was brought up to date. If the
+/// stamp of the current state equals the stored stamp the lock-file is known to satisfy the manifest
+/// and the prefix is known to match the lock-file, so they don't have to be verified again.
+#[derive(Debug, PartialEq, Eq, Serialize, Deserialize)]
+struct EnvironmentStamp {
+    /// The hash of the manifest
+    manifest: String,
+
+    /// The hash of the lock-file
+    lock_file: String,
+
+    /// The hash of the installed packages, see [`Prefix::installed_packages_hash`].
+    installed_packages: String,
+}
+
+impl EnvironmentStamp {
+    /// Computes the stamp of the current state of the project and the prefix. Returns `None` if the
+    /// lock-file or the prefix do not exist.
+    fn current(project: &Project, prefix: &Prefix) -> Option<Self> {
+        let lock_file_hash = compute_file_digest::<Sha256>(project.lock_file_path()).ok()?;
+        Self::new(project, prefix, &lock_file_hash)
+    }
+
+    /// Computes the stamp of the project and the prefix from the already computed hash of the
+    /// lock-file. Returns `None` if the prefix does not exist.
+    fn new(project: &Project, prefix: &Prefix, lock_file_hash: &Sha256Hash) -> Option<Self> {
+        Some(Self {
+            manifest: format!("{:x}", compute_bytes_digest::<Sha256>(project.source_str())),
+            lock_file: format!("{lock_file_hash:x}"),
+            installed_packages: prefix.installed_packages_hash()?,
+        })
+    }
+
+    /// Reads a previously stored stamp.
+    fn from_path(path: &Path) -> Option<Self> {
+        let contents = std::fs::read(path).ok()?;
+        serde_json::from_slice(&contents).ok()
+    }
+
+    /// Stores the stamp on disk.
+    fn write_to_path(&self, path: &Path) -> miette::Result<()> {
+        std::fs::write(path, serde_json::to_vec(self).into_diagnostic()?).into_diagnostic()
+    }
+}
+
 /// Loads the lockfile for the specified project or returns a dummy one if none could be found.
 pub async fn load_lock_for_manifest_path(path: &Path) -> miette::Result<CondaLock> {
     load_lock_file(&Project::load(path)?).await
 }
 
 /// Loads the lockfile for the specified project or returns a dummy one if none could be found.
+///
+/// Parsing the lock-file is slow, so the parsed lock-file is also stored in a [`LockFileCache`] in
+/// the `.pixi` directory. The cache is used instead of the lock-file as long as the lock-file did
+/// not change.
 pub async fn load_lock_file(project: &Project) -> miette::Result<CondaLock> {
+    let cache = open_lock_file_cache(project, None).await?;
+    load_lock_file_with_cache(project, cache).await
+}
+
+/// Opens the [`LockFileCache`] of the project if it is up to date with the lock-file. The hash of
+/// the lock-file is computed unless it is given.
+async fn open_lock_file_cache(
+    project: &Project,
+    lock_file_hash: Option<Sha256Hash>,
+) -> miette::Result<Option<Arc<LockFileCache>>> {
     let lock_file_path = project.lock_file_path();
+    let cache_path = project.pixi_dir().join(LOCK_CACHE_FILE);
     tokio::task::spawn_blocking(move || {
-        if lock_file_path.is_file() {
-            CondaLock::from_path(&lock_file_path).into_diagnostic()
-        } else {
-            LockFileBuilder::default().build().into_diagnostic()
+        let cache = match lock_file_hash {
+            Some(hash) => LockFileCache::open_with_hash(&cache_path, &lock_file_path, &hash),
+            None => LockFileCache::open(&cache_path, &lock_file_path),
+        };
+        cache.map(Arc::new)
+    })
+    .await
+    .into_diagnostic()
+}
+
+/// Loads the lock-file of the project from the given cache, or parses the lock-file and writes a
+/// new cache if there is no cache.
+async fn load_lock_file_with_cache(
+    project: &Project,
+    cache: Option<Arc<LockFileCache>>,
+) -> miette::Result<CondaLock> {
+    let lock_file_path = project.lock_file_path();
+    let cache_path = project.pixi_dir().join(LOCK_CACHE_FILE);
+    tokio::task::spawn_blocking(move || {
+        if !lock_file_path.is_file() {
+            return LockFileBuilder::default().build().into_diagnostic();
         }
+
+        if let Some(cache) = cache {
+            match cache.lock_file() {
+                Ok(lock_file) => return Ok(lock_file),
+                Err(err) => tracing::debug!("failed to read {}: {err}", cache_path.display()),
+            }
+        }
+
+        let lock_file = CondaLock::from_path(&lock_file_path).into_diagnostic()?;
+        if let Err(err) = LockFileCache::write(&cache_path, &lock_file_path, &lock_file) {
+            tracing::warn!("failed to write {}: {err}", cache_path.display());
+        }
+        Ok(lock_file)
     })
     .await
     .unwrap_or_else(|e| Err(e).into_diagnostic())
 }
 
+/// Returns the [`RepoDataRecord`]s of the given platform from the cache, or `None` if they could
+/// not be read from it. Only the records of the platform are deserialized.
+async fn load_cached_packages(
+    cache: Arc<LockFileCache>,
+    platform: Platform,
+) -> miette::Result<Option<Vec<RepoDataRecord>>> {
+    tokio::task::spawn_blocking(move || {
+        cache
+            .records(platform)
+            .map_err(|err| tracing::debug!("failed to read the cached records: {err}"))
+            .ok()
+            .flatten()
+    })
+    .await
+    .into_diagnostic()
+}
+
+/// Returns the [`RepoDataRecord`]s for the packages of the given platform from the lock-file. The
+/// records are read from the cache of the same lock-file if there is one, which avoids converting
+/// all the packages of the lock-file.
+async fn load_required_packages(
+    lock_file: &CondaLock,
+    platform: Platform,
+    cache: Option<Arc<LockFileCache>>,
+) -> miette::Result<Vec<RepoDataRecord>> {
+    let cached = match cache {
+        Some(cache) => load_cached_packages(cache, platform).await?,
+        None => None,
+    };
+    match cached {
+        Some(records) => Ok(records),
+        None => get_required_packages(lock_file, platform),
+    }
+}
+
 /// Returns true if the locked packages match the dependencies in the project.
+#[tracing::instrument(skip_all)]
 pub fn lock_file_up_to_date(project: &Project, lock_file: &CondaLock) -> miette::Result<bool> {
     let platforms = project.platforms();
 
@@ -137,90 +405,132 @@ pub fn lock_file_up_to_date(project: &Project, lock_file: &CondaLock) -> miette:
         return Ok(false);
     }
 
+    // Parsing match specs is relatively expensive and the same constraints occur on every
+    // platform, so every unique constraint is only parsed once. `None` indicates that the
+    // constraint could not be parsed.
+    let mut parsed_constraints = HashMap::<String, Option<NamelessMatchSpec>>::new();
+
     // For each platform,
     for platform in platforms.iter().cloned() {
-        // Check if all dependencies exist in the lock-file.
-        let dependencies = project
-            .all_dependencies(platform)?
-            .into_iter()
-            .collect::<VecDeque<_>>();
-
-        // Construct a queue of dependencies that we wanna find in the lock file
-        let mut queue = dependencies.clone();
-
-        // Get the virtual packages for the system
-        let virtual_packages = project
-            .virtual_packages(platform)?
-            .into_iter()
-            .map(|vpkg| (vpkg.name.clone(), vpkg))
-            .collect::<HashMap<_, _>>();
-
-        // Keep track of which dependencies we already found. Since there can always only be one
-        // version per named package we can just keep track of the package names.
-        let mut seen = dependencies
-            .iter()
-            .map(|(name, _)| name.clone())
-            .collect::<HashSet<_>>();
-
-        while let Some((name, spec)) = queue.pop_back() {
-            // Is this a virtual package? And does it match?
-            if let Some(vpkg) = virtual_packages.get(&name) {
-                if let Some(version_spec) = spec.version {
-                    if !version_spec.matches(&vpkg.version) {
-                        tracing::info!("found a dependency on virtual package '{}' but the version spec '{}' does not match the expected version of the virtual package '{}'.", &name, &version_spec, &vpkg.version);
-                        return Ok(false);
-                    }
-                }
-                if let Some(build_spec) = spec.build {
-                    if !build_spec.matches(&vpkg.build_string) {
-                        tracing::info!("found a dependency on virtual package '{}' but the build spec '{}' does not match the expected build of the virtual package '{}'.", &name, &build_spec, &vpkg.build_string);
-                        return Ok(false);
-                    }
-                }
+        if !platform_up_to_date(project, lock_file, platform, &mut parsed_constraints)? {
+            return Ok(false);
+        }
+    }
 
-                // Virtual package matches
-                continue;
-            }
+    Ok(true)
+}
 
-            // Find the package in the lock-file that matches our dependency.
-            let locked_package = lock_file
-                .packages_for_platform(platform)
-                .find(|locked_package| locked_dependency_satisfies(locked_package, &name, &spec));
+/// Returns true if the locked packages of a single platform match the dependencies of the project
+/// for that platform.
+fn platform_up_to_date(
+    project: &Project,
+    lock_file: &CondaLock,
+    platform: Platform,
+    parsed_constraints: &mut HashMap<String, Option<NamelessMatchSpec>>,
+) -> miette::Result<bool> {
+    // Index the locked packages of this platform by name so we dont have to scan all packages
+    // for every dependency.
+    let mut locked_packages = HashMap::<&str, Vec<&conda_lock::LockedDependency>>::new();
+    let mut locked_package_count = 0;
+    for locked_package in lock_file.packages_for_platform(platform) {
+        locked_packages
+            .entry(locked_package.name.as_str())
+            .or_default()
+            .push(locked_package);
+        locked_package_count += 1;
+    }
 
-            match locked_package {
-                None => {
-                    // No package found that matches the dependency, the lock file is not in a
-                    // consistent state.
-                    tracing::info!("failed to find a locked package for '{} {}', assuming the lock file is out of date.", &name, &spec);
+    // Check if all dependencies exist in the lock-file.
+    let dependencies = project
+        .all_dependencies(platform)?
+        .into_iter()
+        .collect::<VecDeque<_>>();
+
+    // Construct a queue of dependencies that we wanna find in the lock file
+    let mut queue = dependencies.clone();
+
+    // Get the virtual packages for the system
+    let virtual_packages = project
+        .virtual_packages(platform)?
+        .into_iter()
+        .map(|vpkg| (vpkg.name.clone(), vpkg))
+        .collect::<HashMap<_, _>>();
+
+    // Keep track of which dependencies we already found. Since there can always only be one
+    // version per named package we can just keep track of the package names.
+    let mut seen = dependencies
+        .iter()
+        .map(|(name, _)| name.clone())
+        .collect::<HashSet<_>>();
+
+    while let Some((name, spec)) = queue.pop_back() {
+        // Is this a virtual package? And does it match?
+        if let Some(vpkg) = virtual_packages.get(&name) {
+            if let Some(version_spec) = spec.version {
+                if !version_spec.matches(&vpkg.version) {
+                    tracing::info!("found a dependency on virtual package '{}' but the version spec '{}' does not match the expected version of the virtual package '{}'.", &name, &version_spec, &vpkg.version);
+                    return Ok(false);
+                }
+            }
+            if let Some(build_spec) = spec.build {
+                if !build_spec.matches(&vpkg.build_string) {
+                    tracing::info!("found a dependency on virtual package '{}' but the build spec '{}' does not match the expected build of the virtual package '{}'.", &name, &build_spec, &vpkg.build_string);
                     return Ok(false);
                 }
-                Some(package) => {
-                    for (depends_name, depends_constraint) in package.dependencies.iter() {
-                        if !seen.contains(depends_name) {
-                            // Parse the constraint
-                            match NamelessMatchSpec::from_str(&depends_constraint.to_string()) {
-                                Ok(spec) => {
-                                    queue.push_back((depends_name.clone(), spec));
-                                    seen.insert(depends_name.clone());
-                                }
-                                Err(_) => {
-                                    tracing::warn!("failed to parse spec '{}', assuming the lock file is corrupt.", depends_constraint);
-                                    return Ok(false);
-                                }
+            }
+
+            // Virtual package matches
+            continue;
+        }
+
+        // Find the package in the lock-file that matches our dependency.
+        let locked_package = locked_packages.get(name.as_str()).and_then(|candidates| {
+            candidates
+                .iter()
+                .find(|locked_package| locked_dependency_satisfies(locked_package, &name, &spec))
+        });
+
+        match locked_package {
+            None => {
+                // No package found that matches the dependency, the lock file is not in a
+                // consistent state.
+                tracing::info!("failed to find a locked package for '{} {}', assuming the lock file is out of date.", &name, &spec);
+                return Ok(false);
+            }
+            Some(package) => {
+                for (depends_name, depends_constraint) in package.dependencies.iter() {
+                    if !seen.contains(depends_name) {
+                        // Parse the constraint
+                        let spec = parsed_constraints
+                            .entry(depends_constraint.to_string())
+                            .or_insert_with_key(|constraint| {
+                                NamelessMatchSpec::from_str(constraint).ok()
+                            });
+                        match spec {
+                            Some(spec) => {
+                                queue.push_back((depends_name.clone(), spec.clone()));
+                                seen.insert(depends_name.clone());
+                            }
+                            None => {
+                                tracing::warn!(
+                                    "failed to parse spec '{}', assuming the lock file is corrupt.",
+                                    depends_constraint
+                                );
+                                return Ok(false);
                             }
                         }
                     }
                 }
             }
         }
+    }
 
-        // If the number of "seen" dependencies is less than the number of packages for this
-        // platform in the first place, there are more packages in the lock file than are used. This
-        // means the lock file is also out of date.
-        if seen.len() < lock_file.packages_for_platform(platform).count() {
-            tracing::info!("there are more packages in the lock-file than required to fulfill all dependency requirements. Assuming the lock file is out of date.");
-            return Ok(false);
-        }
+    // If the number of "seen" dependencies is less than the number of packages for this
+    // platform in the first place, there are more packages in the lock file than are used. This
+    // means the lock file is also out of date.
+    if seen.len() < locked_package_count {
+        tracing::info!("there are more packages in the lock-file than required to fulfill all dependency requirements. Assuming the lock file is out of date.");
+        return Ok(false);
     }
 
     Ok(true)
@@ -269,16 +579,63 @@ fn locked_dependency_satisfies(
 pub async fn update_lock_file(
     project: &Project,
     existing_lock_file: CondaLock,
-    repodata: Option<Vec<SparseRepoData>>,
+    repodata: Option<Vec<IndexedRepoData>>,
+) -> miette::Result<CondaLock> {
+    update_lock_file_with_solutions(project, existing_lock_file, repodata, HashMap::new()).await
+}
+
+/// Updates the lock file for a project. `solutions` contains the records of platforms that have
+/// already been solved for the current dependencies of the project, these platforms are not solved
+/// again.
+#[tracing::instrument(name = "update_lock_file", skip_all)]
+pub async fn update_lock_file_with_solutions(
+    project: &Project,
+    existing_lock_file: CondaLock,
+    repodata: Option<Vec<IndexedRepoData>>,
+    mut solutions: HashMap<Platform, Vec<RepoDataRecord>>,
 ) -> miette::Result<CondaLock> {
     let platforms = project.platforms();
 
-    // Get the repodata for the project
-    let sparse_repo_data = if let Some(sparse_repo_data) = repodata {
-        sparse_repo_data
-    } else {
-        project.fetch_sparse_repodata().await?
-    };
+    // Repodata is only fetched for the platforms that are left to solve. Every platform is solved
+    // as soon as its own repodata is available, while the repodata of the other platforms is still
+    // being fetched.
+    let repodata = repodata.map(|repodata| {
+        Arc::new(
+            repodata
+                .into_iter()
+                .map(Arc::new)
+                .collect::<Vec<Arc<IndexedRepoData>>>(),
+        )
+    });
+    let gateway = RepoDataGateway::new(project.channels())?;
+
+    // Platforms whose inputs did not change since the lock-file was written keep their locked
+    // packages, e.g. adding a dependency for a single platform only solves that platform again.
+    let fingerprints = platforms
+        .iter()
+        .map(|&platform| Ok((platform, platform_fingerprint(project, platform)?)))
+        .collect::<miette::Result<HashMap<_, _>>>()?;
+    let mut parsed_constraints = HashMap::new();
+    for platform in platforms.iter().cloned() {
+        if solutions.contains_key(&platform)
+            || existing_lock_file.metadata.content_hash.get(&platform)
+                != fingerprints.get(&platform)
+            || !platform_up_to_date(
+                project,
+                &existing_lock_file,
+                platform,
+                &mut parsed_constraints,
+            )?
+        {
+            continue;
+        }
+
+        tracing::debug!("the inputs of {platform} did not change, keeping its locked packages");
+        solutions.insert(
+            platform,
+            get_required_packages(&existing_lock_file, platform)?,
+        );
+    }
 
     // Construct a conda lock file
     let channels = project
@@ -286,9 +643,14 @@ pub async fn update_lock_file(
         .iter()
         .map(|channel| conda_lock::Channel::from(channel.base_url().to_string()));
 
-    // Empty match-specs because these differ per platform
-    let mut builder = LockFileBuilder::new(channels, platforms.iter().cloned(), vec![]);
+    // Solve all platforms at the same time. Loading the records and solving are both blocking
+    // operations so each platform is solved on a separate blocking thread.
+    let mut solve_handles = HashMap::with_capacity(platforms.len());
     for platform in platforms.iter().cloned() {
+        if solutions.contains_key(&platform) {
+            continue;
+        }
+
         let dependencies = project.all_dependencies(platform)?;
         let match_specs = dependencies
             .iter()
@@ -298,60 +660,144 @@ pub async fn update_lock_file(
             .collect_vec();
 
         // Extract the package names from the dependencies
-        let package_names = dependencies.keys().collect_vec();
-
-        // Get the repodata for the current platform and for NoArch
-        let platform_sparse_repo_data = sparse_repo_data.iter().filter(|sparse| {
-            sparse.subdir() == platform.as_str() || sparse.subdir() == Platform::NoArch.as_str()
-        });
-
-        // Load only records we need for this platform
-        let available_packages = SparseRepoData::load_records_recursive(
-            platform_sparse_repo_data,
-            package_names.iter().copied(),
-            None,
-        )
-        .into_diagnostic()?;
+        let package_names = dependencies.into_keys().collect_vec();
 
         // Get the virtual packages for this platform
         let virtual_packages = project.virtual_packages(platform)?;
 
-        // Construct a solver task that we can start solving.
-        let task = rattler_solve::SolverTask {
-            specs: match_specs.clone(),
-            available_packages: &available_packages,
-            locked_packages: existing_lock_file
-                .packages_for_platform(platform)
-                .map(RepoDataRecord::try_from)
-                .collect::<Result<Vec<_>, _>>()
-                .into_diagnostic()?,
-            pinned_packages: vec![],
-            virtual_packages,
-        };
+        // Get the packages that were previously locked for this platform
+        let locked_packages = get_required_packages(&existing_lock_file, platform)?;
+
+        let (repodata, gateway) = (repodata.clone(), gateway.clone());
+        solve_handles.insert(
+            platform,
+            tokio::spawn(async move {
+                let repodata = match repodata {
+                    Some(repodata) => repodata.as_ref().clone(),
+                    None => gateway.fetch(platform).await?,
+                };
+                run_blocking(move || {
+                    solve_platform(
+                        platform,
+                        repodata.iter().map(AsRef::as_ref),
+                        match_specs,
+                        package_names,
+                        virtual_packages,
+                        locked_packages,
+                    )
+                })
+                .await
+            }),
+        );
+    }
+
+    // Empty match-specs because these differ per platform
+    let mut builder = LockFileBuilder::new(channels, platforms.iter().cloned(), vec![]);
 
-        // Solve the task
-        let records = libsolv_rs::Solver.solve(task).into_diagnostic()?;
+    // Add the results in the order of the platforms to keep the lock-file deterministic.
+    for platform in platforms.iter().cloned() {
+        let records = match (solutions.remove(&platform), solve_handles.remove(&platform)) {
+            (Some(records), _) => records,
+            (None, Some(handle)) => match handle.await {
+                Ok(result) => result?,
+                Err(err) => {
+                    if let Ok(panic) = err.try_into_panic() {
+                        std::panic::resume_unwind(panic);
+                    }
+                    miette::bail!("solving was cancelled");
+                }
+            },
+            (None, None) => unreachable!("every platform is either solved or being solved"),
+        };
 
-        // Update lock file
         let mut locked_packages = LockedPackages::new(platform);
         for record in records {
             let locked_package = LockedPackage::try_from(record).into_diagnostic()?;
             locked_packages = locked_packages.add_locked_package(locked_package);
         }
-
         builder = builder.add_locked_packages(locked_packages);
     }
 
-    let conda_lock = builder.build().into_diagnostic()?;
+    let mut conda_lock = builder.build().into_diagnostic()?;
+    conda_lock.metadata.content_hash = fingerprints;
 
     // Write the conda lock to disk
-    conda_lock
-        .to_path(&project.lock_file_path())
-        .into_diagnostic()?;
+    let lock_file_path = project.lock_file_path();
+    conda_lock.to_path(&lock_file_path).into_diagnostic()?;
+
+    // Update the cache right away so the next invocation doesn't have to parse the lock-file.
+    let cache_path = project.pixi_dir().join(LOCK_CACHE_FILE);
+    if let Err(err) = LockFileCache::write(&cache_path, &lock_file_path, &conda_lock) {
+        tracing::warn!("failed to write {}: {err}", cache_path.display());
+    }
 
     Ok(conda_lock)
 }
 
+/// Computes a hash of everything the solution of a platform depends on: the dependencies, the
+/// channels and the virtual packages of the platform. The hash is stored as the content hash of the
+/// platform in the lock-file.
+pub fn platform_fingerprint(project: &Project, platform: Platform) -> miette::Result<String> {
+    let mut content = String::new();
+    writeln!(content, "platform: {platform}").unwrap();
+    for channel in project.channels() {
+        writeln!(content, "channel: {}", channel.base_url()).unwrap();
+    }
+    for (name, spec) in project
+        .all_dependencies(platform)?
+        .into_iter()
+        .sorted_by(|a, b| a.0.cmp(&b.0))
+    {
+        writeln!(content, "dependency: {name} {spec}").unwrap();
+    }
+    for virtual_package in project
+        .virtual_packages(platform)?
+        .into_iter()
+        .sorted_by(|a, b| a.name.cmp(&b.name))
+    {
+        writeln!(
+            content,
+            "virtual package: {} {} {}",
+            virtual_package.name, virtual_package.version, virtual_package.build_string
+        )
+        .unwrap();
+    }
+    Ok(format!("{:x}", compute_bytes_digest::<Sha256>(content)))
+}
+
+/// Solves the dependencies for a single platform and returns the records of the packages to
+/// install.
+#[tracing::instrument(name = "solve", skip_all, fields(platform = %platform))]
+pub fn solve_platform<'a>(
+    platform: Platform,
+    sparse_repo_data: impl IntoIterator<Item = &'a IndexedRepoData>,
+    match_specs: Vec<MatchSpec>,
+    package_names: Vec<String>,
+    virtual_packages: Vec<GenericVirtualPackage>,
+    locked_packages: Vec<RepoDataRecord>,
+) -> miette::Result<Vec<RepoDataRecord>> {
+    // Get the repodata for the current platform and for NoArch
+    let platform_sparse_repo_data = sparse_repo_data.into_iter().filter(|sparse| {
+        sparse.subdir() == platform.as_str() || sparse.subdir() == Platform::NoArch.as_str()
+    });
+
+    // Load only records we need for this platform
+    let available_packages =
+        IndexedRepoData::load_records_recursive(platform_sparse_repo_data, package_names)?;
+
+    // Construct a solver task that we can start solving.
+    let task = rattler_solve::SolverTask {
+        specs: match_specs,
+        available_packages: &available_packages,
+        locked_packages,
+        pinned_packages: vec![],
+        virtual_packages,
+    };
+
+    // Solve the task
+    libsolv_rs::Solver.solve(task).into_diagnostic()
+}
+
 /// Returns the [`RepoDataRecord`]s for the packages of the current platform from the lock-file.
 pub fn get_required_packages(
     lock_file: &CondaLock,
@@ -365,23 +811,127 @@ pub fn get_required_packages(
         .collect()
 }
 
+/// Returns the [`RepoDataRecord`]s for the packages of all platforms in the lock-file. Packages
+/// that are locked for multiple platforms (e.g. `noarch` packages) are only returned once.
+pub fn get_required_packages_of_all_platforms(
+    lock_file: &CondaLock,
+) -> miette::Result<Vec<RepoDataRecord>> {
+    let mut seen = HashSet::new();
+    let mut records = Vec::new();
+    for platform in lock_file.metadata.platforms.iter().copied() {
+        for record in get_required_packages(lock_file, platform)? {
+            if seen.insert(record.url.clone()) {
+                records.push(record);
+            }
+        }
+    }
+    Ok(records)
+}
+
+/// Makes sure the packages of all platforms in the lock-file are available in the package cache,
+/// so they can later be installed without downloading them. Returns the number of packages.
+#[tracing::instrument(skip_all)]
+pub async fn prefetch_packages(
+    lock_file: &CondaLock,
+    cache_dir: PathBuf,
+    download_client: AuthenticatedClient,
+) -> miette::Result<usize> {
+    let records = get_required_packages_of_all_platforms(lock_file)?;
+    let package_cache = PackageCache::new(cache_dir.join("pkgs"));
+
+    let pb = global_multi_progress().add(
+        ProgressBar::new(records.len() as u64)
+            .with_style(default_progress_style())
+            .with_prefix("prefetching"),
+    );
+    pb.enable_steady_tick(Duration::from_millis(100));
+
+    // The same limits as when installing packages apply.
+    let concurrency = InstallConcurrency::from_env();
+    let host_semaphores = records
+        .iter()
+        .filter_map(|record| record.url.host_str().map(ToOwned::to_owned))
+        .unique()
+        .map(|host| {
+            let semaphore = tokio::sync::Semaphore::new(concurrency.downloads_per_host);
+            (host, semaphore)
+        })
+        .collect::<HashMap<_, _>>();
+
+    let count = records.len();
+    let result = stream::iter(records)
+        .map(|record| {
+            let (package_cache, download_client, host_semaphores, pb) =
+                (&package_cache, &download_client, &host_semaphores, &pb);
+            let span = tracing::info_span!("download", package = %record.file_name);
+            async move {
+                let record = &record;
+                network::with_retry(
+                    format!("downloading {}", record.file_name),
+                    |err| network::is_transient(err),
+                    || async move {
+                        // The semaphores are never closed.
+                        let _permit = match record
+                            .url
+                            .host_str()
+                            .and_then(|host| host_semaphores.get(host))
+                        {
+                            Some(semaphore) => semaphore.acquire().await.ok(),
+                            None => None,
+                        };
+                        package_cache
+                            .get_or_fetch_from_url(
+                                &record.package_record,
+                                record.url.clone(),
+                                download_client.clone(),
+                            )
+                            .await
+                    },
+                )
+                .await
+                .into_diagnostic()?;
+                pb.inc(1);
+                Ok::<_, miette::Report>(())
+            }
+            .instrument(span)
+        })
+        .buffer_unordered(concurrency.downloads)
+        .try_collect::<()>()
+        .await;
+    pb.finish_and_clear();
+    result?;
+
+    Ok(count)
+}
+
 /// Executes the transaction on the given environment.
+#[tracing::instrument(skip_all, fields(prefix = %target_prefix.display()))]
 pub async fn execute_transaction(
-    transaction: Transaction<PrefixRecord, RepoDataRecord>,
+    transaction: Transaction<InstalledPackage, RepoDataRecord>,
     target_prefix: PathBuf,
     cache_dir: PathBuf,
     download_client: AuthenticatedClient,
 ) -> miette::Result<()> {
     // Open the package cache
-    let package_cache = PackageCache::new(cache_dir.join("pkgs"));
+    let package_cache_dir = cache_dir.join("pkgs");
+    let package_cache = PackageCache::new(package_cache_dir.clone());
+
+    // Load the index of the installed packages so it can be kept up to date while the transaction
+    // is executed.
+    let prefix = Prefix::new(&target_prefix)?;
+    let prefix_index = std::sync::Mutex::new(PrefixIndex::load(&prefix).await?);
 
     // Create an install driver which helps limit the number of concurrent fileystem operations
     let install_driver = InstallDriver::default();
 
+    // Determine how files are placed from the package cache into the prefix.
+    let link_type = resolve_link_type(LinkMode::from_env()?, &package_cache_dir, prefix.root())?;
+
     // Define default installation options.
     let install_options = InstallOptions {
         python_info: transaction.python_info.clone(),
         platform: Some(transaction.platform),
+        allow_hard_links: Some(matches!(link_type, LinkType::HardLink)),
         ..Default::default()
     };
 
@@ -415,106 +965,340 @@ pub async fn execute_transaction(
     );
     link_pb.enable_steady_tick(Duration::from_millis(100));
 
-    // Perform all transactions operations in parallel.
-    let result = stream::iter(transaction.operations)
-        .map(Ok)
-        .try_for_each_concurrent(50, |op| {
-            let target_prefix = target_prefix.clone();
-            let download_client = download_client.clone();
-            let package_cache = &package_cache;
-            let install_driver = &install_driver;
-            let download_pb = download_pb.as_ref();
-            let link_pb = &link_pb;
-            let install_options = &install_options;
-            async move {
-                execute_operation(
+    // Downloading and linking are performed by two separate stages that are connected by a bounded
+    // queue. Downloads are limited per host so a slow mirror cannot starve the other channels, the
+    // links are limited by what the filesystem can handle.
+    let concurrency = InstallConcurrency::from_env();
+    tracing::debug!(
+        "executing transaction with {} concurrent downloads ({} per host) and {} concurrent links",
+        concurrency.downloads,
+        concurrency.downloads_per_host,
+        concurrency.links
+    );
+    let host_semaphores = transaction
+        .operations
+        .iter()
+        .filter_map(|op| op.record_to_install())
+        .filter_map(|record| record.url.host_str().map(ToOwned::to_owned))
+        .unique()
+        .map(|host| {
+            let semaphore = tokio::sync::Semaphore::new(concurrency.downloads_per_host);
+            (host, semaphore)
+        })
+        .collect::<HashMap<_, _>>();
+    let (downloaded_tx, downloaded_rx) =
+        futures::channel::mpsc::channel(concurrency.downloads + concurrency.links);
+
+    // The download stage makes sure all packages that need to be installed are available in the
+    // package cache and reads the full records of the packages that need to be removed.
+    let download_stage = stream::iter(transaction.operations)
+        .map(|op| {
+            prepare_operation(
+                op,
+                &prefix,
+                &package_cache,
+                &download_client,
+                &host_semaphores,
+                download_pb.as_ref(),
+            )
+        })
+        .buffer_unordered(concurrency.downloads)
+        .forward(downloaded_tx.sink_map_err(|_| miette::miette!("the link stage stopped")));
+
+    // The link stage removes the old packages and links the new packages into the prefix.
+    let link_stage =
+        downloaded_rx
+            .map(Ok)
+            .try_for_each_concurrent(concurrency.links, |operation| {
+                link_operation(
                     &target_prefix,
-                    download_client,
-                    package_cache,
-                    install_driver,
-                    download_pb,
-                    link_pb,
-                    op,
-                    install_options,
+                    &install_driver,
+                    &link_pb,
+                    operation,
+                    &install_options,
+                    &prefix_index,
                 )
-                .await
-            }
-        })
-        .await;
+            });
+
+    let result = tokio::try_join!(download_stage, link_stage);
 
     // Clear progress bars
     if let Some(download_pb) = download_pb {
         download_pb.finish_and_clear();
     }
     link_pb.finish_and_clear();
+    result?;
+
+    // Persist the index now that the conda-meta directory is in its final state. If the
+    // transaction failed the index is left as is, it will be rebuilt the next time it is loaded
+    // because the conda-meta directory no longer matches.
+    let mut prefix_index = prefix_index
+        .into_inner()
+        .expect("the prefix index lock is poisoned");
+    if let Err(err) = prefix_index.write(&prefix) {
+        tracing::warn!(
+            "failed to write the index of {}: {err}",
+            prefix.root().display()
+        );
+    }
 
-    result
+    Ok(())
 }
 
-/// Executes a single operation of a transaction on the environment.
-/// TODO: Move this into an object or something.
-#[allow(clippy::too_many_arguments)]
-async fn execute_operation(
+/// Determines the [`LinkType`] to use to place files from the package cache into the prefix for
+/// the given [`LinkMode`]. Whether hardlinks and reflinks can be created between the two
+/// directories is only probed once per pair of directories.
+///
+/// Reflinks are performed by copying the files: the standard library copies files with
+/// `copy_file_range` on Linux and `fclonefileat` on macOS which share the data between the files
+/// on filesystems that support it. That is also why reflinks are recorded as copies. The probe
+/// only determines whether the copies will share their data, which is logged.
+fn resolve_link_type(
+    mode: LinkMode,
+    package_cache_dir: &Path,
     target_prefix: &Path,
-    download_client: AuthenticatedClient,
-    package_cache: &PackageCache,
-    install_driver: &InstallDriver,
-    download_pb: Option<&ProgressBar>,
-    link_pb: &ProgressBar,
-    op: TransactionOperation<PrefixRecord, RepoDataRecord>,
-    install_options: &InstallOptions,
-) -> miette::Result<()> {
-    // Determine the package to install
-    let install_record = op.record_to_install();
-    let remove_record = op.record_to_remove();
+) -> miette::Result<LinkType> {
+    type Probes = Lazy<std::sync::Mutex<HashMap<(PathBuf, PathBuf), bool>>>;
+    static HARD_LINK_PROBES: Probes = Lazy::new(Default::default);
+    static REFLINK_PROBES: Probes = Lazy::new(Default::default);
+
+    let probe = |probes: &Probes, probe: fn(&Path, &Path) -> bool| {
+        *probes
+            .lock()
+            .expect("the probe cache is poisoned")
+            .entry((package_cache_dir.to_path_buf(), target_prefix.to_path_buf()))
+            .or_insert_with(|| probe(package_cache_dir, target_prefix))
+    };
 
-    // Create a future to remove the existing package
-    let remove_future = if let Some(remove_record) = remove_record {
-        remove_package_from_environment(target_prefix, remove_record).left_future()
-    } else {
-        ready(Ok(())).right_future()
+    let link_type = match mode {
+        LinkMode::Auto if probe(&HARD_LINK_PROBES, can_hard_link) => LinkType::HardLink,
+        LinkMode::Auto | LinkMode::RefLink | LinkMode::Copy => LinkType::Copy,
+        LinkMode::HardLink if probe(&HARD_LINK_PROBES, can_hard_link) => LinkType::HardLink,
+        LinkMode::HardLink => miette::bail!(
+            "cannot create hardlinks from the package cache ({}) to the environment ({}), they are probably on different filesystems. Use another link mode.",
+            package_cache_dir.display(),
+            target_prefix.display()
+        ),
     };
 
-    // Create a future to download the package
-    let cached_package_dir_fut = if let Some(install_record) = install_record {
-        async {
-            // Make sure the package is available in the package cache.
-            let result = package_cache
-                .get_or_fetch_from_url(
-                    &install_record.package_record,
-                    install_record.url.clone(),
-                    download_client.clone(),
-                )
-                .map_ok(|cache_dir| Some((install_record.clone(), cache_dir)))
-                .await
-                .into_diagnostic();
+    // Copies share their data with the package cache if the filesystem supports reflinks.
+    let reflink = matches!(link_type, LinkType::Copy)
+        && mode != LinkMode::Copy
+        && probe(&REFLINK_PROBES, can_reflink);
+    if mode == LinkMode::RefLink && !reflink {
+        tracing::warn!(
+            "cannot create reflinks from the package cache ({}) to the environment ({}), the files are copied instead",
+            package_cache_dir.display(),
+            target_prefix.display()
+        );
+    }
 
-            // Increment the download progress bar.
-            if let Some(pb) = download_pb {
-                pb.inc(1);
-                if pb.length() == Some(pb.position()) {
-                    pb.set_style(finished_progress_style());
-                }
-            }
+    let used = match link_type {
+        LinkType::HardLink => "hardlinks",
+        _ if reflink => "reflinks",
+        _ => "copies",
+    };
+    tracing::debug!("using {used} to install packages (link mode {mode:?})");
+    Ok(link_type)
+}
+
+/// Returns true if a hardlink can be created from a file in the source directory to a file in the
+/// target directory.
+fn can_hard_link(source_dir: &Path, target_dir: &Path) -> bool {
+    if std::fs::create_dir_all(source_dir).is_err() || std::fs::create_dir_all(target_dir).is_err()
+    {
+        return false;
+    }
+
+    let Ok(source) = tempfile::NamedTempFile::new_in(source_dir) else {
+        return false;
+    };
+    let target = target_dir.join(format!(".pixi-link-probe-{}", std::process::id()));
+    let result = std::fs::hard_link(source.path(), &target).is_ok();
+    let _ = std::fs::remove_file(&target);
+    result
+}
+
+/// Returns true if the data of a file in the source directory can be shared with a file in the
+/// target directory, i.e. they are on the same copy-on-write filesystem.
+#[cfg(target_os = "linux")]
+fn can_reflink(source_dir: &Path, target_dir: &Path) -> bool {
+    use std::io::Write as _;
+    use std::os::unix::io::AsRawFd;
 
-            result
+    if std::fs::create_dir_all(source_dir).is_err() || std::fs::create_dir_all(target_dir).is_err()
+    {
+        return false;
+    }
+    let Ok(mut source) = tempfile::NamedTempFile::new_in(source_dir) else {
+        return false;
+    };
+    let Ok(target) = tempfile::NamedTempFile::new_in(target_dir) else {
+        return false;
+    };
+    if source
+        .write_all(b"pixi")
+        .and_then(|_| source.flush())
+        .is_err()
+    {
+        return false;
+    }
+    // SAFETY: both file descriptors stay open for the duration of the call.
+    unsafe {
+        libc::ioctl(
+            target.as_file().as_raw_fd(),
+            libc::FICLONE,
+            source.as_file().as_raw_fd(),
+        ) == 0
+    }
+}
+
+/// Returns true if the data of a file in the source directory can be shared with a file in the
+/// target directory, i.e. they are on the same copy-on-write filesystem.
+#[cfg(target_os = "macos")]
+fn can_reflink(source_dir: &Path, target_dir: &Path) -> bool {
+    use std::os::unix::ffi::OsStrExt;
+
+    if std::fs::create_dir_all(source_dir).is_err() || std::fs::create_dir_all(target_dir).is_err()
+    {
+        return false;
+    }
+    let Ok(source) = tempfile::NamedTempFile::new_in(source_dir) else {
+        return false;
+    };
+    let target = target_dir.join(format!(".pixi-reflink-probe-{}", std::process::id()));
+    let (Ok(source_path), Ok(target_path)) = (
+        std::ffi::CString::new(source.path().as_os_str().as_bytes()),
+        std::ffi::CString::new(target.as_os_str().as_bytes()),
+    ) else {
+        return false;
+    };
+    // SAFETY: both paths are nul terminated strings.
+    let result = unsafe { libc::clonefile(source_path.as_ptr(), target_path.as_ptr(), 0) } == 0;
+    let _ = std::fs::remove_file(&target);
+    result
+}
+
+/// Reflinks are only probed on Linux and macOS, other platforms always copy the data.
+#[cfg(not(any(target_os = "linux", target_os = "macos")))]
+fn can_reflink(_source_dir: &Path, _target_dir: &Path) -> bool {
+    false
+}
+
+/// An operation of a transaction that is ready to be applied to the prefix.
+struct PreparedOperation {
+    /// The package to install and its directory in the package cache.
+    install: Option<(RepoDataRecord, PathBuf)>,
+
+    /// The full record of the package to remove.
+    remove: Option<PrefixRecord>,
+}
+
+/// The first stage of executing an operation: makes sure the package that needs to be installed, if
+/// any, is available in the package cache and concurrently reads the full record of the package
+/// to remove, if any.
+async fn prepare_operation(
+    op: TransactionOperation<InstalledPackage, RepoDataRecord>,
+    prefix: &Prefix,
+    package_cache: &PackageCache,
+    download_client: &AuthenticatedClient,
+    host_semaphores: &HashMap<String, tokio::sync::Semaphore>,
+    download_pb: Option<&ProgressBar>,
+) -> miette::Result<PreparedOperation> {
+    let remove_future = async {
+        match op.record_to_remove() {
+            Some(package) => package.load_prefix_record(prefix).await.map(Some),
+            None => Ok(None),
         }
-        .left_future()
-    } else {
-        ready(Ok(None)).right_future()
     };
 
-    // Await removal and downloading concurrently
-    let (_, install_package) = tokio::try_join!(remove_future, cached_package_dir_fut)?;
+    let download_future = async {
+        let Some(install_record) = op.record_to_install() else {
+            return Ok(None);
+        };
+
+        // Make sure the package is available in the package cache.
+        let package_dir = network::with_retry(
+            format!("downloading {}", install_record.file_name),
+            |err| network::is_transient(err),
+            || async move {
+                // Limit the number of concurrent requests to the same host. The permit is released
+                // while waiting for a retry. The semaphores are never closed.
+                let _permit = match install_record
+                    .url
+                    .host_str()
+                    .and_then(|host| host_semaphores.get(host))
+                {
+                    Some(semaphore) => semaphore.acquire().await.ok(),
+                    None => None,
+                };
+                package_cache
+                    .get_or_fetch_from_url(
+                        &install_record.package_record,
+                        install_record.url.clone(),
+                        download_client.clone(),
+                    )
+                    .await
+            },
+        )
+        .await
+        .into_diagnostic()?;
+
+        // Increment the download progress bar.
+        if let Some(pb) = download_pb {
+            pb.inc(1);
+            if pb.length() == Some(pb.position()) {
+                pb.set_style(finished_progress_style());
+            }
+        }
+
+        Ok(Some((install_record.clone(), package_dir)))
+    }
+    .instrument(tracing::info_span!(
+        "download",
+        package = op.record_to_install().map(|r| r.file_name.as_str())
+    ));
+
+    let (remove, install) = tokio::try_join!(remove_future, download_future)?;
+    Ok(PreparedOperation { install, remove })
+}
+
+/// The second stage of executing an operation: removes the existing package from the environment
+/// and links the downloaded package into it.
+#[tracing::instrument(name = "link", skip_all)]
+async fn link_operation(
+    target_prefix: &Path,
+    install_driver: &InstallDriver,
+    link_pb: &ProgressBar,
+    operation: PreparedOperation,
+    install_options: &InstallOptions,
+    prefix_index: &std::sync::Mutex<PrefixIndex>,
+) -> miette::Result<()> {
+    // Remove the existing package. Files that are also part of the new package are not removed,
+    // they are replaced when the new package is linked.
+    if let Some(remove_record) = &operation.remove {
+        let replaced_paths = match &operation.install {
+            Some((_, package_dir)) => package_paths(package_dir.clone()).await,
+            None => HashSet::new(),
+        };
+        remove_package_from_environment(
+            target_prefix,
+            remove_record,
+            &replaced_paths,
+            prefix_index,
+        )
+        .await?;
+    }
 
     // If there is a package to install, do that now.
-    if let Some((record, package_dir)) = install_package {
+    if let Some((record, package_dir)) = operation.install {
         install_package_to_environment(
             target_prefix,
             package_dir,
-            record.clone(),
+            record,
             install_driver,
             install_options,
+            prefix_index,
         )
         .await?;
     }
@@ -528,14 +1312,55 @@ async fn execute_operation(
     Ok(())
 }
 
+/// Returns the paths of the files of the extracted package in the given directory. Returns an empty
+/// set if the paths could not be determined.
+async fn package_paths(package_dir: PathBuf) -> HashSet<PathBuf> {
+    let result = run_blocking(move || {
+        PathsJson::from_package_directory(&package_dir)
+            .into_diagnostic()
+            .map(|paths_json| {
+                paths_json
+                    .paths
+                    .into_iter()
+                    .map(|entry| entry.relative_path)
+                    .collect()
+            })
+    })
+    .await;
+    match result {
+        Ok(paths) => paths,
+        Err(err) => {
+            tracing::debug!("failed to read the paths of a package, removing all files: {err}");
+            HashSet::new()
+        }
+    }
+}
+
+/// Runs a blocking function on the tokio blocking thread pool.
+pub(crate) async fn run_blocking<T: Send + 'static>(
+    f: impl FnOnce() -> miette::Result<T> + Send + 'static,
+) -> miette::Result<T> {
+    match tokio::task::spawn_blocking(f).await {
+        Ok(result) => result,
+        Err(err) => {
+            if let Ok(panic) = err.try_into_panic() {
+                std::panic::resume_unwind(panic);
+            }
+            Err(miette::miette!("cancelled"))
+        }
+    }
+}
+
 /// Install a package into the environment and write a `conda-meta` file that contains information
 /// about how the file was linked.
+#[tracing::instrument(name = "install", skip_all, fields(package = %repodata_record.file_name))]
 async fn install_package_to_environment(
     target_prefix: &Path,
     package_dir: PathBuf,
     repodata_record: RepoDataRecord,
     install_driver: &InstallDriver,
     install_options: &InstallOptions,
+    prefix_index: &std::sync::Mutex<PrefixIndex>,
 ) -> miette::Result<()> {
     // Link the contents of the package into our environment. This returns all the paths that were
     // linked.
@@ -548,6 +1373,16 @@ async fn install_package_to_environment(
     .await
     .into_diagnostic()?;
 
+    // Record how the files were linked
+    let link = Link {
+        source: package_dir.clone(),
+        link_type: Some(if install_options.allow_hard_links == Some(true) {
+            LinkType::HardLink
+        } else {
+            LinkType::Copy
+        }),
+    };
+
     // Construct a PrefixRecord for the package
     let prefix_record = PrefixRecord {
         repodata_record,
@@ -560,8 +1395,7 @@ async fn install_package_to_environment(
         paths_data: paths.into(),
         // TODO: Retrieve the requested spec for this package from the request
         requested_spec: None,
-        // TODO: What to do with this?
-        link: None,
+        link: Some(link),
     };
 
     // Create the conda-meta directory if it doesnt exist yet.
@@ -571,17 +1405,22 @@ async fn install_package_to_environment(
         std::fs::create_dir_all(&conda_meta_path)?;
 
         // Write the conda-meta information
-        let pkg_meta_path = conda_meta_path.join(format!(
-            "{}-{}-{}.json",
-            prefix_record.repodata_record.package_record.name,
-            prefix_record.repodata_record.package_record.version,
-            prefix_record.repodata_record.package_record.build
+        let pkg_meta_path = conda_meta_path.join(conda_meta_file_name(
+            &prefix_record.repodata_record.package_record,
         ));
-        prefix_record.write_to_path(pkg_meta_path, true)
+        prefix_record.write_to_path(pkg_meta_path, true)?;
+        Ok::<_, std::io::Error>(InstalledPackage::from(prefix_record))
     })
     .await
     {
-        Ok(result) => Ok(result.into_diagnostic()?),
+        Ok(result) => {
+            let installed_package = result.into_diagnostic()?;
+            prefix_index
+                .lock()
+                .expect("the prefix index lock is poisoned")
+                .insert(installed_package);
+            Ok(())
+        }
         Err(err) => {
             if let Ok(panic) = err.try_into_panic() {
                 std::panic::resume_unwind(panic);
@@ -592,40 +1431,202 @@ async fn install_package_to_environment(
     }
 }
 
-/// Completely remove the specified package from the environment.
+/// Completely remove the specified package from the environment. Files that are in
+/// `replaced_paths` are kept because they will be overwritten by another package.
+///
+/// Files are removed in parallel batches of files that are in the same directory. Afterwards all
+/// directories that became empty are removed as well.
+#[tracing::instrument(name = "remove", skip_all, fields(package = %package.repodata_record.file_name))]
 async fn remove_package_from_environment(
     target_prefix: &Path,
     package: &PrefixRecord,
+    replaced_paths: &HashSet<PathBuf>,
+    prefix_index: &std::sync::Mutex<PrefixIndex>,
 ) -> miette::Result<()> {
     // TODO: Take into account any clobbered files, they need to be restored.
-    // TODO: Can we also delete empty directories?
 
-    // Remove all entries
-    for paths in package.paths_data.paths.iter() {
-        match tokio::fs::remove_file(target_prefix.join(&paths.relative_path)).await {
+    // Group the files per directory and split them into batches.
+    let paths_by_directory = package
+        .paths_data
+        .paths
+        .iter()
+        .map(|entry| &entry.relative_path)
+        .filter(|path| !replaced_paths.contains(*path))
+        .into_group_map_by(|path| path.parent().map(Path::to_path_buf).unwrap_or_default());
+    let directories = paths_by_directory.keys().cloned().collect_vec();
+    let batches = paths_by_directory
+        .into_values()
+        .flat_map(|paths| {
+            paths
+                .chunks(REMOVE_BATCH_SIZE)
+                .map(|chunk| {
+                    chunk
+                        .iter()
+                        .map(|path| target_prefix.join(path))
+                        .collect_vec()
+                })
+                .collect_vec()
+        })
+        .collect_vec();
+
+    // Remove the batches in parallel
+    let concurrency = std::thread::available_parallelism()
+        .map(NonZeroUsize::get)
+        .unwrap_or(4);
+    stream::iter(batches)
+        .map(|batch| run_blocking(move || remove_files(batch)))
+        .buffer_unordered(concurrency)
+        .try_collect::<()>()
+        .await?;
+
+    // Remove the directories that are empty now, the deepest directories first.
+    let target_prefix_buf = target_prefix.to_path_buf();
+    run_blocking(move || {
+        prune_empty_directories(&target_prefix_buf, directories);
+        Ok(())
+    })
+    .await?;
+
+    // Remove the conda-meta file
+    let conda_meta_path = target_prefix.join("conda-meta").join(conda_meta_file_name(
+        &package.repodata_record.package_record,
+    ));
+    tokio::fs::remove_file(conda_meta_path)
+        .await
+        .into_diagnostic()?;
+    prefix_index
+        .lock()
+        .expect("the prefix index lock is poisoned")
+        .remove(&package.repodata_record.package_record);
+
+    Ok(())
+}
+
+/// The maximum number of files that are removed by a single blocking task.
+const REMOVE_BATCH_SIZE: usize = 256;
+
+/// Removes the given files, ignoring files that do not exist.
+fn remove_files(paths: Vec<PathBuf>) -> miette::Result<()> {
+    for path in paths {
+        match std::fs::remove_file(&path) {
             Ok(_) => {}
             Err(e) if e.kind() == ErrorKind::NotFound => {
                 // Simply ignore if the file is already gone.
             }
             Err(e) => {
-                return Err(e).into_diagnostic().wrap_err(format!(
-                    "failed to delete {}",
-                    paths.relative_path.display()
-                ))
+                return Err(e)
+                    .into_diagnostic()
+                    .wrap_err(format!("failed to delete {}", path.display()))
             }
         }
     }
+    Ok(())
+}
 
-    // Remove the conda-meta file
-    let conda_meta_path = target_prefix.join("conda-meta").join(format!(
-        "{}-{}-{}.json",
-        package.repodata_record.package_record.name,
-        package.repodata_record.package_record.version,
-        package.repodata_record.package_record.build
-    ));
-    tokio::fs::remove_file(conda_meta_path)
-        .await
-        .into_diagnostic()?;
+/// Removes the given directories (relative to the prefix) and their parents if they are empty.
+fn prune_empty_directories(target_prefix: &Path, directories: Vec<PathBuf>) {
+    let mut candidates = HashSet::new();
+    for directory in directories {
+        let mut current = Some(directory.as_path());
+        while let Some(dir) = current.filter(|dir| !dir.as_os_str().is_empty()) {
+            if !candidates.insert(dir.to_path_buf()) {
+                break;
+            }
+            current = dir.parent();
+        }
+    }
 
-    Ok(())
+    for directory in candidates
+        .into_iter()
+        .sorted_by_key(|dir| std::cmp::Reverse(dir.components().count()))
+    {
+        // Removing a directory that is not empty fails, which is exactly what we want.
+        let _ = std::fs::remove_dir(target_prefix.join(directory));
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_prune_empty_directories() {
+        let dir = tempfile::tempdir().unwrap();
+        std::fs::create_dir_all(dir.path().join("lib/python/site-packages/foo")).unwrap();
+        std::fs::create_dir_all(dir.path().join("lib/python/site-packages/bar")).unwrap();
+        std::fs::write(dir.path().join("lib/python/site-packages/bar/file"), "").unwrap();
+        std::fs::create_dir_all(dir.path().join("share/foo")).unwrap();
+
+        prune_empty_directories(
+            dir.path(),
+            vec![
+                PathBuf::from("lib/python/site-packages/foo"),
+                PathBuf::from("lib/python/site-packages/bar"),
+                PathBuf::from("share/foo"),
+            ],
+        );
+
+        assert!(!dir.path().join("lib/python/site-packages/foo").exists());
+        assert!(dir
+            .path()
+            .join("lib/python/site-packages/bar/file")
+            .exists());
+        assert!(!dir.path().join("share").exists());
+        assert!(dir.path().exists());
+    }
+
+    #[test]
+    fn test_platform_fingerprint() {
+        let manifest = r#"
+            [project]
+            name = "foo"
+            version = "0.1.0"
+            channels = ["conda-forge"]
+            platforms = ["linux-64", "win-64"]
+
+            [dependencies]
+            python = "3.11.*"
+            "#;
+        let project = Project::from_manifest_str(Path::new(""), manifest).unwrap();
+        let windows_project = Project::from_manifest_str(
+            Path::new(""),
+            format!("{manifest}\n[target.win-64.dependencies]\nmenuinst = \"*\""),
+        )
+        .unwrap();
+
+        // A dependency for a single platform only changes the fingerprint of that platform.
+        assert_eq!(
+            platform_fingerprint(&project, Platform::Linux64).unwrap(),
+            platform_fingerprint(&windows_project, Platform::Linux64).unwrap()
+        );
+        assert_ne!(
+            platform_fingerprint(&project, Platform::Win64).unwrap(),
+            platform_fingerprint(&windows_project, Platform::Win64).unwrap()
+        );
+    }
+
+    #[tokio::test]
+    async fn test_frozen_requires_lock_file() {
+        let dir = tempfile::tempdir().unwrap();
+        let project = Project::from_manifest_str(
+            dir.path(),
+            format!(
+                r#"
+                [project]
+                name = "foo"
+                version = "0.1.0"
+                channels = ["conda-forge"]
+                platforms = ["{}"]
+                "#,
+                Platform::current()
+            ),
+        )
+        .unwrap();
+
+        // Without a lock-file there is nothing to install, a new lock-file is not created.
+        assert!(get_up_to_date_prefix(&project, LockFileUsage::Frozen)
+            .await
+            .is_err());
+        assert!(!project.lock_file_path().exists());
+    }
 }
@@ -0,0 +1,242 @@
+//! Defines the format of offline bundles. A bundle contains the package archives of all the
+//! packages in a lock-file together with their repodata records, so the package cache of a machine
+//! without network access can be filled with a single sequential read.
+//!
+//! A bundle is a stream of entries, all integers are stored little-endian:
+//!
+//! ```text
+//! header:  magic (8 bytes)
+//! entry:   record length (u32), the repodata record as json, archive length (u64), archive
+//! trailer: a record length of 0
+//! ```
+
+use super::get_required_packages_of_all_platforms;
+use crate::binary::{has_magic, MAGIC_LEN};
+use crate::network;
+use crate::progress::{default_progress_style, global_multi_progress};
+use futures::{stream, StreamExt};
+use indicatif::ProgressBar;
+use miette::{Context, IntoDiagnostic};
+use rattler::package_cache::PackageCache;
+use rattler_conda_types::{conda_lock::CondaLock, RepoDataRecord};
+use rattler_digest::{compute_file_digest, Sha256};
+use rattler_networking::AuthenticatedClient;
+use std::path::{Path, PathBuf};
+use std::time::Duration;
+use tokio::io::{AsyncReadExt, AsyncWriteExt, BufReader, BufWriter};
+use url::Url;
+
+/// The magic bytes at the start of every bundle. The last byte is the version of the format.
+const BUNDLE_MAGIC: &[u8; MAGIC_LEN] = b"PIXIBDL\x01";
+
+/// The maximum number of package archives that are downloaded at the same time while exporting.
+const EXPORT_CONCURRENCY: usize = 8;
+
+/// Writes a bundle with the packages of all platforms in the lock-file to `path`. The archives are
+/// downloaded concurrently and appended to the bundle in the order they finish downloading.
+#[tracing::instrument(skip_all, fields(path = %path.display()))]
+pub async fn export_bundle(
+    lock_file: &CondaLock,
+    path: &Path,
+    download_client: AuthenticatedClient,
+) -> miette::Result<usize> {
+    let records = get_required_packages_of_all_platforms(lock_file)?;
+    let download_dir = tempfile::tempdir().into_diagnostic()?;
+    let mut bundle = BufWriter::new(
+        tokio::fs::File::create(path)
+            .await
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to create {}", path.display()))?,
+    );
+    bundle.write_all(BUNDLE_MAGIC).await.into_diagnostic()?;
+
+    let pb = global_multi_progress().add(
+        ProgressBar::new(records.len() as u64)
+            .with_style(default_progress_style())
+            .with_prefix("bundling"),
+    );
+    pb.enable_steady_tick(Duration::from_millis(100));
+    let count = records.len();
+    let mut downloads = stream::iter(records)
+        .map(|record| {
+            let archive_path = download_dir.path().join(&record.file_name);
+            let download_client = download_client.clone();
+            async move {
+                network::with_retry(
+                    format!("downloading {}", record.file_name),
+                    |err| network::is_transient(err.as_ref()),
+                    || download_archive(&download_client, &record.url, &archive_path),
+                )
+                .await
+                .map_err(|err| miette::miette!("failed to download {}: {err}", record.url))?;
+                Ok::<_, miette::Report>((record, archive_path))
+            }
+        })
+        .buffer_unordered(EXPORT_CONCURRENCY);
+
+    while let Some(download) = downloads.next().await {
+        let (record, archive_path) = download?;
+        let record_json = serde_json::to_vec(&record).into_diagnostic()?;
+        let mut archive = tokio::fs::File::open(&archive_path)
+            .await
+            .into_diagnostic()?;
+        let archive_len = archive.metadata().await.into_diagnostic()?.len();
+
+        bundle
+            .write_u32_le(record_json.len() as u32)
+            .await
+            .into_diagnostic()?;
+        bundle.write_all(&record_json).await.into_diagnostic()?;
+        bundle.write_u64_le(archive_len).await.into_diagnostic()?;
+        tokio::io::copy(&mut archive, &mut bundle)
+            .await
+            .into_diagnostic()?;
+        drop(archive);
+        tokio::fs::remove_file(&archive_path)
+            .await
+            .into_diagnostic()?;
+        pb.inc(1);
+    }
+    pb.finish_and_clear();
+
+    bundle.write_u32_le(0).await.into_diagnostic()?;
+    bundle.flush().await.into_diagnostic()?;
+    Ok(count)
+}
+
+/// Reads a bundle and extracts all the packages in it into the package cache. Returns the number
+/// of packages in the bundle.
+#[tracing::instrument(skip_all, fields(path = %path.display()))]
+pub async fn import_bundle(path: &Path, cache_dir: PathBuf) -> miette::Result<usize> {
+    let package_cache = PackageCache::new(cache_dir.join("pkgs"));
+    let extract_dir = tempfile::tempdir().into_diagnostic()?;
+    let mut bundle = BufReader::new(
+        tokio::fs::File::open(path)
+            .await
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to open {}", path.display()))?,
+    );
+
+    let mut magic = [0u8; MAGIC_LEN];
+    bundle.read_exact(&mut magic).await.into_diagnostic()?;
+    if !has_magic(&magic, BUNDLE_MAGIC) {
+        miette::bail!("{} is not a pixi bundle", path.display());
+    }
+
+    let pb = global_multi_progress().add(ProgressBar::new_spinner());
+    pb.enable_steady_tick(Duration::from_millis(100));
+    pb.set_message("importing bundle");
+    let mut count = 0;
+    loop {
+        let record_len = bundle.read_u32_le().await.into_diagnostic()? as usize;
+        if record_len == 0 {
+            break;
+        }
+        let mut record_json = vec![0u8; record_len];
+        bundle
+            .read_exact(&mut record_json)
+            .await
+            .into_diagnostic()?;
+        let record: RepoDataRecord = serde_json::from_slice(&record_json).into_diagnostic()?;
+
+        // Copy the archive out of the bundle, the extension of the file determines how the
+        // archive is extracted.
+        let archive_len = bundle.read_u64_le().await.into_diagnostic()?;
+        let archive_path = extract_dir.path().join(&record.file_name);
+        let mut archive = tokio::fs::File::create(&archive_path)
+            .await
+            .into_diagnostic()?;
+        let copied = tokio::io::copy(&mut (&mut bundle).take(archive_len), &mut archive)
+            .await
+            .into_diagnostic()?;
+        archive.flush().await.into_diagnostic()?;
+        drop(archive);
+        if copied != archive_len {
+            miette::bail!("{} is truncated", path.display());
+        }
+
+        if let Some(expected) = record.package_record.sha256 {
+            let archive_path = archive_path.clone();
+            let digest =
+                tokio::task::spawn_blocking(move || compute_file_digest::<Sha256>(archive_path))
+                    .await
+                    .into_diagnostic()?
+                    .into_diagnostic()?;
+            if digest != expected {
+                miette::bail!(
+                    "the archive of {} in the bundle does not match its sha256",
+                    record.file_name
+                );
+            }
+        }
+
+        let url = Url::from_file_path(&archive_path)
+            .map_err(|_| miette::miette!("invalid path {}", archive_path.display()))?;
+        package_cache
+            .get_or_fetch_from_url(&record.package_record, url, network::authenticated_client())
+            .await
+            .into_diagnostic()?;
+        tokio::fs::remove_file(&archive_path)
+            .await
+            .into_diagnostic()?;
+
+        count += 1;
+        pb.set_message(format!("importing bundle ({count} packages)"));
+    }
+    pb.finish_and_clear();
+
+    Ok(count)
+}
+
+/// Downloads the archive at `url` to `path`, local channels are copied. The errors are kept as they
+/// are so [`network::is_transient`] can decide whether to retry.
+async fn download_archive(
+    download_client: &AuthenticatedClient,
+    url: &Url,
+    path: &Path,
+) -> Result<(), Box<dyn std::error::Error + Send + Sync>> {
+    if url.scheme() == "file" {
+        let source = url.to_file_path().map_err(|_| "invalid file url")?;
+        tokio::fs::copy(source, path).await?;
+        return Ok(());
+    }
+
+    let mut response = download_client
+        .get(url.clone())
+        .send()
+        .await?
+        .error_for_status()?;
+    let mut file = BufWriter::new(tokio::fs::File::create(path).await?);
+    while let Some(chunk) = response.chunk().await? {
+        file.write_all(&chunk).await?;
+    }
+    file.flush().await?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[tokio::test]
+    async fn test_import_bundle_format() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache_dir = dir.path().join("cache");
+
+        // An empty bundle only consists of the header and the trailer
+        let bundle_path = dir.path().join("empty.bundle");
+        let mut bundle = BUNDLE_MAGIC.to_vec();
+        bundle.extend_from_slice(&0u32.to_le_bytes());
+        std::fs::write(&bundle_path, bundle).unwrap();
+        assert_eq!(
+            import_bundle(&bundle_path, cache_dir.clone())
+                .await
+                .unwrap(),
+            0
+        );
+
+        let bundle_path = dir.path().join("pixi.lock");
+        std::fs::write(&bundle_path, "version: 1").unwrap();
+        assert!(import_bundle(&bundle_path, cache_dir).await.is_err());
+    }
+}
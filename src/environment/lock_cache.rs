@@ -0,0 +1,273 @@
+//! Defines [`LockFileCache`], a binary cache of the `pixi.lock` of a project that is stored in the
+//! `.pixi` directory. Parsing the yaml lock-file is slow for large lock-files, the cache stores the
+//! lock-file as json together with the [`RepoDataRecord`]s of every platform so the records of a
+//! single platform can be read without touching the rest of the file. The yaml lock-file remains
+//! the source of truth, the cache is only used as long as the lock-file did not change.
+//!
+//! The cache has the following layout, all integers are stored little-endian:
+//!
+//! ```text
+//! header:    magic (8 bytes), lock-file length (u64), lock-file modification time in ns (u64),
+//!            lock-file sha256 (32 bytes), lock offset (u64), lock length (u64),
+//!            platform count (u64)
+//! platforms: per platform: name offset (u64), name length (u64), records offset (u64),
+//!            records length (u64)
+//! data:      the names of the platforms, the lock-file as json and the records of every platform
+//!            as a json array
+//! ```
+
+use crate::binary::{has_magic, read_range, read_u64, read_usize, MAGIC_LEN};
+use memmap2::Mmap;
+use miette::IntoDiagnostic;
+use rattler_conda_types::{conda_lock::CondaLock, Platform, RepoDataRecord};
+use rattler_digest::{compute_file_digest, Sha256, Sha256Hash};
+use std::fs::File;
+use std::io::Write;
+use std::ops::Range;
+use std::path::Path;
+use std::time::UNIX_EPOCH;
+
+/// The name of the cache file in the `.pixi` directory.
+pub const LOCK_CACHE_FILE: &str = "lock-cache";
+
+/// The magic bytes at the start of every cache file. The last byte is the version of the format.
+const CACHE_MAGIC: &[u8; MAGIC_LEN] = b"PIXILCK\x01";
+
+const HEADER_SIZE: usize = 80;
+const PLATFORM_ENTRY_SIZE: usize = 32;
+
+/// A memory-mapped cache of a lock-file, see the module documentation.
+pub struct LockFileCache {
+    cache: Mmap,
+}
+
+impl LockFileCache {
+    /// Opens the cache at `cache_path` if it exists and was created from the current contents of
+    /// the lock-file at `lock_file_path`.
+    pub fn open(cache_path: &Path, lock_file_path: &Path) -> Option<Self> {
+        Self::open_impl(cache_path, lock_file_path, None)
+    }
+
+    /// Same as [`Self::open`] but the sha256 hash of the lock-file was already computed by the
+    /// caller, so the lock-file is not read again.
+    pub fn open_with_hash(
+        cache_path: &Path,
+        lock_file_path: &Path,
+        lock_file_hash: &Sha256Hash,
+    ) -> Option<Self> {
+        Self::open_impl(cache_path, lock_file_path, Some(lock_file_hash))
+    }
+
+    fn open_impl(
+        cache_path: &Path,
+        lock_file_path: &Path,
+        lock_file_hash: Option<&Sha256Hash>,
+    ) -> Option<Self> {
+        let file = File::open(cache_path).ok()?;
+        // SAFETY: Cache files are replaced atomically and never modified in place.
+        let cache = unsafe { Mmap::map(&file) }.ok()?;
+        if cache.len() < HEADER_SIZE || !has_magic(&cache, CACHE_MAGIC) {
+            return None;
+        }
+
+        // Check the cheap properties first before hashing the lock-file.
+        let (len, mtime) = file_stamp(lock_file_path)?;
+        if read_u64(&cache, 8) != Some(len) || read_u64(&cache, 16) != Some(mtime) {
+            return None;
+        }
+        let cached_hash = cache.get(24..56)?;
+        let hash_matches = match lock_file_hash {
+            Some(hash) => cached_hash == &hash[..],
+            None => cached_hash == &compute_file_digest::<Sha256>(lock_file_path).ok()?[..],
+        };
+        if !hash_matches {
+            return None;
+        }
+
+        // Every range in the cache has to be inside the file.
+        let result = Self { cache };
+        let range_count = read_usize(&result.cache, 72)?
+            .checked_mul(2)?
+            .checked_add(1)?;
+        let ranges = result
+            .platform_entries()
+            .flat_map(|(name, records)| [name, records])
+            .chain([result.lock_range()?])
+            .collect::<Vec<_>>();
+        let valid = ranges.len() == range_count
+            && ranges.iter().all(|range| range.end <= result.cache.len());
+        valid.then_some(result)
+    }
+
+    /// Returns the cached lock-file.
+    pub fn lock_file(&self) -> miette::Result<CondaLock> {
+        serde_json::from_slice(self.slice(self.lock_range())?).into_diagnostic()
+    }
+
+    /// Returns the records of the packages of the given platform, or `None` if the lock-file does
+    /// not contain the platform. Only the records of the platform are deserialized.
+    pub fn records(&self, platform: Platform) -> miette::Result<Option<Vec<RepoDataRecord>>> {
+        let Some((_, records)) = self
+            .platform_entries()
+            .find(|(name, _)| self.cache.get(name.clone()) == Some(platform.as_str().as_bytes()))
+        else {
+            return Ok(None);
+        };
+        serde_json::from_slice(self.slice(Some(records))?)
+            .into_diagnostic()
+            .map(Some)
+    }
+
+    /// Writes a cache of the lock-file at `lock_file_path` which was parsed into `lock_file`.
+    pub fn write(
+        cache_path: &Path,
+        lock_file_path: &Path,
+        lock_file: &CondaLock,
+    ) -> miette::Result<()> {
+        let (len, mtime) = file_stamp(lock_file_path)
+            .ok_or_else(|| miette::miette!("failed to read the metadata of the lock-file"))?;
+        let hash = compute_file_digest::<Sha256>(lock_file_path).into_diagnostic()?;
+
+        // Serialize the lock-file and the records of every platform
+        let mut platforms = Vec::with_capacity(lock_file.metadata.platforms.len());
+        for platform in lock_file.metadata.platforms.iter().copied() {
+            let records = super::get_required_packages(lock_file, platform)?;
+            platforms.push((platform, serde_json::to_vec(&records).into_diagnostic()?));
+        }
+        let lock = serde_json::to_vec(lock_file).into_diagnostic()?;
+
+        // Determine where all the data is placed
+        let mut offset = HEADER_SIZE + platforms.len() * PLATFORM_ENTRY_SIZE;
+        let mut entries = Vec::with_capacity(platforms.len());
+        for (platform, records) in platforms.iter() {
+            let name_offset = offset;
+            offset += platform.as_str().len();
+            entries.push((name_offset, platform.as_str().len(), offset, records.len()));
+            offset += records.len();
+        }
+        let lock_offset = offset;
+
+        let mut cache = Vec::with_capacity(lock_offset + lock.len());
+        cache.extend_from_slice(CACHE_MAGIC);
+        for value in [len, mtime] {
+            cache.extend_from_slice(&value.to_le_bytes());
+        }
+        cache.extend_from_slice(&hash[..]);
+        for value in [lock_offset, lock.len(), platforms.len()] {
+            cache.extend_from_slice(&(value as u64).to_le_bytes());
+        }
+        for (name_offset, name_len, records_offset, records_len) in entries {
+            for value in [name_offset, name_len, records_offset, records_len] {
+                cache.extend_from_slice(&(value as u64).to_le_bytes());
+            }
+        }
+        for (platform, records) in platforms.iter() {
+            cache.extend_from_slice(platform.as_str().as_bytes());
+            cache.extend_from_slice(records);
+        }
+        cache.extend_from_slice(&lock);
+
+        // Write the cache to a temporary file first so readers never see a partial file.
+        let directory = cache_path
+            .parent()
+            .ok_or_else(|| miette::miette!("{} has no parent", cache_path.display()))?;
+        std::fs::create_dir_all(directory).into_diagnostic()?;
+        let mut file = tempfile::NamedTempFile::new_in(directory).into_diagnostic()?;
+        file.write_all(&cache).into_diagnostic()?;
+        file.persist(cache_path).into_diagnostic()?;
+        Ok(())
+    }
+
+    /// Returns the range of the lock-file json in the cache.
+    fn lock_range(&self) -> Option<Range<usize>> {
+        read_range(&self.cache, 56)
+    }
+
+    /// Returns the ranges of the name and the records of every platform in the cache. The entries
+    /// end at the first entry that can't be read.
+    fn platform_entries(&self) -> impl Iterator<Item = (Range<usize>, Range<usize>)> + '_ {
+        let count = read_usize(&self.cache, 72).unwrap_or_default();
+        (0..count)
+            .map_while(|index| {
+                index
+                    .checked_mul(PLATFORM_ENTRY_SIZE)?
+                    .checked_add(HEADER_SIZE)
+            })
+            .map_while(|entry| {
+                Some((
+                    read_range(&self.cache, entry)?,
+                    read_range(&self.cache, entry.checked_add(16)?)?,
+                ))
+            })
+    }
+
+    /// Returns the bytes in the given range of the cache. The ranges were checked when the cache
+    /// was opened, so this only fails if the cache was modified in the meantime.
+    fn slice(&self, range: Option<Range<usize>>) -> miette::Result<&[u8]> {
+        range
+            .and_then(|range| self.cache.get(range))
+            .ok_or_else(|| miette::miette!("the lock-file cache is corrupt"))
+    }
+}
+
+/// Returns the length and the modification time in nanoseconds of a file.
+fn file_stamp(path: &Path) -> Option<(u64, u64)> {
+    let metadata = std::fs::metadata(path).ok()?;
+    let mtime = metadata
+        .modified()
+        .ok()?
+        .duration_since(UNIX_EPOCH)
+        .ok()?
+        .as_nanos() as u64;
+    Some((metadata.len(), mtime))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_lock_file_cache() {
+        let dir = tempfile::tempdir().unwrap();
+        let lock_file_path = dir.path().join("pixi.lock");
+        let cache_path = dir.path().join(".pixi").join("lock-cache");
+
+        let lock_file = rattler_conda_types::conda_lock::builder::LockFileBuilder::new(
+            Vec::<rattler_conda_types::conda_lock::Channel>::new(),
+            [Platform::Linux64, Platform::Win64],
+            vec![],
+        )
+        .build()
+        .unwrap();
+        lock_file.to_path(&lock_file_path).unwrap();
+
+        assert!(LockFileCache::open(&cache_path, &lock_file_path).is_none());
+        LockFileCache::write(&cache_path, &lock_file_path, &lock_file).unwrap();
+
+        let cache = LockFileCache::open(&cache_path, &lock_file_path).unwrap();
+        let hash = compute_file_digest::<Sha256>(&lock_file_path).unwrap();
+        assert!(LockFileCache::open_with_hash(&cache_path, &lock_file_path, &hash).is_some());
+        assert_eq!(
+            cache.lock_file().unwrap().metadata.platforms,
+            lock_file.metadata.platforms
+        );
+        assert_eq!(
+            cache
+                .records(Platform::Win64)
+                .unwrap()
+                .map(|records| records.len()),
+            Some(0)
+        );
+        assert!(cache.records(Platform::Osx64).unwrap().is_none());
+
+        // A truncated cache is not used
+        drop(cache);
+        let contents = std::fs::read(&cache_path).unwrap();
+        std::fs::write(&cache_path, &contents[..contents.len() - 1]).unwrap();
+        assert!(LockFileCache::open(&cache_path, &lock_file_path).is_none());
+
+        // Modifying the lock-file invalidates the cache
+        std::fs::write(&lock_file_path, "modified").unwrap();
+        assert!(LockFileCache::open(&cache_path, &lock_file_path).is_none());
+    }
+}
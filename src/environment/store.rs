@@ -0,0 +1,373 @@
+//! Defines the [`EnvironmentStore`], a content-addressed store of environments in the pixi cache
+//! directory. Checkouts of the same project (e.g. git worktrees) usually lock the same packages,
+//! instead of linking every package again a new environment is cloned from an environment in the
+//! store that contains the most of the required packages. Only the remaining difference is then
+//! installed by a regular transaction.
+//!
+//! Every entry of the store is a directory named after the hash of the locked packages of the
+//! environment it was created from:
+//!
+//! ```text
+//! <cache>/envs/<hash>/entry.json   the packages in the entry, see [`StoreEntry`]
+//! <cache>/envs/<hash>/prefix/      the files and conda-meta records of these packages
+//! ```
+//!
+//! Some packages contain the path of the prefix they are installed in (e.g. in scripts or
+//! configuration files). Those packages cannot be cloned into another prefix and are not stored,
+//! they are installed by the transaction instead.
+
+use super::{resolve_link_type, run_blocking};
+use crate::config::{LinkMode, ENVIRONMENT_STORE_ENV};
+use crate::prefix::{conda_meta_file_name, Prefix};
+use futures::{stream, StreamExt, TryStreamExt};
+use itertools::Itertools;
+use miette::IntoDiagnostic;
+use rattler_conda_types::{
+    prefix_record::{LinkType, PathType},
+    PrefixRecord, RepoDataRecord,
+};
+use rattler_digest::{compute_bytes_digest, Sha256};
+use serde::{Deserialize, Serialize};
+use std::collections::{BTreeMap, HashSet};
+use std::path::{Path, PathBuf};
+
+/// The name of the file in a store entry that describes the entry.
+const STORE_ENTRY_FILE: &str = "entry.json";
+
+/// The maximum number of packages that are cloned or stored at the same time.
+const STORE_CONCURRENCY: usize = 16;
+
+/// Describes the packages an entry of the store contains.
+#[derive(Debug, Default, Serialize, Deserialize)]
+struct StoreEntry {
+    /// The name of the conda-meta file of every package in the entry, indexed by the url of the
+    /// package.
+    packages: BTreeMap<String, String>,
+}
+
+/// A content-addressed store of environments, see the module documentation.
+#[derive(Debug, Clone)]
+pub struct EnvironmentStore {
+    root: PathBuf,
+}
+
+impl EnvironmentStore {
+    /// Returns the store in the pixi cache directory if it is enabled through
+    /// [`ENVIRONMENT_STORE_ENV`].
+    pub fn from_env() -> miette::Result<Option<Self>> {
+        match std::env::var(ENVIRONMENT_STORE_ENV).as_deref() {
+            Ok(value) if !value.is_empty() && value != "0" => {}
+            _ => return Ok(None),
+        }
+        let cache_dir = rattler::default_cache_dir()
+            .map_err(|_| miette::miette!("could not determine default cache directory"))?;
+        Ok(Some(Self {
+            root: cache_dir.join("envs"),
+        }))
+    }
+
+    /// Clones the packages of the store entry that has the most of the given packages in common
+    /// into the (empty) prefix. Returns the number of packages that were cloned, the prefix has to
+    /// be brought up to date with a transaction afterwards. If cloning fails the files that were
+    /// already cloned are removed again, so the prefix is left empty.
+    #[tracing::instrument(skip_all, fields(prefix = %prefix.root().display()))]
+    pub async fn materialize(
+        &self,
+        packages: &[RepoDataRecord],
+        prefix: &Prefix,
+    ) -> miette::Result<usize> {
+        let root = self.root.clone();
+        let urls = packages
+            .iter()
+            .map(|record| record.url.to_string())
+            .collect::<HashSet<_>>();
+        let Some((entry_dir, conda_meta_files)) =
+            run_blocking(move || Ok(find_best_entry(&root, &urls))).await?
+        else {
+            return Ok(0);
+        };
+
+        tracing::info!(
+            "cloning {} packages from {}",
+            conda_meta_files.len(),
+            entry_dir.display()
+        );
+        let source = entry_dir.join("prefix");
+        let target = prefix.root().to_path_buf();
+        let link_type = resolve_link_type(LinkMode::from_env()?, &source, &target)?;
+        let count = conda_meta_files.len();
+        let result = stream::iter(conda_meta_files.clone())
+            .map(|conda_meta_file| {
+                let (source, target) = (source.clone(), target.clone());
+                run_blocking(move || clone_package(&source, &target, &conda_meta_file, link_type))
+            })
+            .buffer_unordered(STORE_CONCURRENCY)
+            .try_collect::<()>()
+            .await;
+
+        if let Err(err) = result {
+            run_blocking(move || {
+                remove_cloned_packages(&source, &target, &conda_meta_files);
+                Ok(())
+            })
+            .await?;
+            return Err(err);
+        }
+        Ok(count)
+    }
+
+    /// Adds the packages installed in the prefix to the store, unless the store already has an
+    /// entry for these packages. Packages that contain the path of the prefix are skipped.
+    #[tracing::instrument(skip_all, fields(prefix = %prefix.root().display()))]
+    pub async fn insert(&self, packages: &[RepoDataRecord], prefix: &Prefix) -> miette::Result<()> {
+        let entry_dir = self.root.join(store_key(packages));
+        if entry_dir.join(STORE_ENTRY_FILE).is_file() {
+            return Ok(());
+        }
+
+        // Stage the entry in a temporary directory, it is moved into place once it is complete.
+        std::fs::create_dir_all(&self.root).into_diagnostic()?;
+        let staging_dir = tempfile::tempdir_in(&self.root).into_diagnostic()?;
+        let target = staging_dir.path().join("prefix");
+        std::fs::create_dir_all(target.join("conda-meta")).into_diagnostic()?;
+        let link_type = resolve_link_type(LinkMode::from_env()?, prefix.root(), &target)?;
+
+        let source = prefix.root().to_path_buf();
+        let stored = stream::iter(prefix.find_installed_packages(None).await?)
+            .map(|record| {
+                let (source, target) = (source.clone(), target.clone());
+                run_blocking(move || {
+                    if !is_relocatable(&record) {
+                        tracing::debug!(
+                            "not storing {}, it contains the path of the prefix",
+                            record.repodata_record.file_name
+                        );
+                        return Ok(None);
+                    }
+                    let conda_meta_file =
+                        conda_meta_file_name(&record.repodata_record.package_record);
+                    clone_package(&source, &target, &conda_meta_file, link_type)?;
+                    Ok(Some((
+                        record.repodata_record.url.to_string(),
+                        conda_meta_file,
+                    )))
+                })
+            })
+            .buffer_unordered(STORE_CONCURRENCY)
+            .try_collect::<Vec<_>>()
+            .await?;
+
+        let entry = StoreEntry {
+            packages: stored.into_iter().flatten().collect(),
+        };
+        std::fs::write(
+            staging_dir.path().join(STORE_ENTRY_FILE),
+            serde_json::to_vec(&entry).into_diagnostic()?,
+        )
+        .into_diagnostic()?;
+
+        // Another process might have stored the same environment in the meantime, that is fine.
+        let staging_dir = staging_dir.into_path();
+        if std::fs::rename(&staging_dir, &entry_dir).is_err() {
+            let _ = std::fs::remove_dir_all(&staging_dir);
+        }
+        Ok(())
+    }
+}
+
+/// Returns the key of the store entry for the given packages.
+fn store_key(packages: &[RepoDataRecord]) -> String {
+    let urls = packages
+        .iter()
+        .map(|record| record.url.as_str())
+        .sorted()
+        .join("\n");
+    format!("{:x}", compute_bytes_digest::<Sha256>(urls))
+}
+
+/// Finds the entry in the store that contains the most of the packages with the given urls.
+/// Returns the directory of the entry and the conda-meta files of the packages to clone from it.
+fn find_best_entry(root: &Path, urls: &HashSet<String>) -> Option<(PathBuf, Vec<String>)> {
+    std::fs::read_dir(root)
+        .ok()?
+        .filter_map(Result::ok)
+        .filter_map(|dir_entry| {
+            let contents = std::fs::read(dir_entry.path().join(STORE_ENTRY_FILE)).ok()?;
+            let entry: StoreEntry = serde_json::from_slice(&contents).ok()?;
+            let conda_meta_files = entry
+                .packages
+                .into_iter()
+                .filter(|(url, _)| urls.contains(url))
+                .map(|(_, conda_meta_file)| conda_meta_file)
+                .collect_vec();
+            Some((dir_entry.path(), conda_meta_files))
+        })
+        .filter(|(_, conda_meta_files)| !conda_meta_files.is_empty())
+        .max_by_key(|(_, conda_meta_files)| conda_meta_files.len())
+}
+
+/// Returns true if none of the files of the package contain the path of the prefix. This is
+/// determined from the paths in the conda-meta record without reading the files: the prefix is
+/// written into files with a prefix placeholder and into the python entry points that are
+/// generated at install time. A post-link script may write the prefix into any file.
+fn is_relocatable(record: &PrefixRecord) -> bool {
+    record.paths_data.paths.iter().all(|entry| {
+        entry.prefix_placeholder.is_none()
+            && !matches!(
+                entry.path_type,
+                PathType::UnixPythonEntryPoint
+                    | PathType::WindowsPythonEntryPointScript
+                    | PathType::WindowsPythonEntryPointExe
+            )
+            && !is_post_link_script(&entry.relative_path)
+    })
+}
+
+/// Returns true if the path is a post-link script, e.g. `bin/.foo-post-link.sh`.
+fn is_post_link_script(path: &Path) -> bool {
+    path.file_name()
+        .and_then(|name| name.to_str())
+        .map_or(false, |name| {
+            name.starts_with('.')
+                && (name.ends_with("-post-link.sh") || name.ends_with("-post-link.bat"))
+        })
+}
+
+/// Places the files and the conda-meta record of a package installed in `source` into `target`.
+/// The conda-meta record is always copied because it is rewritten when the package is modified.
+fn clone_package(
+    source: &Path,
+    target: &Path,
+    conda_meta_file: &str,
+    link_type: LinkType,
+) -> miette::Result<()> {
+    let conda_meta_path = Path::new("conda-meta").join(conda_meta_file);
+    let record = PrefixRecord::from_path(source.join(&conda_meta_path)).into_diagnostic()?;
+    for entry in record.paths_data.paths.iter() {
+        clone_file(
+            &source.join(&entry.relative_path),
+            &target.join(&entry.relative_path),
+            link_type,
+        )?;
+    }
+
+    std::fs::create_dir_all(target.join("conda-meta")).into_diagnostic()?;
+    std::fs::copy(source.join(&conda_meta_path), target.join(&conda_meta_path))
+        .into_diagnostic()?;
+    Ok(())
+}
+
+/// Removes the files of the packages that [`clone_package`] placed into `target` from `source`.
+/// Files that were not cloned (yet) are ignored.
+fn remove_cloned_packages(source: &Path, target: &Path, conda_meta_files: &[String]) {
+    for conda_meta_file in conda_meta_files {
+        let conda_meta_path = Path::new("conda-meta").join(conda_meta_file);
+        let _ = std::fs::remove_file(target.join(&conda_meta_path));
+        let Ok(record) = PrefixRecord::from_path(source.join(&conda_meta_path)) else {
+            continue;
+        };
+        for entry in record.paths_data.paths.iter() {
+            let _ = std::fs::remove_file(target.join(&entry.relative_path));
+        }
+    }
+}
+
+/// Places a single file from `source` at `target`. Symlinks are recreated, other files are
+/// hardlinked or copied depending on the link type. A file that already exists at `target`, e.g.
+/// because another package contains the same path, is replaced.
+fn clone_file(source: &Path, target: &Path, link_type: LinkType) -> miette::Result<()> {
+    if let Some(parent) = target.parent() {
+        std::fs::create_dir_all(parent).into_diagnostic()?;
+    }
+    if std::fs::symlink_metadata(target).is_ok() {
+        std::fs::remove_file(target).into_diagnostic()?;
+    }
+    let metadata = std::fs::symlink_metadata(source).into_diagnostic()?;
+    if metadata.is_symlink() {
+        let link = std::fs::read_link(source).into_diagnostic()?;
+        #[cfg(unix)]
+        return std::os::unix::fs::symlink(link, target).into_diagnostic();
+        #[cfg(windows)]
+        return if source.is_dir() {
+            std::os::windows::fs::symlink_dir(link, target).into_diagnostic()
+        } else {
+            std::os::windows::fs::symlink_file(link, target).into_diagnostic()
+        };
+    }
+
+    match link_type {
+        LinkType::HardLink if std::fs::hard_link(source, target).is_ok() => Ok(()),
+        _ => std::fs::copy(source, target).map(|_| ()).into_diagnostic(),
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_find_best_entry() {
+        let dir = tempfile::tempdir().unwrap();
+        let write_entry = |name: &str, packages: &[(&str, &str)]| {
+            let entry = StoreEntry {
+                packages: packages
+                    .iter()
+                    .map(|(url, file)| (url.to_string(), file.to_string()))
+                    .collect(),
+            };
+            std::fs::create_dir(dir.path().join(name)).unwrap();
+            std::fs::write(
+                dir.path().join(name).join(STORE_ENTRY_FILE),
+                serde_json::to_vec(&entry).unwrap(),
+            )
+            .unwrap();
+        };
+        write_entry("a", &[("https://a", "a.json"), ("https://c", "c.json")]);
+        write_entry("b", &[("https://a", "a.json"), ("https://b", "b.json")]);
+
+        // The entry with the most packages in common is used, but only the required packages.
+        let urls = ["https://a", "https://b", "https://d"]
+            .into_iter()
+            .map(String::from)
+            .collect();
+        let (entry_dir, files) = find_best_entry(dir.path(), &urls).unwrap();
+        assert_eq!(entry_dir, dir.path().join("b"));
+        assert_eq!(files, ["a.json", "b.json"]);
+
+        let urls = [String::from("https://d")].into_iter().collect();
+        assert!(find_best_entry(dir.path(), &urls).is_none());
+    }
+
+    #[test]
+    fn test_is_post_link_script() {
+        assert!(is_post_link_script(Path::new("bin/.foo-post-link.sh")));
+        assert!(is_post_link_script(Path::new("Scripts/.foo-post-link.bat")));
+        assert!(!is_post_link_script(Path::new("bin/foo-post-link.sh")));
+        assert!(!is_post_link_script(Path::new("bin/python")));
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_clone_file_replaces_existing_files() {
+        let dir = tempfile::tempdir().unwrap();
+        let (source, target) = (dir.path().join("source"), dir.path().join("target"));
+        std::fs::create_dir_all(source.join("lib")).unwrap();
+        std::fs::write(source.join("lib/libfoo.so.1"), "foo").unwrap();
+        std::os::unix::fs::symlink("libfoo.so.1", source.join("lib/libfoo.so")).unwrap();
+
+        // Clone both files twice, as if two packages contained the same paths.
+        for _ in 0..2 {
+            for path in ["lib/libfoo.so.1", "lib/libfoo.so"] {
+                clone_file(&source.join(path), &target.join(path), LinkType::HardLink).unwrap();
+            }
+        }
+        assert_eq!(
+            std::fs::read_link(target.join("lib/libfoo.so")).unwrap(),
+            Path::new("libfoo.so.1")
+        );
+        assert_eq!(
+            std::fs::read_to_string(target.join("lib/libfoo.so")).unwrap(),
+            "foo"
+        );
+    }
+}
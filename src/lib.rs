@@ -1,12 +1,15 @@
+pub mod binary;
 pub mod cli;
 pub mod config;
 pub mod consts;
 pub mod environment;
+pub mod network;
 pub mod prefix;
 pub mod progress;
 pub mod project;
 pub mod repodata;
 pub mod task;
+pub mod timings;
 pub mod util;
 pub mod virtual_packages;
 
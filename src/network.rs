@@ -0,0 +1,171 @@
+//! The HTTP client that is shared by all the requests pixi makes. Using a single client for the
+//! whole process allows fetching repodata and downloading packages to reuse the same pooled
+//! connections (and the TLS sessions with them), with HTTP/2 the requests to a host are multiplexed
+//! over a single connection.
+
+use crate::config::InstallConcurrency;
+use once_cell::sync::Lazy;
+use rattler_networking::{AuthenticatedClient, AuthenticationStorage};
+use std::error::Error;
+use std::fmt::Display;
+use std::future::Future;
+use std::io::ErrorKind;
+use std::time::{Duration, SystemTime};
+
+/// The number of times a failed request is retried.
+const MAX_RETRIES: u32 = 3;
+
+/// The delay before the first retry, it doubles with every retry.
+const INITIAL_BACKOFF: Duration = Duration::from_millis(500);
+
+/// Returns the client to use for all requests. The returned client shares its connection pool with
+/// all other clients returned by this function.
+pub fn authenticated_client() -> AuthenticatedClient {
+    static CLIENT: Lazy<AuthenticatedClient> = Lazy::new(|| {
+        let concurrency = InstallConcurrency::from_env();
+        let client = reqwest::Client::builder()
+            .user_agent(concat!("pixi/", env!("CARGO_PKG_VERSION")))
+            // Keep enough connections around to serve the concurrent downloads from one host.
+            .pool_max_idle_per_host(concurrency.downloads_per_host)
+            .pool_idle_timeout(Duration::from_secs(90))
+            .tcp_keepalive(Duration::from_secs(60))
+            .http2_adaptive_window(true)
+            .build()
+            .unwrap_or_else(|err| {
+                tracing::warn!("failed to configure the http client, using the defaults: {err}");
+                reqwest::Client::default()
+            });
+        AuthenticatedClient::from_client(client, AuthenticationStorage::default())
+    });
+
+    CLIENT.clone()
+}
+
+/// Runs `f` until it succeeds, retrying up to [`MAX_RETRIES`] times with an exponential backoff if
+/// it fails with an error for which `should_retry` returns true. A little jitter is added to the
+/// backoff so concurrent requests that were rejected at the same time (e.g. with
+/// `429 Too Many Requests`) don't all retry at the same moment.
+pub async fn with_retry<T, E: Display, Fut: Future<Output = Result<T, E>>>(
+    what: impl Display,
+    should_retry: impl Fn(&E) -> bool,
+    mut f: impl FnMut() -> Fut,
+) -> Result<T, E> {
+    let mut attempt = 0;
+    loop {
+        match f().await {
+            Err(err) if attempt < MAX_RETRIES && should_retry(&err) => {
+                let delay = backoff(attempt);
+                tracing::warn!("{what} failed, retrying in {delay:?}: {err}");
+                tokio::time::sleep(delay).await;
+                attempt += 1;
+            }
+            result => return result,
+        }
+    }
+}
+
+/// Returns true if the error, or one of the errors that caused it, is likely transient: the
+/// connection failed or timed out, or the server responded with `429 Too Many Requests` or a server
+/// error. Retrying other errors, e.g. `404 Not Found` or a corrupt archive, would only fail again.
+pub fn is_transient(err: &(dyn Error + 'static)) -> bool {
+    let mut cause = Some(err);
+    while let Some(err) = cause {
+        if let Some(err) = err.downcast_ref::<reqwest::Error>() {
+            if err.is_connect() || err.is_timeout() {
+                return true;
+            }
+            if let Some(status) = err.status() {
+                return status == reqwest::StatusCode::TOO_MANY_REQUESTS
+                    || status.is_server_error();
+            }
+        }
+        if let Some(err) = err.downcast_ref::<std::io::Error>() {
+            if matches!(
+                err.kind(),
+                ErrorKind::TimedOut
+                    | ErrorKind::ConnectionRefused
+                    | ErrorKind::ConnectionReset
+                    | ErrorKind::ConnectionAborted
+                    | ErrorKind::UnexpectedEof
+            ) {
+                return true;
+            }
+            // The source of an io error skips the error it wraps.
+            if let Some(inner) = err.get_ref() {
+                if is_transient(inner) {
+                    return true;
+                }
+            }
+        }
+        cause = err.source();
+    }
+    false
+}
+
+/// Returns the delay before the given retry.
+fn backoff(attempt: u32) -> Duration {
+    let jitter = SystemTime::now()
+        .duration_since(SystemTime::UNIX_EPOCH)
+        .map(|time| time.subsec_nanos() % 250_000_000)
+        .unwrap_or_default();
+    INITIAL_BACKOFF * 2u32.pow(attempt) + Duration::from_nanos(jitter as u64)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::atomic::{AtomicU32, Ordering};
+
+    #[test]
+    fn test_backoff() {
+        assert!(backoff(0) >= INITIAL_BACKOFF);
+        assert!(backoff(0) < INITIAL_BACKOFF * 2);
+        assert!(backoff(2) >= INITIAL_BACKOFF * 4);
+    }
+
+    #[test]
+    fn test_is_transient() {
+        let err = std::io::Error::from(ErrorKind::TimedOut);
+        assert!(is_transient(&err));
+        let err = std::io::Error::from(ErrorKind::NotFound);
+        assert!(!is_transient(&err));
+
+        // Errors wrapped in other errors are found as well
+        let err = std::io::Error::new(ErrorKind::Other, std::io::Error::from(ErrorKind::TimedOut));
+        assert!(is_transient(&err));
+        assert!(!is_transient(&std::fmt::Error));
+    }
+
+    #[tokio::test]
+    async fn test_with_retry() {
+        // Errors that should be retried are retried until the request succeeds
+        let attempts = &AtomicU32::new(0);
+        let result = with_retry(
+            "request",
+            |_: &String| true,
+            || async move {
+                match attempts.fetch_add(1, Ordering::SeqCst) {
+                    0 | 1 => Err(String::from("429 Too Many Requests")),
+                    _ => Ok(42),
+                }
+            },
+        )
+        .await;
+        assert_eq!(result, Ok(42));
+        assert_eq!(attempts.load(Ordering::SeqCst), 3);
+
+        // Other errors are returned right away
+        let attempts = &AtomicU32::new(0);
+        let result = with_retry(
+            "request",
+            |err: &String| err != "404 Not Found",
+            || async move {
+                attempts.fetch_add(1, Ordering::SeqCst);
+                Err::<(), _>(String::from("404 Not Found"))
+            },
+        )
+        .await;
+        assert!(result.is_err());
+        assert_eq!(attempts.load(Ordering::SeqCst), 1);
+    }
+}
@@ -1,10 +1,22 @@
+use crate::environment::run_blocking;
 use futures::stream::FuturesUnordered;
 use futures::StreamExt;
-use miette::IntoDiagnostic;
-use rattler_conda_types::PrefixRecord;
+use itertools::Itertools;
+use miette::{Context, IntoDiagnostic};
+use rattler_conda_types::{PackageRecord, PrefixRecord, RepoDataRecord};
+use rattler_digest::{compute_bytes_digest, Sha256};
+use serde::{Deserialize, Serialize};
+use std::collections::BTreeMap;
+use std::fmt::Write;
 use std::path::{Path, PathBuf};
 use tokio::task::JoinHandle;
 
+/// The name of the file in the prefix that stores the [`PrefixIndex`].
+const PREFIX_INDEX_FILE: &str = "pixi-index.json";
+
+/// The version of the format of the [`PrefixIndex`]. Indices with another version are discarded.
+const PREFIX_INDEX_VERSION: u32 = 1;
+
 /// Points to a directory that serves as a Conda prefix.
 #[derive(Debug, Clone)]
 pub struct Prefix {
@@ -23,6 +35,40 @@ impl Prefix {
         &self.root
     }
 
+    /// Returns a hash that changes whenever packages are installed into or removed from the prefix.
+    /// Only the listing of the `conda-meta` directory is read (the names, sizes and modification
+    /// times of its entries), not the contents of the files. Returns `None` if the `conda-meta`
+    /// directory could not be read.
+    pub fn installed_packages_hash(&self) -> Option<String> {
+        let entries = std::fs::read_dir(self.root.join("conda-meta"))
+            .ok()?
+            .collect::<Result<Vec<_>, _>>()
+            .ok()?;
+
+        let mut content = String::new();
+        for entry in entries.into_iter().sorted_by_key(|entry| entry.file_name()) {
+            let metadata = entry.metadata().ok()?;
+            writeln!(
+                content,
+                "{} {} {:?}",
+                entry.file_name().to_string_lossy(),
+                metadata.len(),
+                metadata.modified().ok()
+            )
+            .ok()?;
+        }
+
+        Some(format!("{:x}", compute_bytes_digest::<Sha256>(content)))
+    }
+
+    /// Returns the packages installed in the prefix without the information about the files they
+    /// installed. This reads the [`PrefixIndex`] of the prefix which is much cheaper than reading
+    /// all the `conda-meta` files. Use [`InstalledPackage::load_prefix_record`] to read the full
+    /// record of a package.
+    pub async fn installed_packages(&self) -> miette::Result<Vec<InstalledPackage>> {
+        Ok(PrefixIndex::load(self).await?.into_packages())
+    }
+
     /// Scans the `conda-meta` directory of an environment and returns all the [`PrefixRecord`]s found
     /// in there.
     pub async fn find_installed_packages(
@@ -39,7 +85,7 @@ impl Prefix {
         {
             let entry = entry.into_diagnostic()?;
             let path = entry.path();
-            if path.ends_with(".json") {
+            if path.extension() != Some("json".as_ref()) {
                 continue;
             }
 
@@ -82,3 +128,170 @@ impl Prefix {
         Ok(result)
     }
 }
+
+/// A package that is installed in a prefix. This only contains the repodata record of the package
+/// and not the (potentially very large) list of files the package installed.
+#[derive(Debug, Clone, Serialize, Deserialize)]
+pub struct InstalledPackage {
+    /// The repodata record of the installed package
+    pub repodata_record: RepoDataRecord,
+}
+
+impl InstalledPackage {
+    /// Returns the name of the file in the `conda-meta` directory that describes this package.
+    pub fn conda_meta_file_name(&self) -> String {
+        conda_meta_file_name(&self.repodata_record.package_record)
+    }
+
+    /// Reads the full [`PrefixRecord`] of this package from the `conda-meta` directory of the
+    /// prefix.
+    pub async fn load_prefix_record(&self, prefix: &Prefix) -> miette::Result<PrefixRecord> {
+        let path = prefix
+            .root()
+            .join("conda-meta")
+            .join(self.conda_meta_file_name());
+        match tokio::task::spawn_blocking(move || {
+            PrefixRecord::from_path(&path)
+                .into_diagnostic()
+                .wrap_err_with(|| format!("failed to read {}", path.display()))
+        })
+        .await
+        {
+            Ok(result) => result,
+            Err(err) => {
+                if let Ok(panic) = err.try_into_panic() {
+                    std::panic::resume_unwind(panic);
+                }
+                Err(miette::miette!("cancelled"))
+            }
+        }
+    }
+}
+
+impl From<PrefixRecord> for InstalledPackage {
+    fn from(record: PrefixRecord) -> Self {
+        Self {
+            repodata_record: record.repodata_record,
+        }
+    }
+}
+
+impl AsRef<RepoDataRecord> for InstalledPackage {
+    fn as_ref(&self) -> &RepoDataRecord {
+        &self.repodata_record
+    }
+}
+
+impl AsRef<PackageRecord> for InstalledPackage {
+    fn as_ref(&self) -> &PackageRecord {
+        &self.repodata_record.package_record
+    }
+}
+
+/// Returns the name of the file in the `conda-meta` directory that describes the given package.
+pub fn conda_meta_file_name(record: &PackageRecord) -> String {
+    format!("{}-{}-{}.json", record.name, record.version, record.build)
+}
+
+/// A compact index of all the packages installed in a prefix. Reading the index is much cheaper
+/// than reading all `conda-meta` files because those also contain the paths of all the files a
+/// package installed.
+///
+/// The index is stored next to the `conda-meta` directory and records the
+/// [`Prefix::installed_packages_hash`] at the time it was written. If the `conda-meta` directory was
+/// modified without updating the index (e.g. because an installation was interrupted or another
+/// tool modified the prefix) the index is rebuilt from the `conda-meta` files.
+#[derive(Debug, Default, Serialize, Deserialize)]
+pub struct PrefixIndex {
+    /// The version of the format of the index
+    version: u32,
+
+    /// The hash of the `conda-meta` directory when the index was written.
+    conda_meta_hash: String,
+
+    /// The installed packages indexed by the name of their `conda-meta` file.
+    packages: BTreeMap<String, InstalledPackage>,
+}
+
+impl PrefixIndex {
+    /// Loads the index of the given prefix. If the index does not exist or is out of date it is
+    /// rebuilt from the `conda-meta` directory. The files are read on a blocking thread.
+    pub async fn load(prefix: &Prefix) -> miette::Result<Self> {
+        let (conda_meta_hash, index) = {
+            let prefix = prefix.clone();
+            run_blocking(move || {
+                let conda_meta_hash = prefix.installed_packages_hash();
+                let index = conda_meta_hash
+                    .as_deref()
+                    .and_then(|conda_meta_hash| Self::read(&prefix, conda_meta_hash));
+                Ok((conda_meta_hash, index))
+            })
+            .await?
+        };
+        if let Some(index) = index {
+            return Ok(index);
+        }
+
+        // Rebuild the index from the conda-meta files
+        let mut index = PrefixIndex::default();
+        for record in prefix.find_installed_packages(None).await? {
+            index.insert(record.into());
+        }
+
+        // Only store the index if the prefix actually exists.
+        if conda_meta_hash.is_none() {
+            return Ok(index);
+        }
+        let prefix = prefix.clone();
+        run_blocking(move || {
+            if let Err(err) = index.write(&prefix) {
+                tracing::warn!(
+                    "failed to write the index of {}: {err}",
+                    prefix.root().display()
+                );
+            }
+            Ok(index)
+        })
+        .await
+    }
+
+    /// Reads the stored index of the prefix. Returns `None` if there is no index or it does not
+    /// match the given hash of the `conda-meta` directory.
+    fn read(prefix: &Prefix, conda_meta_hash: &str) -> Option<Self> {
+        let contents = std::fs::read(prefix.root().join(PREFIX_INDEX_FILE)).ok()?;
+        let index = serde_json::from_slice::<PrefixIndex>(&contents).ok()?;
+        (index.version == PREFIX_INDEX_VERSION && index.conda_meta_hash == conda_meta_hash)
+            .then_some(index)
+    }
+
+    /// Returns all packages in the index.
+    pub fn into_packages(self) -> Vec<InstalledPackage> {
+        self.packages.into_values().collect()
+    }
+
+    /// Adds a package to the index.
+    pub fn insert(&mut self, package: InstalledPackage) {
+        self.packages
+            .insert(package.conda_meta_file_name(), package);
+    }
+
+    /// Removes a package from the index.
+    pub fn remove(&mut self, package: &PackageRecord) {
+        self.packages.remove(&conda_meta_file_name(package));
+    }
+
+    /// Writes the index to the prefix. This has to be called after all modifications to the
+    /// `conda-meta` directory are done. The file is replaced atomically.
+    pub fn write(&mut self, prefix: &Prefix) -> miette::Result<()> {
+        self.version = PREFIX_INDEX_VERSION;
+        self.conda_meta_hash = prefix
+            .installed_packages_hash()
+            .ok_or_else(|| miette::miette!("could not read the conda-meta directory"))?;
+
+        let mut file = tempfile::NamedTempFile::new_in(prefix.root()).into_diagnostic()?;
+        serde_json::to_writer(&mut file, self).into_diagnostic()?;
+        file.persist(prefix.root().join(PREFIX_INDEX_FILE))
+            .into_diagnostic()?;
+        Ok(())
+    }
+}
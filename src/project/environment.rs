@@ -1,13 +1,45 @@
+use crate::prefix::Prefix;
+use crate::project::manifest::CompilerCache;
 use crate::Project;
 use itertools::Itertools;
 use miette::IntoDiagnostic;
+use rattler_conda_types::{PackageRecord, Platform};
+use rattler_digest::{compute_bytes_digest, Sha256};
 use rattler_shell::shell::{Shell, ShellEnum};
+use serde::{Deserialize, Serialize};
 use std::collections::HashMap;
 use std::fmt::Write;
+use std::path::{Path, PathBuf};
 
 // Setting a base prefix for the pixi package
 const ENV_PREFIX: &str = "PIXI_PACKAGE_";
 
+/// The environment variable that overrides the directory in which the compiler caches are stored.
+const COMPILER_CACHE_DIR_ENV: &str = "PIXI_COMPILER_CACHE_DIR";
+
+/// The prefixes and suffixes of the names of the packages that provide compilers. Their versions
+/// and builds determine which compiler cache is used.
+const COMPILER_PACKAGE_PREFIXES: [&str; 5] = ["gcc", "gxx", "gfortran", "clang", "vs20"];
+const COMPILER_PACKAGE_SUFFIXES: [&str; 1] = ["-compiler"];
+
+/// The name of the file in the `.pixi` directory that caches the key of the compiler cache.
+const COMPILER_CACHE_KEY_FILE: &str = "compiler-cache-key.json";
+
+/// The key of the compiler cache for the packages installed in the prefix. It is cached so the
+/// installed packages don't have to be read on every invocation.
+#[derive(Debug, PartialEq, Eq, Serialize, Deserialize)]
+struct CompilerCacheKey {
+    /// The [`Prefix::installed_packages_hash`] of the prefix the key was computed for.
+    conda_meta_hash: String,
+
+    /// The name of the compiler cache.
+    launcher: String,
+
+    /// The key computed by [`compiler_cache_key`], or `None` if the compiler cache is not
+    /// installed in the prefix.
+    key: Option<String>,
+}
+
 // Add pixi meta data into the environment as environment variables.
 pub fn add_metadata_as_env_vars(
     script: &mut impl Write,
@@ -46,3 +78,199 @@ pub fn get_metadata_env(project: &Project) -> HashMap<String, String> {
         ),
     ])
 }
+
+/// Returns the environment variables that make build tools use the compiler cache configured in
+/// the manifest as compiler launcher. The cache is stored in a location that is shared between
+/// projects and is keyed by the compiler packages installed in the prefix, so every compiler build
+/// gets its own cache.
+pub async fn get_compiler_cache_env(
+    project: &Project,
+    prefix: &Prefix,
+) -> miette::Result<HashMap<String, String>> {
+    let Some(compiler_cache) = project.compiler_cache() else {
+        return Ok(HashMap::new());
+    };
+
+    let launcher = compiler_cache.name();
+    let Some(key) = get_compiler_cache_key(project, prefix, launcher).await? else {
+        tracing::warn!(
+            "the compiler-cache is set to {launcher} but {launcher} is not a dependency of the project"
+        );
+        return Ok(HashMap::new());
+    };
+
+    let cache_dir = match std::env::var_os(COMPILER_CACHE_DIR_ENV) {
+        Some(dir) => PathBuf::from(dir),
+        None => dirs::cache_dir()
+            .ok_or_else(|| miette::miette!("could not determine the cache directory"))?
+            .join("pixi")
+            .join("compiler-cache"),
+    }
+    .join(launcher)
+    .join(format!("{}-{key}", Platform::current()));
+
+    let cache_dir = cache_dir.to_string_lossy().into_owned();
+    let mut env = HashMap::from_iter([
+        (
+            String::from("CMAKE_C_COMPILER_LAUNCHER"),
+            launcher.to_string(),
+        ),
+        (
+            String::from("CMAKE_CXX_COMPILER_LAUNCHER"),
+            launcher.to_string(),
+        ),
+    ]);
+    match compiler_cache {
+        CompilerCache::Ccache => {
+            env.insert(String::from("CCACHE_DIR"), cache_dir);
+            // Rewrite absolute paths in the project relative so different checkouts share hits.
+            env.insert(
+                String::from("CCACHE_BASEDIR"),
+                project.root().to_string_lossy().into_owned(),
+            );
+        }
+        CompilerCache::Sccache => {
+            env.insert(String::from("SCCACHE_DIR"), cache_dir);
+        }
+    }
+
+    Ok(env)
+}
+
+/// Returns the key of the compiler cache for the packages installed in the prefix, or `None` if the
+/// launcher is not installed. The key is read from the cache in the `.pixi` directory as long as the
+/// installed packages did not change.
+async fn get_compiler_cache_key(
+    project: &Project,
+    prefix: &Prefix,
+    launcher: &str,
+) -> miette::Result<Option<String>> {
+    let cache_path = project.pixi_dir().join(COMPILER_CACHE_KEY_FILE);
+    let (conda_meta_hash, cached_key) = {
+        let (prefix, cache_path, launcher) =
+            (prefix.clone(), cache_path.clone(), launcher.to_string());
+        tokio::task::spawn_blocking(move || {
+            let conda_meta_hash = prefix.installed_packages_hash();
+            let cached_key = conda_meta_hash
+                .as_deref()
+                .and_then(|hash| read_compiler_cache_key(&cache_path, hash, &launcher));
+            (conda_meta_hash, cached_key)
+        })
+        .await
+        .into_diagnostic()?
+    };
+    if let Some(key) = cached_key {
+        return Ok(key);
+    }
+
+    let installed_packages = prefix.installed_packages().await?;
+    let records = installed_packages
+        .iter()
+        .map(|package| &package.repodata_record.package_record)
+        .collect_vec();
+    let key = records
+        .iter()
+        .any(|record| record.name == launcher)
+        .then(|| compiler_cache_key(records.into_iter()));
+
+    // Only cache the key if the state of the prefix is known.
+    if let Some(conda_meta_hash) = conda_meta_hash {
+        let cache = CompilerCacheKey {
+            conda_meta_hash,
+            launcher: launcher.to_string(),
+            key: key.clone(),
+        };
+        tokio::task::spawn_blocking(move || {
+            if let Err(err) = write_compiler_cache_key(&cache_path, &cache) {
+                tracing::warn!("failed to write {}: {err}", cache_path.display());
+            }
+        })
+        .await
+        .into_diagnostic()?;
+    }
+
+    Ok(key)
+}
+
+/// Reads the cached key of the compiler cache if it was computed for the given state of the prefix
+/// and the given launcher.
+fn read_compiler_cache_key(
+    cache_path: &Path,
+    conda_meta_hash: &str,
+    launcher: &str,
+) -> Option<Option<String>> {
+    let contents = std::fs::read(cache_path).ok()?;
+    let cache: CompilerCacheKey = serde_json::from_slice(&contents).ok()?;
+    (cache.conda_meta_hash == conda_meta_hash && cache.launcher == launcher).then_some(cache.key)
+}
+
+/// Stores the key of the compiler cache. The file is replaced atomically so concurrent invocations
+/// never observe a partially written file.
+fn write_compiler_cache_key(cache_path: &Path, cache: &CompilerCacheKey) -> miette::Result<()> {
+    let dir = cache_path
+        .parent()
+        .ok_or_else(|| miette::miette!("invalid cache path"))?;
+    let mut file = tempfile::NamedTempFile::new_in(dir).into_diagnostic()?;
+    serde_json::to_writer(&mut file, cache).into_diagnostic()?;
+    file.persist(cache_path).into_diagnostic()?;
+    Ok(())
+}
+
+/// Returns a short hash of the names, versions and builds of the compiler packages.
+fn compiler_cache_key<'a>(records: impl Iterator<Item = &'a PackageRecord>) -> String {
+    let compilers = records
+        .filter(|record| is_compiler_package(&record.name))
+        .map(|record| format!("{} {} {}", record.name, record.version, record.build))
+        .sorted()
+        .join("\n");
+    let hash = format!("{:x}", compute_bytes_digest::<Sha256>(compilers));
+    hash[..16].to_string()
+}
+
+/// Returns true if the package with the given name provides a compiler.
+fn is_compiler_package(name: &str) -> bool {
+    COMPILER_PACKAGE_PREFIXES
+        .iter()
+        .any(|prefix| name.starts_with(prefix))
+        || COMPILER_PACKAGE_SUFFIXES
+            .iter()
+            .any(|suffix| name.ends_with(suffix))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_is_compiler_package() {
+        assert!(is_compiler_package("gcc_impl_linux-64"));
+        assert!(is_compiler_package("clangxx_osx-arm64"));
+        assert!(is_compiler_package("cxx-compiler"));
+        assert!(is_compiler_package("vs2019_win-64"));
+        assert!(!is_compiler_package("cmake"));
+        assert!(!is_compiler_package("libgcc-ng"));
+        assert!(!is_compiler_package("ccache"));
+    }
+
+    #[test]
+    fn test_compiler_cache_key_file() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache_path = dir.path().join(COMPILER_CACHE_KEY_FILE);
+        assert_eq!(read_compiler_cache_key(&cache_path, "abc", "ccache"), None);
+
+        let cache = CompilerCacheKey {
+            conda_meta_hash: String::from("abc"),
+            launcher: String::from("ccache"),
+            key: Some(String::from("0123456789abcdef")),
+        };
+        write_compiler_cache_key(&cache_path, &cache).unwrap();
+        assert_eq!(
+            read_compiler_cache_key(&cache_path, "abc", "ccache"),
+            Some(cache.key)
+        );
+
+        // The key is computed again when the packages or the launcher changed
+        assert_eq!(read_compiler_cache_key(&cache_path, "def", "ccache"), None);
+        assert_eq!(read_compiler_cache_key(&cache_path, "abc", "sccache"), None);
+    }
+}
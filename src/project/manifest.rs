@@ -159,6 +159,28 @@ pub struct ProjectMetadata {
     // TODO: This is actually slightly different from the rattler_conda_types::Platform because it
     //     should not include noarch.
     pub platforms: Spanned<Vec<Platform>>,
+
+    /// The compiler cache that is used when running tasks
+    #[serde(default, rename = "compiler-cache")]
+    pub compiler_cache: Option<CompilerCache>,
+}
+
+/// A compiler cache that is set up as the compiler launcher for tasks.
+#[derive(Debug, Copy, Clone, Eq, PartialEq, Deserialize)]
+#[serde(rename_all = "lowercase")]
+pub enum CompilerCache {
+    Ccache,
+    Sccache,
+}
+
+impl CompilerCache {
+    /// Returns the name of the executable and of the conda package of the compiler cache.
+    pub fn name(&self) -> &'static str {
+        match self {
+            CompilerCache::Ccache => "ccache",
+            CompilerCache::Sccache => "sccache",
+        }
+    }
 }
 
 #[serde_as]
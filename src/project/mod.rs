@@ -3,7 +3,7 @@ pub mod manifest;
 mod serde;
 
 use crate::consts;
-use crate::project::manifest::{ProjectManifest, TargetMetadata, TargetSelector};
+use crate::project::manifest::{CompilerCache, ProjectManifest, TargetMetadata, TargetSelector};
 use crate::task::{CmdArgs, Task};
 use indexmap::IndexMap;
 use miette::{IntoDiagnostic, LabeledSpan, NamedSource, WrapErr};
@@ -47,6 +47,18 @@ fn task_as_toml(task: Task) -> Item {
                     Value::Array(Array::from_iter(process.depends_on.into_iter())),
                 );
             }
+            if !process.inputs.is_empty() {
+                table.insert(
+                    "inputs",
+                    Value::Array(Array::from_iter(process.inputs.into_iter())),
+                );
+            }
+            if !process.outputs.is_empty() {
+                table.insert(
+                    "outputs",
+                    Value::Array(Array::from_iter(process.outputs.into_iter())),
+                );
+            }
             Item::Value(Value::InlineTable(table))
         }
         Task::Alias(alias) => {
@@ -76,6 +88,11 @@ impl Project {
         NamedSource::new(consts::PROJECT_MANIFEST, self.source.clone())
     }
 
+    /// Returns the contents of the manifest as it was read from disk.
+    pub fn source_str(&self) -> &str {
+        &self.source
+    }
+
     /// Loads a project manifest file.
     pub fn load(filename: &Path) -> miette::Result<Self> {
         // Determine the parent directory of the manifest file
@@ -420,6 +437,12 @@ impl Project {
         self.root.join(consts::PROJECT_LOCK_FILE)
     }
 
+    /// Returns the path to the `.pixi` directory of the project which contains all the data that
+    /// pixi stores for the project.
+    pub fn pixi_dir(&self) -> PathBuf {
+        self.root.join(consts::PIXI_DIR)
+    }
+
     /// Save back changes
     pub fn save(&self) -> miette::Result<()> {
         fs::write(self.manifest_path(), self.doc.to_string())
@@ -503,6 +526,11 @@ impl Project {
         self.manifest.project.platforms.as_ref().as_slice()
     }
 
+    /// Returns the compiler cache that should be used when running tasks, if any.
+    pub fn compiler_cache(&self) -> Option<CompilerCache> {
+        self.manifest.project.compiler_cache
+    }
+
     /// Get the task with the specified name or `None` if no such task exists.
     pub fn task_opt(&self, name: &str) -> Option<&Task> {
         self.manifest.tasks.get(name)
@@ -1,24 +1,32 @@
-use crate::{progress, project::Project};
+use crate::{config::RepodataFeatures, network, progress, project::Project};
 use indicatif::ProgressBar;
 use miette::{Context, IntoDiagnostic};
 use rattler_conda_types::{Channel, Platform};
 use rattler_networking::AuthenticatedClient;
-use rattler_repodata_gateway::{fetch, sparse::SparseRepoData};
-use std::{path::Path, time::Duration};
+use rattler_repodata_gateway::fetch;
+use std::{
+    collections::HashMap,
+    path::{Path, PathBuf},
+    sync::{Arc, Mutex},
+    time::Duration,
+};
+use url::Url;
+
+mod index;
+
+pub use index::IndexedRepoData;
 
 impl Project {
-    pub async fn fetch_sparse_repodata(&self) -> miette::Result<Vec<SparseRepoData>> {
+    pub async fn fetch_sparse_repodata(&self) -> miette::Result<Vec<IndexedRepoData>> {
         let channels = self.channels();
         let platforms = self.platforms();
         fetch_sparse_repodata(channels, platforms).await
     }
 }
 
-pub async fn fetch_sparse_repodata(
-    channels: &[Channel],
-    target_platforms: &[Platform],
-) -> miette::Result<Vec<SparseRepoData>> {
-    // Determine all the repodata that requires fetching.
+/// Returns the channel subdirectories that have to be fetched to get the repodata of the channels
+/// for the given platforms.
+fn fetch_targets(channels: &[Channel], target_platforms: &[Platform]) -> Vec<(Channel, Platform)> {
     let mut fetch_targets = Vec::with_capacity(channels.len() * target_platforms.len());
     for channel in channels {
         // Determine the platforms to use for this channel.
@@ -33,6 +41,110 @@ pub async fn fetch_sparse_repodata(
             fetch_targets.push((channel.clone(), Platform::NoArch));
         }
     }
+    fetch_targets
+}
+
+/// Returns the directory in which downloaded repodata is cached.
+fn repodata_cache_dir() -> miette::Result<PathBuf> {
+    Ok(rattler::default_cache_dir()
+        .map_err(|_| miette::miette!("could not determine default cache directory"))?
+        .join("repodata"))
+}
+
+/// The repodata of a channel subdirectory that is fetched at most once, `None` if the channel does
+/// not have the subdirectory.
+type LazySubdir = Arc<tokio::sync::OnceCell<Option<Arc<IndexedRepoData>>>>;
+
+/// Provides the repodata of a set of channels. The repodata of a channel subdirectory is only
+/// fetched when a platform that needs it is requested, and at most once even if multiple platforms
+/// that share it (e.g. `noarch`) are requested at the same time. This allows solving a platform as
+/// soon as its own repodata is available while the repodata of other platforms is still being
+/// fetched.
+#[derive(Clone)]
+pub struct RepoDataGateway {
+    inner: Arc<RepoDataGatewayInner>,
+}
+
+struct RepoDataGatewayInner {
+    channels: Vec<Channel>,
+    cache_path: PathBuf,
+    client: AuthenticatedClient,
+    subdirs: Mutex<HashMap<(Url, Platform), LazySubdir>>,
+}
+
+impl RepoDataGateway {
+    /// Constructs a new gateway for the given channels, nothing is fetched until requested.
+    pub fn new(channels: &[Channel]) -> miette::Result<Self> {
+        Ok(Self {
+            inner: Arc::new(RepoDataGatewayInner {
+                channels: channels.to_vec(),
+                cache_path: repodata_cache_dir()?,
+                client: network::authenticated_client(),
+                subdirs: Mutex::new(HashMap::new()),
+            }),
+        })
+    }
+
+    /// Returns the repodata of all channels for the given platform, including `noarch`. The
+    /// subdirectories that were not fetched before are fetched concurrently.
+    pub async fn fetch(&self, platform: Platform) -> miette::Result<Vec<Arc<IndexedRepoData>>> {
+        let subdirs = futures::future::try_join_all(
+            fetch_targets(&self.inner.channels, &[platform])
+                .into_iter()
+                .map(|(channel, platform)| self.fetch_subdir(channel, platform)),
+        )
+        .await
+        .wrap_err("failed to fetch repodata from channels")?;
+        Ok(subdirs.into_iter().flatten().collect())
+    }
+
+    /// Returns the repodata of a single channel subdirectory, fetching it if that did not happen
+    /// before.
+    async fn fetch_subdir(
+        &self,
+        channel: Channel,
+        platform: Platform,
+    ) -> miette::Result<Option<Arc<IndexedRepoData>>> {
+        let subdir = self
+            .inner
+            .subdirs
+            .lock()
+            .expect("the repodata lock is poisoned")
+            .entry((channel.base_url().clone(), platform))
+            .or_default()
+            .clone();
+
+        subdir
+            .get_or_try_init(|| async {
+                let progress_bar = progress::global_multi_progress().add(
+                    indicatif::ProgressBar::new(1)
+                        .with_prefix(format!("{}/{platform}", friendly_channel_name(&channel)))
+                        .with_style(progress::default_bytes_style()),
+                );
+                progress_bar.enable_steady_tick(Duration::from_millis(50));
+                let result = fetch_repo_data_records_with_progress(
+                    channel,
+                    platform,
+                    &self.inner.cache_path,
+                    self.inner.client.clone(),
+                    progress_bar.clone(),
+                    platform == Platform::NoArch,
+                )
+                .await;
+                progress_bar.finish_and_clear();
+                Ok::<_, miette::Report>(result?.map(Arc::new))
+            })
+            .await
+            .cloned()
+    }
+}
+
+pub async fn fetch_sparse_repodata(
+    channels: &[Channel],
+    target_platforms: &[Platform],
+) -> miette::Result<Vec<IndexedRepoData>> {
+    // Determine all the repodata that requires fetching.
+    let fetch_targets = fetch_targets(channels, target_platforms);
 
     // Construct a top-level progress bar
     let multi_progress = progress::global_multi_progress();
@@ -41,13 +153,11 @@ pub async fn fetch_sparse_repodata(
     top_level_progress.set_message("fetching latest repodata");
     top_level_progress.enable_steady_tick(Duration::from_millis(50));
 
-    let repodata_cache_path = rattler::default_cache_dir()
-        .map_err(|_| miette::miette!("could not determine default cache directory"))?
-        .join("repodata");
-    let repodata_download_client = AuthenticatedClient::default();
+    let repodata_cache_path = repodata_cache_dir()?;
+    let repodata_download_client = network::authenticated_client();
     let multi_progress = progress::global_multi_progress();
     let (tx, mut rx) =
-        tokio::sync::mpsc::channel::<miette::Result<Option<SparseRepoData>>>(fetch_targets.len());
+        tokio::sync::mpsc::channel::<miette::Result<Option<IndexedRepoData>>>(fetch_targets.len());
     let mut progress_bars = Vec::new();
     for (channel, platform) in fetch_targets {
         // Construct a progress bar for the fetch
@@ -112,6 +222,7 @@ pub async fn fetch_sparse_repodata(
 
 /// Given a channel and platform, download and cache the `repodata.json` for it. This function
 /// reports its progress via a CLI progressbar.
+#[tracing::instrument(name = "fetch_repodata", skip_all, fields(channel = %friendly_channel_name(&channel), subdir = %platform))]
 async fn fetch_repo_data_records_with_progress(
     channel: Channel,
     platform: Platform,
@@ -119,22 +230,37 @@ async fn fetch_repo_data_records_with_progress(
     client: AuthenticatedClient,
     progress_bar: indicatif::ProgressBar,
     allow_not_found: bool,
-) -> miette::Result<Option<SparseRepoData>> {
-    // Download the repodata.json
-    let download_progress_progress_bar = progress_bar.clone();
-    let result = fetch::fetch_repo_data(
-        channel.platform_url(platform),
-        client,
+) -> miette::Result<Option<IndexedRepoData>> {
+    // Download the repodata.json. Prefer the compressed and incremental variants, if that fails
+    // for any other reason than the repodata not existing, fall back to downloading the full
+    // repodata.json.
+    let features = RepodataFeatures::from_env();
+    let url = channel.platform_url(platform);
+    let mut result = fetch_repo_data(
+        url.clone(),
+        client.clone(),
         repodata_cache,
-        fetch::FetchRepoDataOptions {
-            download_progress: Some(Box::new(move |fetch::DownloadProgress { total, bytes }| {
-                download_progress_progress_bar.set_length(total.unwrap_or(bytes));
-                download_progress_progress_bar.set_position(bytes);
-            })),
-            ..Default::default()
-        },
+        &progress_bar,
+        features,
     )
     .await;
+    if features.any() {
+        if let Err(err) = &result {
+            if !matches!(err, fetch::FetchRepoDataError::NotFound(_)) {
+                tracing::warn!(
+                    "failed to fetch repodata from {url} using zstd/bz2/jlap, falling back to repodata.json: {err}"
+                );
+                result = fetch_repo_data(
+                    url,
+                    client,
+                    repodata_cache,
+                    &progress_bar,
+                    RepodataFeatures::none(),
+                )
+                .await;
+            }
+        }
+    }
 
     // Error out if an error occurred, but also update the progress bar
     let result = match result {
@@ -152,15 +278,16 @@ async fn fetch_repo_data_records_with_progress(
         Ok(result) => result,
     };
 
-    // Notify that we are deserializing
+    // Notify that we are indexing
     progress_bar.set_style(progress::deserializing_progress_style());
-    progress_bar.set_message("Deserializing..");
+    progress_bar.set_message("Indexing..");
 
-    // Deserialize the data. This is a hefty blocking operation so we spawn it as a tokio blocking
-    // task.
+    // Open the repodata, this builds the index of the repodata if the repodata changed. This is a
+    // hefty blocking operation so we spawn it as a tokio blocking task.
     let repo_data_json_path = result.repo_data_json_path.clone();
     match tokio::task::spawn_blocking(move || {
-        SparseRepoData::new(channel, platform.to_string(), repo_data_json_path, None)
+        let _span = tracing::info_span!("index_repodata", subdir = %platform).entered();
+        IndexedRepoData::new(channel, platform, repo_data_json_path)
     })
     .await
     {
@@ -176,7 +303,7 @@ async fn fetch_repo_data_records_with_progress(
         Ok(Err(err)) => {
             progress_bar.set_style(progress::errored_progress_style());
             progress_bar.finish_with_message("Error");
-            Err(err).into_diagnostic()
+            Err(err)
         }
         Err(err) => match err.try_into_panic() {
             Ok(panic) => {
@@ -192,6 +319,48 @@ async fn fetch_repo_data_records_with_progress(
     }
 }
 
+/// Returns true if fetching the repodata failed with an error that is likely transient, see
+/// [`network::is_transient`]. The http and io errors are displayed transparently, which also
+/// skips them as a source, so they are checked directly.
+fn is_transient_fetch_error(err: &fetch::FetchRepoDataError) -> bool {
+    match err {
+        fetch::FetchRepoDataError::HttpError(err) => network::is_transient(err),
+        fetch::FetchRepoDataError::FailedToDownloadRepoData(err) => network::is_transient(err),
+        err => network::is_transient(err),
+    }
+}
+
+/// Downloads the repodata from the given url into the cache using the specified features.
+async fn fetch_repo_data(
+    url: Url,
+    client: AuthenticatedClient,
+    repodata_cache: &Path,
+    progress_bar: &indicatif::ProgressBar,
+    features: RepodataFeatures,
+) -> Result<fetch::CachedRepoData, fetch::FetchRepoDataError> {
+    network::with_retry(format!("fetching {url}"), is_transient_fetch_error, || {
+        let download_progress_progress_bar = progress_bar.clone();
+        fetch::fetch_repo_data(
+            url.clone(),
+            client.clone(),
+            repodata_cache,
+            fetch::FetchRepoDataOptions {
+                download_progress: Some(Box::new(
+                    move |fetch::DownloadProgress { total, bytes }| {
+                        download_progress_progress_bar.set_length(total.unwrap_or(bytes));
+                        download_progress_progress_bar.set_position(bytes);
+                    },
+                )),
+                zstd_enabled: features.zstd,
+                bz2_enabled: features.bz2,
+                jlap_enabled: features.jlap,
+                ..Default::default()
+            },
+        )
+    })
+    .await
+}
+
 /// Returns a friendly name for the specified channel.
 pub fn friendly_channel_name(channel: &Channel) -> String {
     channel
@@ -0,0 +1,522 @@
+//! Defines [`IndexedRepoData`], a memory-mapped `repodata.json` together with a binary index that
+//! maps package names to the location of their records in the json file.
+//!
+//! The index is stored in a sidecar file next to the cached `repodata.json` and is only rebuilt when
+//! the `repodata.json` changes. Looking up the records of a package is a binary search in the
+//! memory-mapped index followed by deserializing only the records of that package, the rest of the
+//! `repodata.json` is never touched.
+//!
+//! The sidecar file has the following layout, all integers are stored little-endian:
+//!
+//! ```text
+//! header:  magic (8 bytes), json length (u64), json modification time in ns (u64),
+//!          name count (u64), record count (u64), strings length (u64)
+//! names:   sorted by name, per name: name offset (u64), name length (u32),
+//!          first record (u32), record count (u32), padding (u32)
+//! records: per record: file name offset (u64), file name length (u32),
+//!          record length (u32), record offset in the json (u64)
+//! strings: the names of the packages and the file names of the records
+//! ```
+
+use crate::binary::{has_magic, read_u32, read_u64, read_usize, MAGIC_LEN};
+use itertools::Itertools;
+use memmap2::Mmap;
+use miette::{Context, IntoDiagnostic};
+use rattler_conda_types::{Channel, PackageRecord, Platform, RepoDataRecord};
+use serde::Deserialize;
+use serde_json::value::RawValue;
+use std::borrow::Cow;
+use std::collections::{HashMap, HashSet, VecDeque};
+use std::fs::File;
+use std::io::Write;
+use std::ops::Range;
+use std::path::{Path, PathBuf};
+use std::time::UNIX_EPOCH;
+
+/// The magic bytes at the start of every index file. The last byte is the version of the format.
+const INDEX_MAGIC: &[u8; MAGIC_LEN] = b"PIXIIDX\x01";
+
+/// The extension of the sidecar file that stores the index.
+const INDEX_EXTENSION: &str = "pixi-index";
+
+const HEADER_SIZE: usize = 48;
+const NAME_ENTRY_SIZE: usize = 24;
+const RECORD_ENTRY_SIZE: usize = 24;
+
+/// A `repodata.json` of a single channel subdirectory with an index to quickly find the records of
+/// a package.
+pub struct IndexedRepoData {
+    channel: Channel,
+    platform: Platform,
+    repodata: Mmap,
+    index: Mmap,
+    name_count: usize,
+    record_count: usize,
+}
+
+impl IndexedRepoData {
+    /// Opens the `repodata.json` at the given path. If the index of the file does not exist or is
+    /// out of date it is (re)built first.
+    pub fn new(
+        channel: Channel,
+        platform: Platform,
+        path: impl AsRef<Path>,
+    ) -> miette::Result<Self> {
+        let path = path.as_ref();
+        let repodata_file = File::open(path)
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to open {}", path.display()))?;
+        let (json_len, json_mtime) = file_stamp(&repodata_file)?;
+
+        // SAFETY: The cache files are replaced atomically and never modified in place.
+        let repodata = unsafe { Mmap::map(&repodata_file) }.into_diagnostic()?;
+
+        let index_path = index_path(path);
+        let index = match open_index(&index_path, json_len, json_mtime) {
+            Some(index) => index,
+            None => {
+                tracing::debug!("building index for {}", path.display());
+                build_index(&repodata, &index_path, json_len, json_mtime)?;
+                open_index(&index_path, json_len, json_mtime).ok_or_else(|| {
+                    miette::miette!("failed to read back the index {}", index_path.display())
+                })?
+            }
+        };
+
+        // Both counts were checked by `open_index`.
+        let name_count = read_usize(&index, 24).unwrap_or_default();
+        let record_count = read_usize(&index, 32).unwrap_or_default();
+        Ok(Self {
+            channel,
+            platform,
+            repodata,
+            index,
+            name_count,
+            record_count,
+        })
+    }
+
+    /// Returns the channel of the repodata.
+    pub fn channel(&self) -> &Channel {
+        &self.channel
+    }
+
+    /// Returns the subdirectory of the repodata.
+    pub fn subdir(&self) -> &str {
+        self.platform.as_str()
+    }
+
+    /// Returns the number of records in the repodata.
+    pub fn record_count(&self) -> usize {
+        self.record_count
+    }
+
+    /// Returns all records of the package with the given name.
+    pub fn load_records(&self, package_name: &str) -> miette::Result<Vec<RepoDataRecord>> {
+        let Some(name_index) = self.find_name(package_name)? else {
+            return Ok(Vec::new());
+        };
+
+        let entry = HEADER_SIZE + name_index * NAME_ENTRY_SIZE;
+        let (first_record, record_count) =
+            name_records(&self.index, entry).ok_or_else(|| self.corrupt())?;
+
+        let base_url = self.channel.platform_url(self.platform);
+        (first_record..first_record + record_count)
+            .map(|record_index| {
+                let entry = self.records_offset() + record_index * RECORD_ENTRY_SIZE;
+                let (file_name, record) = record_entry(&self.index, entry)
+                    .and_then(|(name, record)| {
+                        Some((self.string(name)?, self.repodata.get(record)?))
+                    })
+                    .ok_or_else(|| self.corrupt())?;
+
+                let package_record: PackageRecord = serde_json::from_slice(record)
+                    .into_diagnostic()
+                    .wrap_err_with(|| format!("failed to parse the record of {file_name}"))?;
+
+                Ok(RepoDataRecord {
+                    url: base_url.join(file_name).into_diagnostic()?,
+                    channel: self.channel.base_url().to_string(),
+                    file_name: file_name.to_owned(),
+                    package_record,
+                })
+            })
+            .collect()
+    }
+
+    /// Loads the records of the given packages and all packages they (transitively) depend on from
+    /// all the given repodata. Returns the records per repodata in the same order.
+    pub fn load_records_recursive<'a>(
+        repodata: impl IntoIterator<Item = &'a IndexedRepoData>,
+        package_names: impl IntoIterator<Item = impl Into<String>>,
+    ) -> miette::Result<Vec<Vec<RepoDataRecord>>> {
+        let repodata = repodata.into_iter().collect_vec();
+        let mut result = vec![Vec::new(); repodata.len()];
+
+        let mut seen = HashSet::<String>::new();
+        let mut queue = VecDeque::new();
+        for name in package_names {
+            let name: String = name.into();
+            if seen.insert(name.clone()) {
+                queue.push_back(name);
+            }
+        }
+
+        while let Some(name) = queue.pop_front() {
+            for (records, repodata) in result.iter_mut().zip(repodata.iter()) {
+                let package_records = repodata.load_records(&name)?;
+                for record in package_records.iter() {
+                    for dependency in record.package_record.depends.iter() {
+                        let dependency = package_name_from_match_spec(dependency);
+                        if !seen.contains(dependency) {
+                            seen.insert(dependency.to_owned());
+                            queue.push_back(dependency.to_owned());
+                        }
+                    }
+                }
+                records.extend(package_records);
+            }
+        }
+
+        Ok(result)
+    }
+
+    /// Finds the index of the given package name in the names table.
+    fn find_name(&self, package_name: &str) -> miette::Result<Option<usize>> {
+        let (mut low, mut high) = (0, self.name_count);
+        while low < high {
+            let mid = low + (high - low) / 2;
+            let entry = HEADER_SIZE + mid * NAME_ENTRY_SIZE;
+            let name = string_range(&self.index, entry)
+                .and_then(|name| self.string(name))
+                .ok_or_else(|| self.corrupt())?;
+            match name.cmp(package_name) {
+                std::cmp::Ordering::Less => low = mid + 1,
+                std::cmp::Ordering::Greater => high = mid,
+                std::cmp::Ordering::Equal => return Ok(Some(mid)),
+            }
+        }
+        Ok(None)
+    }
+
+    fn records_offset(&self) -> usize {
+        HEADER_SIZE + self.name_count * NAME_ENTRY_SIZE
+    }
+
+    /// Returns the string at the given range of the strings table, or `None` if the range is out
+    /// of bounds or not valid UTF-8.
+    fn string(&self, range: Range<usize>) -> Option<&str> {
+        let start = self.records_offset() + self.record_count * RECORD_ENTRY_SIZE;
+        let range = start.checked_add(range.start)?..start.checked_add(range.end)?;
+        std::str::from_utf8(self.index.get(range)?).ok()
+    }
+
+    /// The error that is returned when an entry of the index can't be read. This only happens if a
+    /// string is not valid UTF-8 or the index was modified after it was validated.
+    fn corrupt(&self) -> miette::Report {
+        miette::miette!(
+            "the repodata index of {}/{} is corrupt",
+            self.channel.canonical_name(),
+            self.platform
+        )
+    }
+}
+
+/// Returns the name of the package from a match spec string like `python >=3.8`.
+fn package_name_from_match_spec(spec: &str) -> &str {
+    spec.split(|c: char| c.is_whitespace() || matches!(c, '=' | '<' | '>' | '!' | '~' | '['))
+        .next()
+        .unwrap_or(spec)
+}
+
+/// Returns the path of the index of the `repodata.json` at the given path.
+fn index_path(repodata_path: &Path) -> PathBuf {
+    repodata_path.with_extension(INDEX_EXTENSION)
+}
+
+/// Returns the length and modification time of a file, used to determine if the index is still
+/// valid for a `repodata.json`.
+fn file_stamp(file: &File) -> miette::Result<(u64, u64)> {
+    let metadata = file.metadata().into_diagnostic()?;
+    let mtime = metadata
+        .modified()
+        .ok()
+        .and_then(|modified| modified.duration_since(UNIX_EPOCH).ok())
+        .map(|duration| duration.as_nanos() as u64)
+        .unwrap_or_default();
+    Ok((metadata.len(), mtime))
+}
+
+/// Opens the index at the given path if it exists and matches the `repodata.json`.
+fn open_index(path: &Path, json_len: u64, json_mtime: u64) -> Option<Mmap> {
+    let file = File::open(path).ok()?;
+    // SAFETY: Index files are replaced atomically and never modified in place.
+    let index = unsafe { Mmap::map(&file) }.ok()?;
+    if !has_magic(&index, INDEX_MAGIC)
+        || read_u64(&index, 8) != Some(json_len)
+        || read_u64(&index, 16) != Some(json_mtime)
+    {
+        return None;
+    }
+
+    validate_index(&index, json_len).then_some(index)
+}
+
+/// Checks that the tables of the index have the sizes given in the header and that every entry
+/// points inside the index and the `repodata.json`, so a truncated or corrupt index is rebuilt
+/// instead of being read out of bounds. Only the entries are checked, the strings are checked
+/// when they are read.
+fn validate_index(index: &[u8], json_len: u64) -> bool {
+    let validate = || -> Option<bool> {
+        let name_count = read_usize(index, 24)?;
+        let record_count = read_usize(index, 32)?;
+        let strings_len = read_usize(index, 40)?;
+        let records_offset = name_count
+            .checked_mul(NAME_ENTRY_SIZE)?
+            .checked_add(HEADER_SIZE)?;
+        let strings_offset = record_count
+            .checked_mul(RECORD_ENTRY_SIZE)?
+            .checked_add(records_offset)?;
+        if strings_offset.checked_add(strings_len)? != index.len() {
+            return Some(false);
+        }
+
+        let names_valid = (HEADER_SIZE..records_offset)
+            .step_by(NAME_ENTRY_SIZE)
+            .all(|entry| {
+                let records = name_records(index, entry);
+                string_range(index, entry).map_or(false, |name| name.end <= strings_len)
+                    && records.map_or(false, |(first, count)| {
+                        first
+                            .checked_add(count)
+                            .map_or(false, |end| end <= record_count)
+                    })
+            });
+        let records_valid = (records_offset..strings_offset)
+            .step_by(RECORD_ENTRY_SIZE)
+            .all(|entry| {
+                record_entry(index, entry).map_or(false, |(name, record)| {
+                    name.end <= strings_len && (record.end as u64) <= json_len
+                })
+            });
+        Some(names_valid && records_valid)
+    };
+    validate().unwrap_or(false)
+}
+
+/// Returns the range in the strings table of the string referenced by the name or record entry at
+/// the given offset. Both entries start with the offset and length of a string.
+fn string_range(index: &[u8], entry: usize) -> Option<Range<usize>> {
+    let start = read_usize(index, entry)?;
+    let len = read_u32(index, entry.checked_add(8)?)? as usize;
+    Some(start..start.checked_add(len)?)
+}
+
+/// Returns the first record and the number of records of the name entry at the given offset.
+fn name_records(index: &[u8], entry: usize) -> Option<(usize, usize)> {
+    let first_record = read_u32(index, entry.checked_add(12)?)? as usize;
+    let record_count = read_u32(index, entry.checked_add(16)?)? as usize;
+    Some((first_record, record_count))
+}
+
+/// Returns the range of the file name in the strings table and the range of the record in the
+/// `repodata.json` of the record entry at the given offset.
+fn record_entry(index: &[u8], entry: usize) -> Option<(Range<usize>, Range<usize>)> {
+    let file_name = string_range(index, entry)?;
+    let record_len = read_u32(index, entry.checked_add(12)?)? as usize;
+    let record_offset = read_usize(index, entry.checked_add(16)?)?;
+    Some((
+        file_name,
+        record_offset..record_offset.checked_add(record_len)?,
+    ))
+}
+
+/// The parts of a `repodata.json` that are needed to build the index. The records themselves are
+/// not parsed, only their location in the file is recorded.
+#[derive(Deserialize)]
+struct RawRepoData<'a> {
+    #[serde(borrow, default)]
+    packages: HashMap<Cow<'a, str>, &'a RawValue>,
+
+    #[serde(borrow, default, rename = "packages.conda")]
+    conda_packages: HashMap<Cow<'a, str>, &'a RawValue>,
+}
+
+/// The name of a package record.
+#[derive(Deserialize)]
+struct RecordName<'a> {
+    #[serde(borrow)]
+    name: Cow<'a, str>,
+}
+
+/// Builds the index of the given `repodata.json` and writes it to the given path.
+fn build_index(repodata: &[u8], path: &Path, json_len: u64, json_mtime: u64) -> miette::Result<()> {
+    let raw: RawRepoData = serde_json::from_slice(repodata)
+        .into_diagnostic()
+        .wrap_err("failed to parse repodata.json")?;
+
+    // Group the records by package name.
+    let mut packages = HashMap::<String, Vec<(Cow<str>, &RawValue)>>::new();
+    for (file_name, record) in raw.packages.into_iter().chain(raw.conda_packages) {
+        let name = serde_json::from_str::<RecordName>(record.get())
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to parse the name of {file_name}"))?
+            .name;
+        packages
+            .entry(name.into_owned())
+            .or_default()
+            .push((file_name, record));
+    }
+
+    let mut names = Vec::new();
+    let mut records = Vec::new();
+    let mut strings = Vec::new();
+    for (name, package_records) in packages.into_iter().sorted_by(|a, b| a.0.cmp(&b.0)) {
+        names.extend_from_slice(&(strings.len() as u64).to_le_bytes());
+        names.extend_from_slice(&(name.len() as u32).to_le_bytes());
+        names.extend_from_slice(&((records.len() / RECORD_ENTRY_SIZE) as u32).to_le_bytes());
+        names.extend_from_slice(&(package_records.len() as u32).to_le_bytes());
+        names.extend_from_slice(&0u32.to_le_bytes());
+        strings.extend_from_slice(name.as_bytes());
+
+        for (file_name, record) in package_records.into_iter().sorted_by(|a, b| a.0.cmp(&b.0)) {
+            // The raw value borrows from the repodata so its position in the file can be computed
+            // from the pointers.
+            let record_offset = record.get().as_ptr() as usize - repodata.as_ptr() as usize;
+            records.extend_from_slice(&(strings.len() as u64).to_le_bytes());
+            records.extend_from_slice(&(file_name.len() as u32).to_le_bytes());
+            records.extend_from_slice(&(record.get().len() as u32).to_le_bytes());
+            records.extend_from_slice(&(record_offset as u64).to_le_bytes());
+            strings.extend_from_slice(file_name.as_bytes());
+        }
+    }
+
+    let directory = path.parent().unwrap_or(Path::new("."));
+    let mut file = tempfile::NamedTempFile::new_in(directory).into_diagnostic()?;
+    let mut writer = std::io::BufWriter::new(&mut file);
+    writer.write_all(INDEX_MAGIC).into_diagnostic()?;
+    for value in [
+        json_len,
+        json_mtime,
+        (names.len() / NAME_ENTRY_SIZE) as u64,
+        (records.len() / RECORD_ENTRY_SIZE) as u64,
+        strings.len() as u64,
+    ] {
+        writer.write_all(&value.to_le_bytes()).into_diagnostic()?;
+    }
+    writer.write_all(&names).into_diagnostic()?;
+    writer.write_all(&records).into_diagnostic()?;
+    writer.write_all(&strings).into_diagnostic()?;
+    writer.flush().into_diagnostic()?;
+    drop(writer);
+    file.persist(path).into_diagnostic()?;
+
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use rattler_conda_types::ChannelConfig;
+
+    const REPODATA: &str = r#"{
+        "info": { "subdir": "linux-64" },
+        "packages": {
+            "foo-1.0-0.tar.bz2": { "name": "foo", "version": "1.0", "build": "0", "build_number": 0, "subdir": "linux-64", "depends": ["bar >=1"] },
+            "foo-2.0-0.tar.bz2": { "name": "foo", "version": "2.0", "build": "0", "build_number": 0, "subdir": "linux-64", "depends": ["bar"] },
+            "unrelated-1.0-0.tar.bz2": { "name": "unrelated", "version": "1.0", "build": "0", "build_number": 0, "subdir": "linux-64", "depends": [] }
+        },
+        "packages.conda": {
+            "bar-1.0-0.conda": { "name": "bar", "version": "1.0", "build": "0", "build_number": 0, "subdir": "linux-64", "depends": [] }
+        }
+    }"#;
+
+    #[test]
+    fn test_indexed_repodata() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("repodata.json");
+        std::fs::write(&path, REPODATA).unwrap();
+        let channel = Channel::from_str("conda-forge", &ChannelConfig::default()).unwrap();
+
+        let repodata = IndexedRepoData::new(channel.clone(), Platform::Linux64, &path).unwrap();
+        assert!(index_path(&path).is_file());
+        assert_eq!(repodata.record_count(), 4);
+        assert_eq!(repodata.subdir(), "linux-64");
+
+        let foo = repodata.load_records("foo").unwrap();
+        assert_eq!(
+            foo.iter().map(|r| r.file_name.as_str()).collect_vec(),
+            ["foo-1.0-0.tar.bz2", "foo-2.0-0.tar.bz2"]
+        );
+        assert_eq!(
+            foo[0].url.as_str(),
+            "https://conda.anaconda.org/conda-forge/linux-64/foo-1.0-0.tar.bz2"
+        );
+        assert!(repodata.load_records("baz").unwrap().is_empty());
+
+        let records =
+            IndexedRepoData::load_records_recursive([&repodata], [String::from("foo")]).unwrap();
+        assert_eq!(
+            records[0]
+                .iter()
+                .map(|r| r.package_record.name.as_str())
+                .collect_vec(),
+            ["foo", "foo", "bar"]
+        );
+
+        // Opening the repodata again reuses the index.
+        drop(repodata);
+        let index_modified = std::fs::metadata(index_path(&path))
+            .unwrap()
+            .modified()
+            .unwrap();
+        let repodata = IndexedRepoData::new(channel, Platform::Linux64, &path).unwrap();
+        assert_eq!(repodata.load_records("bar").unwrap().len(), 1);
+        assert_eq!(
+            std::fs::metadata(index_path(&path))
+                .unwrap()
+                .modified()
+                .unwrap(),
+            index_modified
+        );
+    }
+
+    #[test]
+    fn test_corrupt_index() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("repodata.json");
+        std::fs::write(&path, REPODATA).unwrap();
+        let channel = Channel::from_str("conda-forge", &ChannelConfig::default()).unwrap();
+        drop(IndexedRepoData::new(channel.clone(), Platform::Linux64, &path).unwrap());
+        let index = std::fs::read(index_path(&path)).unwrap();
+
+        // A truncated index is rebuilt.
+        std::fs::write(index_path(&path), &index[..index.len() - 1]).unwrap();
+        let repodata = IndexedRepoData::new(channel.clone(), Platform::Linux64, &path).unwrap();
+        assert_eq!(repodata.load_records("foo").unwrap().len(), 2);
+        drop(repodata);
+        assert_eq!(std::fs::read(index_path(&path)).unwrap(), index);
+
+        // So is an index with a record outside of the repodata.json.
+        let mut corrupt = index.clone();
+        let record = HEADER_SIZE + 3 * NAME_ENTRY_SIZE;
+        corrupt[record + 16..record + 24].copy_from_slice(&u64::MAX.to_le_bytes());
+        std::fs::write(index_path(&path), &corrupt).unwrap();
+        let repodata = IndexedRepoData::new(channel, Platform::Linux64, &path).unwrap();
+        assert_eq!(repodata.load_records("bar").unwrap().len(), 1);
+        drop(repodata);
+        assert_eq!(std::fs::read(index_path(&path)).unwrap(), index);
+    }
+
+    #[test]
+    fn test_package_name_from_match_spec() {
+        assert_eq!(package_name_from_match_spec("python >=3.8"), "python");
+        assert_eq!(package_name_from_match_spec("python==3.8"), "python");
+        assert_eq!(
+            package_name_from_match_spec("python[build=*_cp*]"),
+            "python"
+        );
+        assert_eq!(package_name_from_match_spec("python"), "python");
+    }
+}
@@ -0,0 +1,182 @@
+//! Terminates the processes that were started by tasks. Dropping the future that executes a task
+//! does not stop the processes the shell spawned for it, so when `pixi run --watch` restarts or
+//! stops its tasks it has to terminate these processes itself.
+
+#[cfg(unix)]
+use std::time::{Duration, Instant};
+
+/// How long the processes get to exit after they received `SIGTERM` before they are killed.
+#[cfg(unix)]
+const TERMINATE_GRACE_PERIOD: Duration = Duration::from_secs(2);
+
+/// The interval at which is checked whether the terminated processes exited.
+#[cfg(unix)]
+const TERMINATE_POLL_INTERVAL: Duration = Duration::from_millis(50);
+
+/// Terminates all processes started by this process and the processes they started in turn. The
+/// processes receive `SIGTERM` first, the ones that are still running after
+/// [`TERMINATE_GRACE_PERIOD`] are killed.
+#[cfg(unix)]
+pub async fn terminate_child_processes() {
+    let mut pids = match list_processes() {
+        Ok(processes) => descendants(std::process::id(), &processes),
+        Err(err) => {
+            tracing::warn!("failed to list the processes started by the tasks: {err}");
+            return;
+        }
+    };
+    if pids.is_empty() {
+        return;
+    }
+
+    tracing::debug!("terminating {} processes started by the tasks", pids.len());
+    send_signal(&pids, libc::SIGTERM);
+    let deadline = Instant::now() + TERMINATE_GRACE_PERIOD;
+    loop {
+        pids.retain(|&pid| is_running(pid));
+        if pids.is_empty() || Instant::now() >= deadline {
+            break;
+        }
+        tokio::time::sleep(TERMINATE_POLL_INTERVAL).await;
+    }
+    send_signal(&pids, libc::SIGKILL);
+}
+
+/// Terminating the processes of the tasks is only supported on unix platforms.
+#[cfg(not(unix))]
+pub async fn terminate_child_processes() {
+    tracing::debug!("the processes started by the tasks are not terminated on this platform");
+}
+
+/// Returns the ids of all processes that descend from the process with the given id, given the
+/// `(pid, parent pid)` pairs of all running processes.
+#[cfg(unix)]
+fn descendants(root: u32, processes: &[(u32, u32)]) -> Vec<u32> {
+    let mut result = Vec::new();
+    let mut queue = vec![root];
+    while let Some(parent) = queue.pop() {
+        for &(pid, _) in processes
+            .iter()
+            .filter(|(pid, ppid)| *ppid == parent && *pid != root)
+        {
+            if !result.contains(&pid) {
+                result.push(pid);
+                queue.push(pid);
+            }
+        }
+    }
+    result
+}
+
+#[cfg(unix)]
+fn send_signal(pids: &[u32], signal: libc::c_int) {
+    for &pid in pids {
+        // SAFETY: `kill` has no memory safety requirements.
+        unsafe { libc::kill(pid as libc::pid_t, signal) };
+    }
+}
+
+/// Returns true if the process exists and is not a zombie waiting to be reaped.
+#[cfg(unix)]
+fn is_running(pid: u32) -> bool {
+    // SAFETY: `kill` has no memory safety requirements.
+    if unsafe { libc::kill(pid as libc::pid_t, 0) } != 0 {
+        return false;
+    }
+    if cfg!(target_os = "linux") {
+        return std::fs::read_to_string(format!("/proc/{pid}/stat"))
+            .ok()
+            .and_then(|stat| parse_proc_stat(&stat))
+            .map_or(false, |(state, _)| state != 'Z');
+    }
+    true
+}
+
+/// Returns the `(pid, parent pid)` pairs of all running processes from `/proc`.
+#[cfg(target_os = "linux")]
+fn list_processes() -> std::io::Result<Vec<(u32, u32)>> {
+    let mut processes = Vec::new();
+    for entry in std::fs::read_dir("/proc")? {
+        let entry = entry?;
+        let Some(pid) = entry
+            .file_name()
+            .to_str()
+            .and_then(|name| name.parse().ok())
+        else {
+            continue;
+        };
+        // The process may have exited in the meantime.
+        let Ok(stat) = std::fs::read_to_string(entry.path().join("stat")) else {
+            continue;
+        };
+        if let Some((_, ppid)) = parse_proc_stat(&stat) {
+            processes.push((pid, ppid));
+        }
+    }
+    Ok(processes)
+}
+
+/// Returns the `(pid, parent pid)` pairs of all running processes from `ps`.
+#[cfg(all(unix, not(target_os = "linux")))]
+fn list_processes() -> std::io::Result<Vec<(u32, u32)>> {
+    let child = std::process::Command::new("ps")
+        .args(["-A", "-o", "pid=", "-o", "ppid="])
+        .stdout(std::process::Stdio::piped())
+        .spawn()?;
+    let ps_pid = child.id();
+    let output = child.wait_with_output()?;
+    Ok(String::from_utf8_lossy(&output.stdout)
+        .lines()
+        .filter_map(|line| {
+            let mut fields = line.split_whitespace();
+            Some((fields.next()?.parse().ok()?, fields.next()?.parse().ok()?))
+        })
+        .filter(|&(pid, _)| pid != ps_pid)
+        .collect())
+}
+
+/// Returns the state and the parent pid from the contents of `/proc/<pid>/stat`. The name of the
+/// process is enclosed in parentheses and may contain spaces and parentheses itself, so the fields
+/// are read after the last closing parenthesis.
+#[cfg(unix)]
+fn parse_proc_stat(stat: &str) -> Option<(char, u32)> {
+    let (_, fields) = stat.rsplit_once(')')?;
+    let mut fields = fields.split_whitespace();
+    let state = fields.next()?.chars().next()?;
+    let ppid = fields.next()?.parse().ok()?;
+    Some((state, ppid))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[cfg(unix)]
+    #[test]
+    fn test_descendants() {
+        let processes = [
+            (1, 0),
+            (10, 1),
+            (11, 10),
+            (12, 10),
+            (13, 11),
+            (20, 1),
+            (21, 20),
+        ];
+        let mut pids = descendants(10, &processes);
+        pids.sort();
+        assert_eq!(pids, [11, 12, 13]);
+        assert!(descendants(13, &processes).is_empty());
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_parse_proc_stat() {
+        assert_eq!(
+            parse_proc_stat("1234 (cargo test) S 1200 1234 1200 0 -1"),
+            Some(('S', 1200))
+        );
+        assert_eq!(parse_proc_stat("1234 (a) b) Z 1 1234"), Some(('Z', 1)));
+        assert_eq!(parse_proc_stat("1234"), None);
+    }
+}
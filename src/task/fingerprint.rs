@@ -0,0 +1,285 @@
+use crate::task::Execute;
+use crate::Project;
+use itertools::Itertools;
+use miette::{Context, IntoDiagnostic};
+use rattler_digest::{compute_bytes_digest, compute_file_digest, Sha256};
+use serde::{Deserialize, Serialize};
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::path::{Path, PathBuf};
+
+/// The name of the directory in `.pixi` that stores the fingerprints of tasks.
+const TASK_CACHE_DIR: &str = "task-cache";
+
+/// Describes the state of a task the last time it was executed successfully. If the fingerprint of
+/// a task did not change since then, the task does not have to be executed again.
+#[derive(Debug, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct TaskFingerprint {
+    /// A hash of the command, the environment and the contents of the input files.
+    pub inputs: String,
+
+    /// A hash of the contents of the output files.
+    pub outputs: String,
+}
+
+/// Stores the [`TaskFingerprint`]s of tasks in the `.pixi` directory of a project.
+#[derive(Debug, Clone)]
+pub struct TaskCache {
+    root: PathBuf,
+    cache_dir: PathBuf,
+}
+
+impl TaskCache {
+    /// Constructs a new instance for the given project.
+    pub fn new(project: &Project) -> Self {
+        Self {
+            root: project.root().to_path_buf(),
+            cache_dir: project.pixi_dir().join(TASK_CACHE_DIR),
+        }
+    }
+
+    /// Returns the path of the file that stores the fingerprint of the task with the given name.
+    fn fingerprint_path(&self, task_name: &str) -> PathBuf {
+        let file_name = task_name
+            .chars()
+            .map(|c| if c.is_ascii_alphanumeric() { c } else { '_' })
+            .collect::<String>();
+        let name_hash = format!("{:x}", compute_bytes_digest::<Sha256>(task_name));
+        self.cache_dir
+            .join(format!("{file_name}-{}.json", &name_hash[..8]))
+    }
+
+    /// Computes a hash of the command, the environment in which it runs and the contents of the
+    /// input files of a task. `env` should only contain the variables the project sets on top of
+    /// the system environment, see [`fingerprint_env`].
+    pub fn hash_inputs(
+        &self,
+        task: &Execute,
+        script: &str,
+        env: &HashMap<String, String>,
+    ) -> miette::Result<String> {
+        let mut content = String::new();
+        writeln!(content, "cmd: {script}").unwrap();
+        for (key, value) in env.iter().sorted() {
+            writeln!(content, "env: {key}={value}").unwrap();
+        }
+        let (files, _) = hash_files(&self.root, &task.inputs)?;
+        content.push_str(&files);
+        Ok(format!("{:x}", compute_bytes_digest::<Sha256>(content)))
+    }
+
+    /// Computes a hash of the contents of the output files of a task. Returns `None` if any of the
+    /// output globs does not match a file.
+    pub fn hash_outputs(&self, task: &Execute) -> miette::Result<Option<String>> {
+        let (files, all_matched) = hash_files(&self.root, &task.outputs)?;
+        Ok(all_matched.then(|| format!("{:x}", compute_bytes_digest::<Sha256>(files))))
+    }
+
+    /// Returns true if the task was previously executed with the same inputs hash and its outputs
+    /// did not change since.
+    pub fn is_up_to_date(&self, task_name: &str, task: &Execute, inputs_hash: &str) -> bool {
+        let previous = match std::fs::read(self.fingerprint_path(task_name))
+            .ok()
+            .and_then(|content| serde_json::from_slice::<TaskFingerprint>(&content).ok())
+        {
+            Some(previous) => previous,
+            None => return false,
+        };
+
+        if previous.inputs != inputs_hash {
+            return false;
+        }
+
+        match self.hash_outputs(task) {
+            Ok(Some(outputs)) => outputs == previous.outputs,
+            _ => false,
+        }
+    }
+
+    /// Records the fingerprint of a task that was executed successfully.
+    pub fn store(
+        &self,
+        task_name: &str,
+        task: &Execute,
+        inputs_hash: String,
+    ) -> miette::Result<()> {
+        let Some(outputs) = self.hash_outputs(task)? else {
+            tracing::warn!(
+                "not all outputs of task '{task_name}' were created, the task will not be cached"
+            );
+            return Ok(());
+        };
+
+        let fingerprint = TaskFingerprint {
+            inputs: inputs_hash,
+            outputs,
+        };
+        let path = self.fingerprint_path(task_name);
+        std::fs::create_dir_all(&self.cache_dir).into_diagnostic()?;
+        std::fs::write(&path, serde_json::to_vec(&fingerprint).into_diagnostic()?)
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to write {}", path.display()))
+    }
+}
+
+/// Returns the variables of `command_env` that are not set to the same value in `system_env`, i.e.
+/// the variables set by the activation of the environment and by the manifest. Only these are part
+/// of the fingerprint of a task: variables like `OLDPWD`, `SHLVL` or the terminal session differ
+/// between shells and would otherwise make a task run again every time.
+pub fn fingerprint_env(
+    command_env: &HashMap<String, String>,
+    system_env: &HashMap<String, String>,
+) -> HashMap<String, String> {
+    command_env
+        .iter()
+        .filter(|(key, value)| system_env.get(*key) != Some(*value))
+        .map(|(key, value)| (key.clone(), value.clone()))
+        .collect()
+}
+
+/// Expands the globs relative to the root directory and returns the sorted paths of all matched
+/// files, together with a flag that indicates whether every glob matched at least one file.
+pub fn expand_globs(root: &Path, globs: &[String]) -> miette::Result<(Vec<PathBuf>, bool)> {
+    let mut files = Vec::new();
+    let mut all_matched = true;
+    for pattern in globs {
+        let mut matched = false;
+        let full_pattern = format!(
+            "{}/{pattern}",
+            glob::Pattern::escape(&root.to_string_lossy())
+        );
+        for entry in glob::glob(&full_pattern)
+            .into_diagnostic()
+            .wrap_err_with(|| format!("invalid glob '{pattern}'"))?
+        {
+            let path = entry.into_diagnostic()?;
+            if path.is_file() {
+                files.push(path);
+                matched = true;
+            }
+        }
+        all_matched &= matched;
+    }
+
+    Ok((files.into_iter().sorted().dedup().collect(), all_matched))
+}
+
+/// Expands the globs relative to the root directory and returns a string that uniquely identifies
+/// the paths and contents of all matched files, together with a flag that indicates whether every
+/// glob matched at least one file.
+fn hash_files(root: &Path, globs: &[String]) -> miette::Result<(String, bool)> {
+    let (files, all_matched) = expand_globs(root, globs)?;
+    let mut content = String::new();
+    for path in files {
+        let hash = compute_file_digest::<Sha256>(&path)
+            .into_diagnostic()
+            .wrap_err_with(|| format!("failed to hash {}", path.display()))?;
+        let relative_path = path.strip_prefix(root).unwrap_or(&path);
+        writeln!(content, "{}: {:x}", relative_path.display(), hash).unwrap();
+    }
+
+    Ok((content, all_matched))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::task::CmdArgs;
+
+    fn task_with_io(inputs: &[&str], outputs: &[&str]) -> Execute {
+        Execute {
+            cmd: CmdArgs::Single(String::from("echo hello")),
+            depends_on: vec![],
+            inputs: inputs.iter().map(|s| s.to_string()).collect(),
+            outputs: outputs.iter().map(|s| s.to_string()).collect(),
+            weight: None,
+            exclusive: false,
+            env: true,
+        }
+    }
+
+    #[test]
+    fn test_fingerprint() {
+        let dir = tempfile::tempdir().unwrap();
+        let cache = TaskCache {
+            root: dir.path().to_path_buf(),
+            cache_dir: dir.path().join(".pixi").join(TASK_CACHE_DIR),
+        };
+        std::fs::write(dir.path().join("input.txt"), "foo").unwrap();
+        let task = task_with_io(&["*.txt"], &["out/*"]);
+        let env = HashMap::from([(String::from("FOO"), String::from("bar"))]);
+
+        // The task never ran and the output does not exist
+        let inputs_hash = cache.hash_inputs(&task, "echo hello", &env).unwrap();
+        assert!(!cache.is_up_to_date("task", &task, &inputs_hash));
+
+        // Without outputs the fingerprint is not stored.
+        cache.store("task", &task, inputs_hash.clone()).unwrap();
+        assert!(!cache.is_up_to_date("task", &task, &inputs_hash));
+
+        std::fs::create_dir(dir.path().join("out")).unwrap();
+        std::fs::write(dir.path().join("out").join("result"), "result").unwrap();
+        cache.store("task", &task, inputs_hash.clone()).unwrap();
+        assert!(cache.is_up_to_date("task", &task, &inputs_hash));
+
+        // Modifying an input, the command or the environment changes the hash.
+        std::fs::write(dir.path().join("input.txt"), "bar").unwrap();
+        assert_ne!(
+            cache.hash_inputs(&task, "echo hello", &env).unwrap(),
+            inputs_hash
+        );
+        std::fs::write(dir.path().join("input.txt"), "foo").unwrap();
+        assert_eq!(
+            cache.hash_inputs(&task, "echo hello", &env).unwrap(),
+            inputs_hash
+        );
+        assert_ne!(
+            cache.hash_inputs(&task, "echo bye", &env).unwrap(),
+            inputs_hash
+        );
+        assert_ne!(
+            cache
+                .hash_inputs(&task, "echo hello", &HashMap::new())
+                .unwrap(),
+            inputs_hash
+        );
+
+        // Modifying an output invalidates the cache
+        std::fs::write(dir.path().join("out").join("result"), "modified").unwrap();
+        assert!(!cache.is_up_to_date("task", &task, &inputs_hash));
+    }
+
+    #[test]
+    fn test_fingerprint_env() {
+        let env = |vars: &[(&str, &str)]| {
+            vars.iter()
+                .map(|(key, value)| (key.to_string(), value.to_string()))
+                .collect::<HashMap<_, _>>()
+        };
+        let system_env = env(&[("SHLVL", "1"), ("PATH", "/usr/bin")]);
+        let command_env = env(&[
+            ("SHLVL", "1"),
+            ("PATH", "/project/.pixi/env/bin:/usr/bin"),
+            ("CONDA_PREFIX", "/project/.pixi/env"),
+        ]);
+
+        // Only the variables set by the project are part of the fingerprint
+        let fingerprint = fingerprint_env(&command_env, &system_env);
+        assert_eq!(
+            fingerprint.keys().sorted().collect_vec(),
+            ["CONDA_PREFIX", "PATH"]
+        );
+
+        // Variables that only differ between shells don't matter
+        let other_shell = env(&[("SHLVL", "3"), ("OLDPWD", "/tmp"), ("PATH", "/usr/bin")]);
+        let mut other_command_env = command_env.clone();
+        other_command_env.extend(env(&[("SHLVL", "3"), ("OLDPWD", "/tmp")]));
+        assert_eq!(
+            fingerprint_env(&other_command_env, &other_shell),
+            fingerprint
+        );
+
+        // Tasks that run with the system environment have no environment in their fingerprint
+        assert!(fingerprint_env(&system_env, &system_env).is_empty());
+    }
+}
@@ -0,0 +1,426 @@
+use crate::task::{CmdArgs, Execute, Task};
+use crate::Project;
+use itertools::Itertools;
+use std::collections::{BTreeSet, HashMap};
+use std::ops::Index;
+
+/// An index of a task in a [`TaskGraph`].
+pub type TaskId = usize;
+
+/// A node in the [`TaskGraph`].
+#[derive(Debug, Clone)]
+pub struct TaskNode {
+    /// The name of the task or `None` if the task was constructed from the command line directly.
+    pub name: Option<String>,
+
+    /// The task to execute
+    pub task: Task,
+
+    /// Additional arguments to pass to the command
+    pub additional_args: Vec<String>,
+
+    /// The ids of the tasks that need to have finished before this task can run.
+    pub dependencies: Vec<TaskId>,
+}
+
+impl TaskNode {
+    /// Returns a name that can be used to identify this task in the output.
+    pub fn display_name(&self) -> String {
+        match &self.name {
+            Some(name) => name.clone(),
+            None => match &self.task {
+                Task::Plain(cmd)
+                | Task::Execute(Execute {
+                    cmd: CmdArgs::Single(cmd),
+                    ..
+                }) => cmd
+                    .split_whitespace()
+                    .next()
+                    .unwrap_or_default()
+                    .to_string(),
+                Task::Execute(Execute {
+                    cmd: CmdArgs::Multiple(args),
+                    ..
+                }) => args.first().cloned().unwrap_or_default(),
+                Task::Alias(_) => String::new(),
+            },
+        }
+    }
+}
+
+/// A directed acyclic graph of tasks and the tasks they depend on. A graph is constructed from the
+/// task that was requested on the command line and includes all of its transitive `depends_on`
+/// tasks. Every task is only included once, even if multiple tasks depend on it.
+#[derive(Debug, Clone)]
+pub struct TaskGraph {
+    nodes: Vec<TaskNode>,
+}
+
+impl Index<TaskId> for TaskGraph {
+    type Output = TaskNode;
+
+    fn index(&self, index: TaskId) -> &Self::Output {
+        &self.nodes[index]
+    }
+}
+
+impl TaskGraph {
+    /// Constructs a graph from the arguments passed on the command line. If the first argument
+    /// refers to a task in the project that task is used, otherwise the arguments are interpreted as
+    /// a command to execute.
+    pub fn from_cmd_args(project: &Project, args: Vec<String>) -> miette::Result<Self> {
+        // Find the command in the project.
+        let (name, task, additional_args) = match args
+            .first()
+            .and_then(|name| project.task_opt(name).map(|task| (name, task)))
+        {
+            Some((name, task)) => (Some(name.clone()), task.clone(), args[1..].to_vec()),
+            None => (
+                None,
+                Task::Execute(Execute {
+                    cmd: CmdArgs::Multiple(args),
+                    depends_on: vec![],
+                    inputs: vec![],
+                    outputs: vec![],
+                    weight: None,
+                    exclusive: false,
+                    env: true,
+                }),
+                Vec::new(),
+            ),
+        };
+
+        Self::from_root(project, name, task, additional_args)
+    }
+
+    /// Constructs a graph that contains the specified task and all the tasks it (transitively)
+    /// depends on.
+    fn from_root(
+        project: &Project,
+        name: Option<String>,
+        task: Task,
+        additional_args: Vec<String>,
+    ) -> miette::Result<Self> {
+        let mut ids = HashMap::new();
+        if let Some(name) = &name {
+            ids.insert(name.clone(), 0);
+        }
+
+        let mut nodes = vec![TaskNode {
+            name,
+            task,
+            additional_args,
+            dependencies: Vec::new(),
+        }];
+
+        let mut queue = vec![0];
+        while let Some(id) = queue.pop() {
+            let mut dependencies = Vec::new();
+            for dependency in nodes[id].task.depends_on().to_vec() {
+                let dependency_id = match ids.get(&dependency) {
+                    Some(&dependency_id) => dependency_id,
+                    None => {
+                        let task = project
+                            .task_opt(&dependency)
+                            .ok_or_else(|| {
+                                miette::miette!("failed to find dependency {}", dependency)
+                            })?
+                            .clone();
+                        let dependency_id = nodes.len();
+                        nodes.push(TaskNode {
+                            name: Some(dependency.clone()),
+                            task,
+                            additional_args: Vec::new(),
+                            dependencies: Vec::new(),
+                        });
+                        ids.insert(dependency, dependency_id);
+                        queue.push(dependency_id);
+                        dependency_id
+                    }
+                };
+
+                if !dependencies.contains(&dependency_id) {
+                    dependencies.push(dependency_id);
+                }
+            }
+            nodes[id].dependencies = dependencies;
+        }
+
+        // Make sure the graph does not contain any cycles.
+        let graph = Self { nodes };
+        graph.topological_order()?;
+
+        Ok(graph)
+    }
+
+    /// Returns the number of tasks in the graph.
+    pub fn len(&self) -> usize {
+        self.nodes.len()
+    }
+
+    /// Returns true if there are no tasks in the graph.
+    pub fn is_empty(&self) -> bool {
+        self.nodes.is_empty()
+    }
+
+    /// Returns all the tasks in the graph. The index of a task in the slice is its [`TaskId`].
+    pub fn nodes(&self) -> &[TaskNode] {
+        &self.nodes
+    }
+
+    /// Returns for every task the ids of the tasks that directly depend on it.
+    pub fn dependents(&self) -> Vec<Vec<TaskId>> {
+        let mut dependents = vec![Vec::new(); self.nodes.len()];
+        for (id, node) in self.nodes.iter().enumerate() {
+            for &dependency in node.dependencies.iter() {
+                dependents[dependency].push(id);
+            }
+        }
+        dependents
+    }
+
+    /// Returns the given tasks together with all the tasks that (transitively) depend on them.
+    pub fn with_dependents(&self, ids: impl IntoIterator<Item = TaskId>) -> BTreeSet<TaskId> {
+        let dependents = self.dependents();
+        let mut result = BTreeSet::new();
+        let mut queue = ids.into_iter().collect_vec();
+        while let Some(id) = queue.pop() {
+            if result.insert(id) {
+                queue.extend(dependents[id].iter().copied());
+            }
+        }
+        result
+    }
+
+    /// Returns a graph that only contains the given tasks. Dependencies on tasks that are not
+    /// included are dropped, these tasks are assumed to have finished already. The ids of the tasks
+    /// in the new graph are their positions in `ids`.
+    pub fn subgraph(&self, ids: &BTreeSet<TaskId>) -> Self {
+        let new_ids: HashMap<TaskId, TaskId> = ids
+            .iter()
+            .enumerate()
+            .map(|(new_id, &id)| (id, new_id))
+            .collect();
+        let nodes = ids
+            .iter()
+            .map(|&id| {
+                let node = &self.nodes[id];
+                TaskNode {
+                    dependencies: node
+                        .dependencies
+                        .iter()
+                        .filter_map(|dependency| new_ids.get(dependency).copied())
+                        .collect(),
+                    ..node.clone()
+                }
+            })
+            .collect();
+        Self { nodes }
+    }
+
+    /// Returns the ids of all tasks in an order in which every task comes after all of its
+    /// dependencies. Tasks that do not depend on each other are ordered by the order in which they
+    /// were discovered. Returns an error if the graph contains a cycle.
+    pub fn topological_order(&self) -> miette::Result<Vec<TaskId>> {
+        let dependents = self.dependents();
+        let mut remaining = self
+            .nodes
+            .iter()
+            .map(|node| node.dependencies.len())
+            .collect_vec();
+
+        let mut ready = remaining
+            .iter()
+            .positions(|&count| count == 0)
+            .collect::<BTreeSet<_>>();
+        let mut order = Vec::with_capacity(self.nodes.len());
+        while let Some(id) = ready.pop_first() {
+            order.push(id);
+            for &dependent in dependents[id].iter() {
+                remaining[dependent] -= 1;
+                if remaining[dependent] == 0 {
+                    ready.insert(dependent);
+                }
+            }
+        }
+
+        if order.len() < self.nodes.len() {
+            let cyclic = remaining
+                .iter()
+                .positions(|&count| count > 0)
+                .map(|id| self.nodes[id].display_name())
+                .join(", ");
+            miette::bail!("cycle detected in the dependencies of the tasks: {cyclic}");
+        }
+
+        Ok(order)
+    }
+
+    /// Returns true if no two tasks in the graph can run at the same time, i.e. every task depends
+    /// on the task that comes before it in the topological order.
+    pub fn is_sequential(&self) -> bool {
+        match self.topological_order() {
+            Ok(order) => order
+                .iter()
+                .tuple_windows()
+                .all(|(prev, next)| self.nodes[*next].dependencies.contains(prev)),
+            Err(_) => false,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::path::Path;
+
+    const PROJECT_BOILERPLATE: &str = r#"
+        [project]
+        name = "foo"
+        version = "0.1.0"
+        channels = []
+        platforms = []
+        "#;
+
+    fn project_with_tasks(tasks: &str) -> Project {
+        Project::from_manifest_str(
+            Path::new(""),
+            format!("{PROJECT_BOILERPLATE}\n[tasks]\n{tasks}"),
+        )
+        .unwrap()
+    }
+
+    fn ordered_names(graph: &TaskGraph) -> Vec<String> {
+        graph
+            .topological_order()
+            .unwrap()
+            .into_iter()
+            .map(|id| graph[id].display_name())
+            .collect()
+    }
+
+    #[test]
+    fn test_diamond_dependencies() {
+        let project = project_with_tasks(
+            r#"
+            root = { cmd = "echo root", depends_on = ["left", "right"] }
+            left = { cmd = "echo left", depends_on = ["base"] }
+            right = { cmd = "echo right", depends_on = ["base"] }
+            base = "echo base"
+            "#,
+        );
+
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("root")]).unwrap();
+        assert_eq!(graph.len(), 4);
+        assert_eq!(ordered_names(&graph), ["base", "left", "right", "root"]);
+        assert!(!graph.is_sequential());
+    }
+
+    #[test]
+    fn test_task_weights() {
+        let project = project_with_tasks(
+            r#"
+            all = { depends_on = ["build", "test", "lint"] }
+            build = { cmd = "ninja -C .build", weight = 4 }
+            test = { cmd = "ctest", exclusive = true }
+            lint = "clang-tidy"
+            "#,
+        );
+
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("all")]).unwrap();
+        let weight = |name: &str, jobs: usize| {
+            graph
+                .nodes()
+                .iter()
+                .find(|node| node.display_name() == name)
+                .unwrap()
+                .task
+                .weight(jobs)
+        };
+        assert_eq!(weight("build", 8), 4);
+        assert_eq!(weight("build", 2), 2);
+        assert_eq!(weight("test", 8), 8);
+        assert_eq!(weight("lint", 8), 1);
+        assert_eq!(weight("all", 8), 0);
+    }
+
+    #[test]
+    fn test_task_requires_environment() {
+        let project = project_with_tasks(
+            r#"
+            deploy = { cmd = "rsync -a dist/ server:", depends_on = ["build"], env = false }
+            build = "python -m build"
+            "#,
+        );
+
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("deploy")]).unwrap();
+        let requires_environment = graph
+            .topological_order()
+            .unwrap()
+            .into_iter()
+            .map(|id| graph[id].task.requires_environment())
+            .collect_vec();
+        assert_eq!(requires_environment, [true, false]);
+    }
+
+    #[test]
+    fn test_sequential_dependencies() {
+        let project = project_with_tasks(
+            r#"
+            start = { cmd = "echo start", depends_on = ["build"] }
+            build = { cmd = "echo build", depends_on = ["configure"] }
+            configure = "echo configure"
+            "#,
+        );
+
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("start")]).unwrap();
+        assert_eq!(ordered_names(&graph), ["configure", "build", "start"]);
+        assert!(graph.is_sequential());
+    }
+
+    #[test]
+    fn test_subgraph_with_dependents() {
+        let project = project_with_tasks(
+            r#"
+            root = { cmd = "echo root", depends_on = ["left", "right"] }
+            left = { cmd = "echo left", depends_on = ["base"] }
+            right = { cmd = "echo right", depends_on = ["base"] }
+            base = "echo base"
+            "#,
+        );
+
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("root")]).unwrap();
+        let left = (0..graph.len())
+            .find(|&id| graph[id].display_name() == "left")
+            .unwrap();
+        let subgraph = graph.subgraph(&graph.with_dependents([left]));
+        assert_eq!(ordered_names(&subgraph), ["left", "root"]);
+
+        // The dependency on `right` is dropped, it is not part of the subgraph.
+        assert!(subgraph.is_sequential());
+    }
+
+    #[test]
+    fn test_cyclic_dependencies() {
+        let project = project_with_tasks(
+            r#"
+            a = { cmd = "echo a", depends_on = ["b"] }
+            b = { cmd = "echo b", depends_on = ["a"] }
+            "#,
+        );
+
+        assert!(TaskGraph::from_cmd_args(&project, vec![String::from("a")]).is_err());
+    }
+
+    #[test]
+    fn test_cmd_args_without_task() {
+        let project = project_with_tasks("");
+        let graph = TaskGraph::from_cmd_args(
+            &project,
+            vec![String::from("python"), String::from("--version")],
+        )
+        .unwrap();
+        assert_eq!(graph.len(), 1);
+        assert_eq!(graph[0].display_name(), "python");
+    }
+}
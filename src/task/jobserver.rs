@@ -0,0 +1,368 @@
+//! Defines a GNU make compatible jobserver, so the tasks `pixi run` executes at the same time share
+//! a single pool of job slots with the build tools they run (make, ninja >= 1.13, cargo, ...)
+//! instead of each of them starting a job per CPU core.
+//!
+//! The jobserver is a named pipe that contains one byte (a token) for every job slot except the
+//! one that every process implicitly owns. A process reads a token from the pipe before it starts
+//! an additional job and writes it back once that job finished. The pipe is passed to the child
+//! processes through `MAKEFLAGS`, in the format introduced with make 4.4:
+//!
+//! ```text
+//! MAKEFLAGS= -j8 --jobserver-auth=fifo:/tmp/.tmpXXXXXX/jobserver
+//! ```
+//!
+//! When `pixi run` itself runs under such a jobserver, e.g. from a make recipe or a task of another
+//! `pixi run`, it uses the jobserver of its parent instead of creating a new one.
+
+use std::collections::HashMap;
+use std::fs::File;
+use std::io;
+use std::path::{Path, PathBuf};
+
+/// The environment variable through which the jobserver is passed to child processes.
+pub const MAKEFLAGS_ENV: &str = "MAKEFLAGS";
+
+/// The byte that represents a token in the pipe, this is the same byte make uses.
+const TOKEN: u8 = b'+';
+
+/// A GNU make compatible jobserver, see the module documentation.
+#[derive(Debug)]
+pub struct Jobserver {
+    /// The named pipe opened for reading and writing, reads do not block.
+    fifo: File,
+
+    /// The value of `MAKEFLAGS` for the child processes.
+    makeflags: String,
+
+    /// The total number of job slots of the jobserver, if known.
+    jobs: Option<usize>,
+
+    /// The directory containing the pipe if it was created by this process, it is removed when
+    /// the jobserver is dropped.
+    _dir: Option<tempfile::TempDir>,
+}
+
+impl Jobserver {
+    /// Returns the jobserver of the parent process if `MAKEFLAGS` contains one that uses a named
+    /// pipe, otherwise a new jobserver with `jobs` slots is created.
+    pub fn new(jobs: usize) -> io::Result<Self> {
+        Self::with_makeflags(jobs, std::env::var(MAKEFLAGS_ENV).unwrap_or_default())
+    }
+
+    /// Returns the jobserver in the given `MAKEFLAGS` or creates a new one.
+    fn with_makeflags(jobs: usize, makeflags: String) -> io::Result<Self> {
+        if let Some(path) = parse_fifo_path(&makeflags) {
+            tracing::debug!("using the jobserver at {}", path.display());
+            return Ok(Self {
+                fifo: open_fifo(&path)?,
+                jobs: parse_jobs(&makeflags),
+                makeflags,
+                _dir: None,
+            });
+        }
+
+        let dir = tempfile::tempdir()?;
+        let path = dir.path().join("jobserver");
+        create_fifo(&path)?;
+        let fifo = open_fifo(&path)?;
+        write_tokens(&fifo, jobs.saturating_sub(1))?;
+
+        // Keep the flags of the user but let the jobserver determine the number of jobs.
+        let makeflags = format!(
+            "{} -j{jobs} --jobserver-auth=fifo:{}",
+            makeflags.trim(),
+            path.display()
+        );
+        Ok(Self {
+            fifo,
+            makeflags,
+            jobs: Some(jobs),
+            _dir: Some(dir),
+        })
+    }
+
+    /// Adds the variables that pass the jobserver to a child process to the given environment.
+    pub fn extend_env(&self, env: &HashMap<String, String>) -> HashMap<String, String> {
+        let mut env = env.clone();
+        env.insert(String::from(MAKEFLAGS_ENV), self.makeflags.clone());
+        env
+    }
+
+    /// Takes a token from the jobserver if one is available right now. Returns false otherwise.
+    pub fn try_acquire(&self) -> io::Result<bool> {
+        let mut token = [0u8; 1];
+        match io::Read::read(&mut &self.fifo, &mut token) {
+            Ok(1) => Ok(true),
+            Ok(_) => Ok(false),
+            Err(err) if err.kind() == io::ErrorKind::WouldBlock => Ok(false),
+            Err(err) if err.kind() == io::ErrorKind::Interrupted => Ok(false),
+            Err(err) => Err(err),
+        }
+    }
+
+    /// Returns tokens to the jobserver.
+    pub fn release(&self, count: usize) -> io::Result<()> {
+        write_tokens(&self.fifo, count)
+    }
+}
+
+/// Keeps track of the job slots that are used by the running tasks. Every task occupies a number
+/// of slots while it runs (see [`crate::task::Task::weight`]) and the total is never more than
+/// `jobs`, this only decides when pixi starts a task. With a [`Jobserver`] every running task
+/// except the first one also holds a single token taken from the jobserver. The other slots of a
+/// task are left in the jobserver so the tools the task runs can use them, making the slots of the
+/// tasks and the jobs of their tools come from the same pool.
+#[derive(Debug)]
+pub struct JobSlots {
+    /// The maximum number of slots that can be used at the same time.
+    jobs: usize,
+
+    /// The number of slots used by the running tasks.
+    used: usize,
+
+    /// The number of running tasks.
+    running: usize,
+
+    /// The number of tokens taken from the jobserver.
+    tokens: usize,
+
+    jobserver: Option<Jobserver>,
+}
+
+impl JobSlots {
+    /// Constructs a new instance with at most `jobs` slots. With the jobserver of a parent process
+    /// there are never more slots than the jobserver has, otherwise a task could wait forever for
+    /// tokens that don't exist.
+    pub fn new(jobs: usize, jobserver: Option<Jobserver>) -> Self {
+        let limit = jobserver
+            .as_ref()
+            .and_then(|jobserver| jobserver.jobs)
+            .unwrap_or(usize::MAX);
+        Self {
+            jobs: jobs.min(limit).max(1),
+            used: 0,
+            running: 0,
+            tokens: 0,
+            jobserver,
+        }
+    }
+
+    /// Returns the jobserver that backs the slots, if any.
+    pub fn jobserver(&self) -> Option<&Jobserver> {
+        self.jobserver.as_ref()
+    }
+
+    /// Tries to occupy `weight` slots for a task. Returns false if not enough slots are available
+    /// right now or the jobserver has no token for the task.
+    pub fn try_occupy(&mut self, weight: usize) -> io::Result<bool> {
+        let weight = weight.min(self.jobs);
+        if self.used + weight > self.jobs {
+            return Ok(false);
+        }
+
+        // The first task uses the implicit token of this process.
+        if let Some(jobserver) = &self.jobserver {
+            if self.tokens < self.running {
+                if !jobserver.try_acquire()? {
+                    return Ok(false);
+                }
+                self.tokens += 1;
+            }
+        }
+
+        self.used += weight;
+        self.running += 1;
+        Ok(true)
+    }
+
+    /// Frees the slots that were occupied by a task that finished.
+    pub fn free(&mut self, weight: usize) {
+        self.used -= weight.min(self.jobs);
+        self.running -= 1;
+    }
+
+    /// Returns the tokens that are not needed by the running tasks to the jobserver, so the tools
+    /// started by the running tasks can use them.
+    pub fn release_unused(&mut self) -> io::Result<()> {
+        let needed = self.running.saturating_sub(1);
+        if let Some(jobserver) = &self.jobserver {
+            if self.tokens > needed {
+                jobserver.release(self.tokens - needed)?;
+            }
+        }
+        self.tokens = self.tokens.min(needed);
+        Ok(())
+    }
+}
+
+impl Drop for JobSlots {
+    fn drop(&mut self) {
+        // Don't keep the tokens of a parent jobserver when the tasks are cancelled.
+        if let Some(jobserver) = &self.jobserver {
+            let _ = jobserver.release(self.tokens);
+        }
+    }
+}
+
+/// Returns the path of the named pipe from a `--jobserver-auth=fifo:PATH` argument in `MAKEFLAGS`.
+/// Jobservers that pass file descriptors instead are not supported because the file descriptors
+/// are not inherited reliably.
+fn parse_fifo_path(makeflags: &str) -> Option<PathBuf> {
+    makeflags
+        .split_whitespace()
+        .rev()
+        .find_map(|flag| flag.strip_prefix("--jobserver-auth=fifo:"))
+        .map(PathBuf::from)
+}
+
+/// Returns the number of jobs from the last `-jN` argument in `MAKEFLAGS`.
+fn parse_jobs(makeflags: &str) -> Option<usize> {
+    makeflags
+        .split_whitespace()
+        .rev()
+        .find_map(|flag| flag.strip_prefix("-j")?.parse().ok())
+}
+
+/// Writes `count` tokens to the pipe.
+fn write_tokens(fifo: &File, count: usize) -> io::Result<()> {
+    io::Write::write_all(&mut &*fifo, &vec![TOKEN; count])
+}
+
+#[cfg(unix)]
+fn create_fifo(path: &Path) -> io::Result<()> {
+    use std::os::unix::ffi::OsStrExt;
+    let path = std::ffi::CString::new(path.as_os_str().as_bytes())
+        .map_err(|err| io::Error::new(io::ErrorKind::InvalidInput, err))?;
+    if unsafe { libc::mkfifo(path.as_ptr(), 0o600) } != 0 {
+        return Err(io::Error::last_os_error());
+    }
+    Ok(())
+}
+
+/// Opens the pipe for reading and writing, this never blocks, not even if no other process has
+/// the pipe open. Reads are non-blocking so waiting for a token never holds up a thread.
+#[cfg(unix)]
+fn open_fifo(path: &Path) -> io::Result<File> {
+    use std::os::unix::fs::OpenOptionsExt;
+    std::fs::OpenOptions::new()
+        .read(true)
+        .write(true)
+        .custom_flags(libc::O_NONBLOCK)
+        .open(path)
+}
+
+#[cfg(not(unix))]
+fn create_fifo(_path: &Path) -> io::Result<()> {
+    Err(io::Error::new(
+        io::ErrorKind::Unsupported,
+        "a jobserver is only available on unix platforms",
+    ))
+}
+
+#[cfg(not(unix))]
+fn open_fifo(_path: &Path) -> io::Result<File> {
+    Err(io::Error::new(
+        io::ErrorKind::Unsupported,
+        "a jobserver is only available on unix platforms",
+    ))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn test_parse_fifo_path() {
+        assert_eq!(
+            parse_fifo_path(" -j8 --jobserver-auth=fifo:/tmp/GMfifo1234"),
+            Some(PathBuf::from("/tmp/GMfifo1234"))
+        );
+        assert_eq!(parse_fifo_path(" -j8 --jobserver-auth=3,4"), None);
+        assert_eq!(parse_fifo_path(""), None);
+        assert_eq!(
+            parse_jobs(" -j8 --jobserver-auth=fifo:/tmp/GMfifo1234"),
+            Some(8)
+        );
+        assert_eq!(parse_jobs(" -j --jobserver-auth=3,4"), None);
+    }
+
+    #[test]
+    fn test_job_slots() {
+        let mut slots = JobSlots::new(4, None);
+        assert!(slots.try_occupy(1).unwrap());
+        assert!(slots.try_occupy(2).unwrap());
+
+        // An exclusive task has to wait for all other tasks
+        assert!(!slots.try_occupy(4).unwrap());
+        assert!(slots.try_occupy(1).unwrap());
+        slots.free(1);
+        slots.free(2);
+        slots.free(1);
+        assert!(slots.try_occupy(4).unwrap());
+
+        // Weights over the number of jobs occupy all slots
+        slots.free(4);
+        assert!(slots.try_occupy(16).unwrap());
+        assert!(!slots.try_occupy(1).unwrap());
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_job_slots_with_jobserver() {
+        let jobserver = Jobserver::with_makeflags(3, String::new()).unwrap();
+        assert!(jobserver.makeflags.ends_with(&format!(
+            " -j3 --jobserver-auth=fifo:{}",
+            jobserver
+                ._dir
+                .as_ref()
+                .unwrap()
+                .path()
+                .join("jobserver")
+                .display()
+        )));
+        let mut slots = JobSlots::new(3, Some(jobserver));
+
+        // The first task uses the implicit token, every other task takes one token regardless of its
+        // weight.
+        assert!(slots.try_occupy(2).unwrap());
+        assert_eq!(slots.tokens, 0);
+        assert!(slots.try_occupy(1).unwrap());
+        assert_eq!(slots.tokens, 1);
+
+        // The remaining token is left for the tools of the tasks
+        assert!(slots.jobserver().unwrap().try_acquire().unwrap());
+        assert!(!slots.jobserver().unwrap().try_acquire().unwrap());
+        slots.jobserver().unwrap().release(1).unwrap();
+
+        // Tokens taken by another process are not available to the tasks
+        slots.free(2);
+        slots.release_unused().unwrap();
+        assert_eq!(slots.tokens, 0);
+        assert!(slots.jobserver().unwrap().try_acquire().unwrap());
+        assert!(slots.jobserver().unwrap().try_acquire().unwrap());
+        assert!(!slots.try_occupy(1).unwrap());
+        slots.jobserver().unwrap().release(2).unwrap();
+        assert!(slots.try_occupy(1).unwrap());
+        assert_eq!(slots.tokens, 1);
+    }
+
+    #[cfg(unix)]
+    #[test]
+    fn test_weighted_task_leaves_tokens_to_its_tools() {
+        let jobserver = Jobserver::with_makeflags(4, String::new()).unwrap();
+        let mut slots = JobSlots::new(4, Some(jobserver));
+
+        // An exclusive task holds no token, the tools it runs can take all the other slots.
+        assert!(slots.try_occupy(4).unwrap());
+        assert_eq!(slots.tokens, 0);
+        for _ in 0..3 {
+            assert!(slots.jobserver().unwrap().try_acquire().unwrap());
+        }
+        assert!(!slots.jobserver().unwrap().try_acquire().unwrap());
+
+        // No other task is started while it runs
+        slots.jobserver().unwrap().release(3).unwrap();
+        assert!(!slots.try_occupy(1).unwrap());
+        assert_eq!(slots.tokens, 0);
+    }
+}
@@ -3,6 +3,18 @@ use serde::Deserialize;
 use serde_with::{formats::PreferMany, serde_as, OneOrMany};
 use std::fmt::{Display, Formatter};
 
+mod children;
+mod fingerprint;
+mod graph;
+mod jobserver;
+mod watch;
+
+pub use children::terminate_child_processes;
+pub use fingerprint::{fingerprint_env, TaskCache, TaskFingerprint};
+pub use graph::{TaskGraph, TaskId, TaskNode};
+pub use jobserver::{JobSlots, Jobserver};
+pub use watch::{has_inputs, InputsSnapshot};
+
 /// Represents different types of scripts
 #[derive(Debug, Clone, Deserialize)]
 #[serde(untagged)]
@@ -20,6 +32,27 @@ impl Task {
             Task::Alias(cmd) => &cmd.depends_on,
         }
     }
+
+    /// Returns true if the task runs in the activated environment of the project.
+    pub fn requires_environment(&self) -> bool {
+        match self {
+            Task::Plain(_) => true,
+            Task::Execute(cmd) => cmd.env,
+            Task::Alias(_) => false,
+        }
+    }
+
+    /// Returns the number of job slots the task occupies while it runs if `jobs` slots are
+    /// available in total. An alias does not run anything and does not occupy a slot.
+    pub fn weight(&self, jobs: usize) -> usize {
+        let jobs = jobs.max(1);
+        match self {
+            Task::Plain(_) => 1,
+            Task::Execute(cmd) if cmd.exclusive => jobs,
+            Task::Execute(cmd) => cmd.weight.unwrap_or(1).clamp(1, jobs),
+            Task::Alias(_) => 0,
+        }
+    }
 }
 
 /// A command script executes a single command from the environment
@@ -34,6 +67,44 @@ pub struct Execute {
     #[serde(default)]
     #[serde_as(deserialize_as = "OneOrMany<_, PreferMany>")]
     pub depends_on: Vec<String>,
+
+    /// Globs of the files that are read by this task, relative to the project root. If the inputs,
+    /// the command and the environment did not change since the task last ran successfully the
+    /// task is skipped.
+    #[serde(default)]
+    pub inputs: Vec<String>,
+
+    /// Globs of the files that are produced by this task, relative to the project root. The task is
+    /// only skipped if all of its outputs still exist and were not modified.
+    #[serde(default)]
+    pub outputs: Vec<String>,
+
+    /// The number of job slots the task occupies while it runs, e.g. the number of jobs a build
+    /// tool started by the task runs in parallel. Defaults to 1.
+    #[serde(default)]
+    pub weight: Option<usize>,
+
+    /// If true no other task runs at the same time as this task, the task can use all job slots.
+    #[serde(default)]
+    pub exclusive: bool,
+
+    /// If false the task runs with the environment variables of the system instead of in the
+    /// activated environment of the project, so the environment is neither verified nor activated
+    /// before the task runs. This is useful for tasks that only use tools of the system.
+    #[serde(default = "default_true")]
+    pub env: bool,
+}
+
+fn default_true() -> bool {
+    true
+}
+
+impl Execute {
+    /// Returns true if the task defines `inputs` or `outputs` and can therefore be skipped when
+    /// nothing changed since it was last executed.
+    pub fn is_cacheable(&self) -> bool {
+        !self.inputs.is_empty() || !self.outputs.is_empty()
+    }
 }
 
 #[derive(Debug, Clone, Deserialize)]
@@ -0,0 +1,117 @@
+use crate::task::fingerprint::expand_globs;
+use crate::task::{Task, TaskGraph, TaskId};
+use std::collections::HashSet;
+use std::path::{Path, PathBuf};
+use std::time::SystemTime;
+
+/// The size and modification time of a file.
+type FileState = (u64, Option<SystemTime>);
+
+/// The state of the input files of every task in a [`TaskGraph`]. Comparing two snapshots tells
+/// which tasks have to run again.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct InputsSnapshot {
+    /// For every task the state of the files that match its `inputs`.
+    tasks: Vec<Vec<(PathBuf, FileState)>>,
+}
+
+impl InputsSnapshot {
+    /// Records the state of the input files of all tasks in the graph. Files that are outputs of a
+    /// task in the graph are ignored, these change when the tasks run.
+    pub fn new(root: &Path, graph: &TaskGraph) -> miette::Result<Self> {
+        let mut outputs = HashSet::new();
+        for node in graph.nodes() {
+            if let Task::Execute(execute) = &node.task {
+                outputs.extend(expand_globs(root, &execute.outputs)?.0);
+            }
+        }
+
+        let mut tasks = Vec::with_capacity(graph.len());
+        for node in graph.nodes() {
+            let inputs = match &node.task {
+                Task::Execute(execute) => expand_globs(root, &execute.inputs)?.0,
+                _ => Vec::new(),
+            };
+            tasks.push(
+                inputs
+                    .into_iter()
+                    .filter(|path| !outputs.contains(path))
+                    .map(|path| {
+                        let state = std::fs::metadata(&path)
+                            .map(|metadata| (metadata.len(), metadata.modified().ok()))
+                            .unwrap_or_default();
+                        (path, state)
+                    })
+                    .collect(),
+            );
+        }
+
+        Ok(Self { tasks })
+    }
+
+    /// Returns the ids of the tasks whose input files differ between the two snapshots. Both
+    /// snapshots must have been taken of the same graph.
+    pub fn changed_tasks(&self, other: &Self) -> Vec<TaskId> {
+        self.tasks
+            .iter()
+            .zip(other.tasks.iter())
+            .enumerate()
+            .filter(|(_, (a, b))| a != b)
+            .map(|(id, _)| id)
+            .collect()
+    }
+}
+
+/// Returns true if any task in the graph defines `inputs` that can be watched.
+pub fn has_inputs(graph: &TaskGraph) -> bool {
+    graph
+        .nodes()
+        .iter()
+        .any(|node| matches!(&node.task, Task::Execute(execute) if !execute.inputs.is_empty()))
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::Project;
+
+    #[test]
+    fn test_inputs_snapshot() {
+        let dir = tempfile::tempdir().unwrap();
+        let project = Project::from_manifest_str(
+            dir.path(),
+            r#"
+            [project]
+            name = "foo"
+            version = "0.1.0"
+            channels = []
+            platforms = []
+
+            [tasks]
+            configure = { cmd = "echo configure", inputs = ["*.txt", "build/*"], outputs = ["build/*"] }
+            build = { cmd = "echo build", depends_on = ["configure"], inputs = ["src/*"] }
+            "#,
+        )
+        .unwrap();
+        let graph = TaskGraph::from_cmd_args(&project, vec![String::from("build")]).unwrap();
+        assert!(has_inputs(&graph));
+
+        std::fs::create_dir(dir.path().join("src")).unwrap();
+        std::fs::create_dir(dir.path().join("build")).unwrap();
+        std::fs::write(dir.path().join("src/main.cpp"), "int main() {}").unwrap();
+        std::fs::write(dir.path().join("build/build.ninja"), "").unwrap();
+        let snapshot = InputsSnapshot::new(dir.path(), &graph).unwrap();
+
+        // Modifying an output of a task is ignored.
+        std::fs::write(dir.path().join("build/build.ninja"), "rules").unwrap();
+        let modified = InputsSnapshot::new(dir.path(), &graph).unwrap();
+        assert!(snapshot.changed_tasks(&modified).is_empty());
+
+        // Adding an input only affects the task that reads it.
+        std::fs::write(dir.path().join("CMakeLists.txt"), "project(foo)").unwrap();
+        let modified = InputsSnapshot::new(dir.path(), &graph).unwrap();
+        let changed = snapshot.changed_tasks(&modified);
+        assert_eq!(changed.len(), 1);
+        assert_eq!(graph[changed[0]].display_name(), "configure");
+    }
+}
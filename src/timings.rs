@@ -0,0 +1,318 @@
+//! Records how long every span of a pixi command took. The recorded timings can be printed as a
+//! summary or written to a file in the Chrome trace event format which can be opened with
+//! `chrome://tracing` or <https://ui.perfetto.dev>.
+
+use itertools::Itertools;
+use miette::IntoDiagnostic;
+use once_cell::sync::OnceCell;
+use serde::Serialize;
+use std::collections::HashMap;
+use std::fmt::Write;
+use std::path::PathBuf;
+use std::sync::{Arc, Mutex};
+use std::time::{Duration, Instant};
+use tracing::span;
+use tracing_subscriber::{layer::Context, registry::LookupSpan, Layer};
+
+/// The timings of the current process, set by [`init`].
+static TIMINGS: OnceCell<Timings> = OnceCell::new();
+
+/// Where the recorded timings should be written to.
+#[derive(Debug, Clone)]
+pub enum TimingsOutput {
+    /// Print a summary to stderr.
+    Summary,
+
+    /// Write a Chrome trace to the given file.
+    ChromeTrace(PathBuf),
+}
+
+/// A span that was closed.
+#[derive(Debug, Clone)]
+struct SpanTiming {
+    name: String,
+    target: String,
+    fields: String,
+    start: Duration,
+    duration: Duration,
+}
+
+/// The shared state of the [`TimingsLayer`] and [`finish`].
+struct Timings {
+    output: TimingsOutput,
+    start: Instant,
+    spans: Arc<Mutex<Vec<SpanTiming>>>,
+    finished: Mutex<bool>,
+}
+
+/// A [`Layer`] that records the time between the creation and the closing of every span.
+pub struct TimingsLayer {
+    start: Instant,
+    spans: Arc<Mutex<Vec<SpanTiming>>>,
+}
+
+/// Information stored in the extensions of every span while it is open.
+struct OpenSpan {
+    created: Instant,
+    fields: String,
+}
+
+/// Sets up recording of timings and returns the layer that has to be added to the tracing
+/// subscriber. Call [`finish`] to write the timings.
+pub fn init(output: TimingsOutput) -> TimingsLayer {
+    let start = Instant::now();
+    let spans = Arc::new(Mutex::new(Vec::new()));
+    let _ = TIMINGS.set(Timings {
+        output,
+        start,
+        spans: spans.clone(),
+        finished: Mutex::new(false),
+    });
+    TimingsLayer { start, spans }
+}
+
+/// Writes the recorded timings if timings were requested. Only the first call has any effect, so
+/// this can safely be called right before exiting the process.
+pub fn finish() -> miette::Result<()> {
+    let Some(timings) = TIMINGS.get() else {
+        return Ok(());
+    };
+
+    let mut finished = timings
+        .finished
+        .lock()
+        .expect("the timings lock is poisoned");
+    if *finished {
+        return Ok(());
+    }
+    *finished = true;
+
+    let spans = timings
+        .spans
+        .lock()
+        .expect("the timings lock is poisoned")
+        .clone();
+    match &timings.output {
+        TimingsOutput::Summary => {
+            eprint!("{}", summary(&spans, timings.start.elapsed()));
+            Ok(())
+        }
+        TimingsOutput::ChromeTrace(path) => {
+            let trace = chrome_trace(&spans);
+            std::fs::write(path, serde_json::to_vec(&trace).into_diagnostic()?).into_diagnostic()
+        }
+    }
+}
+
+impl<S> Layer<S> for TimingsLayer
+where
+    S: tracing::Subscriber + for<'a> LookupSpan<'a>,
+{
+    fn on_new_span(&self, attrs: &span::Attributes<'_>, id: &span::Id, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(id) else { return };
+        let mut fields = FieldsVisitor::default();
+        attrs.record(&mut fields);
+        span.extensions_mut().insert(OpenSpan {
+            created: Instant::now(),
+            fields: fields.0,
+        });
+    }
+
+    fn on_record(&self, id: &span::Id, values: &span::Record<'_>, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(id) else { return };
+        let mut extensions = span.extensions_mut();
+        if let Some(open_span) = extensions.get_mut::<OpenSpan>() {
+            let mut fields = FieldsVisitor(std::mem::take(&mut open_span.fields));
+            values.record(&mut fields);
+            open_span.fields = fields.0;
+        }
+    }
+
+    fn on_close(&self, id: span::Id, ctx: Context<'_, S>) {
+        let Some(span) = ctx.span(&id) else { return };
+        let extensions = span.extensions();
+        let Some(open_span) = extensions.get::<OpenSpan>() else {
+            return;
+        };
+
+        let timing = SpanTiming {
+            name: span.name().to_string(),
+            target: span.metadata().target().to_string(),
+            fields: open_span.fields.clone(),
+            start: open_span.created.duration_since(self.start),
+            duration: open_span.created.elapsed(),
+        };
+        self.spans
+            .lock()
+            .expect("the timings lock is poisoned")
+            .push(timing);
+    }
+}
+
+/// Formats the fields of a span as `key=value` pairs.
+#[derive(Default)]
+struct FieldsVisitor(String);
+
+impl tracing::field::Visit for FieldsVisitor {
+    fn record_debug(&mut self, field: &tracing::field::Field, value: &dyn std::fmt::Debug) {
+        if !self.0.is_empty() {
+            self.0.push(' ');
+        }
+        write!(self.0, "{}={:?}", field.name(), value).unwrap();
+    }
+
+    fn record_str(&mut self, field: &tracing::field::Field, value: &str) {
+        if !self.0.is_empty() {
+            self.0.push(' ');
+        }
+        write!(self.0, "{}={}", field.name(), value).unwrap();
+    }
+}
+
+/// Returns a human readable summary of the total time spent per span name.
+fn summary(spans: &[SpanTiming], total: Duration) -> String {
+    let mut per_name = HashMap::<&str, (usize, Duration)>::new();
+    for span in spans {
+        let entry = per_name.entry(span.name.as_str()).or_default();
+        entry.0 += 1;
+        entry.1 += span.duration;
+    }
+
+    let mut result = String::new();
+    writeln!(result, "{:<32} {:>8} {:>12}", "phase", "count", "total").unwrap();
+    for (name, (count, duration)) in per_name
+        .into_iter()
+        .sorted_by(|a, b| b.1 .1.cmp(&a.1 .1).then(a.0.cmp(b.0)))
+    {
+        writeln!(result, "{name:<32} {count:>8} {:>12.3?}", duration).unwrap();
+    }
+    writeln!(result, "{:<32} {:>8} {:>12.3?}", "wall time", "", total).unwrap();
+    result
+}
+
+/// A single event in the Chrome trace event format.
+#[derive(Debug, Serialize)]
+struct TraceEvent {
+    name: String,
+    cat: String,
+    ph: &'static str,
+    ts: u128,
+    dur: u128,
+    pid: u32,
+    tid: usize,
+    args: HashMap<&'static str, String>,
+}
+
+/// The root of a Chrome trace.
+#[derive(Debug, Serialize)]
+#[serde(rename_all = "camelCase")]
+struct ChromeTrace {
+    trace_events: Vec<TraceEvent>,
+    display_time_unit: &'static str,
+}
+
+/// Converts the spans to a Chrome trace. Spans run concurrently, so they are distributed over
+/// lanes (shown as threads) such that spans in the same lane are either disjoint or nested.
+fn chrome_trace(spans: &[SpanTiming]) -> ChromeTrace {
+    let mut lanes: Vec<Vec<Duration>> = Vec::new();
+    let mut trace_events = Vec::with_capacity(spans.len());
+    for span in spans
+        .iter()
+        .sorted_by(|a, b| a.start.cmp(&b.start).then(b.duration.cmp(&a.duration)))
+    {
+        let end = span.start + span.duration;
+        let lane = lanes.iter_mut().position(|open_spans| {
+            // Close the spans that ended before this span started.
+            while open_spans
+                .last()
+                .map_or(false, |&open_end| open_end <= span.start)
+            {
+                open_spans.pop();
+            }
+            open_spans.last().map_or(true, |&open_end| end <= open_end)
+        });
+        let lane = match lane {
+            Some(lane) => lane,
+            None => {
+                lanes.push(Vec::new());
+                lanes.len() - 1
+            }
+        };
+        lanes[lane].push(end);
+
+        let mut args = HashMap::new();
+        if !span.fields.is_empty() {
+            args.insert("fields", span.fields.clone());
+        }
+        trace_events.push(TraceEvent {
+            name: span.name.clone(),
+            cat: span.target.clone(),
+            ph: "X",
+            ts: span.start.as_micros(),
+            dur: span.duration.as_micros(),
+            pid: std::process::id(),
+            tid: lane,
+            args,
+        });
+    }
+
+    ChromeTrace {
+        trace_events,
+        display_time_unit: "ms",
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn span(name: &str, start_ms: u64, duration_ms: u64) -> SpanTiming {
+        SpanTiming {
+            name: name.to_string(),
+            target: String::from("pixi"),
+            fields: String::new(),
+            start: Duration::from_millis(start_ms),
+            duration: Duration::from_millis(duration_ms),
+        }
+    }
+
+    #[test]
+    fn test_chrome_trace_lanes() {
+        let trace = chrome_trace(&[
+            span("install", 0, 100),
+            span("download", 10, 50),
+            span("download", 20, 50),
+            span("link", 80, 10),
+        ]);
+        let lanes = trace
+            .trace_events
+            .iter()
+            .map(|event| (event.name.as_str(), event.tid))
+            .collect_vec();
+        assert_eq!(
+            lanes,
+            [
+                ("install", 0),
+                ("download", 0),
+                ("download", 1),
+                ("link", 0)
+            ]
+        );
+    }
+
+    #[test]
+    fn test_summary() {
+        let summary = summary(
+            &[
+                span("solve", 0, 30),
+                span("solve", 0, 20),
+                span("fetch", 0, 10),
+            ],
+            Duration::from_millis(60),
+        );
+        let lines = summary.lines().collect_vec();
+        assert!(lines[1].starts_with("solve"));
+        assert!(lines[1].contains(" 2 "));
+        assert!(lines[2].starts_with("fetch"));
+    }
+}
@@ -2,9 +2,18 @@ use crate::Project;
 use miette::IntoDiagnostic;
 use rattler_conda_types::{GenericVirtualPackage, Platform, Version};
 use rattler_virtual_packages::{Archspec, Cuda, LibC, Linux, Osx, VirtualPackage};
-use serde::Deserialize;
-use std::collections::HashMap;
+use serde::{Deserialize, Serialize};
+use std::collections::{BTreeMap, HashMap};
+use std::io::Write;
+use std::path::{Path, PathBuf};
 use std::str::FromStr;
+use std::time::{Duration, SystemTime, UNIX_EPOCH};
+
+/// The name of the file in the cache directory that stores the virtual packages of the host.
+const VIRTUAL_PACKAGES_CACHE_FILE: &str = "virtual-packages.json";
+
+/// How long the detected virtual packages of the host are reused before they are detected again.
+const VIRTUAL_PACKAGES_CACHE_TTL: Duration = Duration::from_secs(24 * 60 * 60);
 
 /// The supported system requirements that can be defined in the configuration.
 #[derive(Debug, Deserialize)]
@@ -129,17 +138,278 @@ impl Project {
     }
 }
 
+/// Identifies the host and everything else that influences the detection of its virtual packages.
+/// The cached virtual packages are only reused on the host and boot they were detected on, a
+/// reboot might come with a new kernel or driver. Platforms without a machine and boot id use the
+/// version of the operating system instead, so an update of the system invalidates the cache.
+#[derive(Debug, PartialEq, Eq, Serialize, Deserialize)]
+struct HostIdentity {
+    /// The version of pixi that detected the packages
+    version: String,
+
+    /// The platform of the host
+    platform: String,
+
+    /// The id of the machine, if it can be determined
+    machine_id: Option<String>,
+
+    /// The id of the current boot of the machine, if it can be determined
+    boot_id: Option<String>,
+
+    /// The version and build of the operating system on macOS and Windows
+    os_version: Option<String>,
+
+    /// The `CONDA_OVERRIDE_*` environment variables which replace detected values
+    overrides: BTreeMap<String, String>,
+}
+
+impl HostIdentity {
+    /// Returns the identity of the current host.
+    fn current() -> Self {
+        let read_id = |path: &str| {
+            std::fs::read_to_string(path)
+                .ok()
+                .map(|id| id.trim().to_string())
+                .filter(|id| !id.is_empty())
+        };
+        let (machine_id, boot_id) = if cfg!(target_os = "linux") {
+            (
+                read_id("/etc/machine-id"),
+                read_id("/proc/sys/kernel/random/boot_id"),
+            )
+        } else {
+            (None, None)
+        };
+
+        Self {
+            version: env!("CARGO_PKG_VERSION").to_string(),
+            platform: Platform::current().to_string(),
+            machine_id,
+            boot_id,
+            os_version: os_version(),
+            overrides: std::env::vars()
+                .filter(|(key, _)| key.starts_with("CONDA_OVERRIDE_"))
+                .collect(),
+        }
+    }
+}
+
+/// Returns the version of the operating system including its build, which changes with every
+/// update of the system. On macOS it is read from the system version file. Returns `None` on
+/// other platforms.
+#[cfg(target_os = "macos")]
+fn os_version() -> Option<String> {
+    let plist = std::fs::read_to_string("/System/Library/CoreServices/SystemVersion.plist").ok()?;
+    let version = plist_string(&plist, "ProductVersion")?;
+    let build = plist_string(&plist, "ProductBuildVersion")?;
+    Some(format!("{version} ({build})"))
+}
+
+/// Returns the build of Windows and its update revision, e.g. `19045.3448`, which changes with
+/// every cumulative update. Both are read from the registry.
+#[cfg(windows)]
+fn os_version() -> Option<String> {
+    use windows_sys::Win32::System::Registry::{RRF_RT_REG_DWORD, RRF_RT_REG_SZ};
+
+    let build = read_windows_version_value("CurrentBuildNumber", RRF_RT_REG_SZ)?;
+    let build = build
+        .chunks_exact(2)
+        .map(|bytes| u16::from_le_bytes([bytes[0], bytes[1]]))
+        .take_while(|&c| c != 0)
+        .collect::<Vec<_>>();
+    let build = String::from_utf16(&build).ok()?;
+    let revision = read_windows_version_value("UBR", RRF_RT_REG_DWORD)?;
+    let revision = u32::from_le_bytes(revision.get(..4)?.try_into().ok()?);
+    Some(format!("{build}.{revision}"))
+}
+
+#[cfg(not(any(target_os = "macos", windows)))]
+fn os_version() -> Option<String> {
+    None
+}
+
+/// Reads a value of the registry key that describes the installed version of Windows.
+#[cfg(windows)]
+fn read_windows_version_value(
+    name: &str,
+    flags: windows_sys::Win32::System::Registry::RRF_RT,
+) -> Option<Vec<u8>> {
+    use windows_sys::Win32::Foundation::ERROR_SUCCESS;
+    use windows_sys::Win32::System::Registry::{RegGetValueW, HKEY_LOCAL_MACHINE};
+
+    let wide = |value: &str| value.encode_utf16().chain([0]).collect::<Vec<u16>>();
+    let key = wide(r"SOFTWARE\Microsoft\Windows NT\CurrentVersion");
+    let name = wide(name);
+    let mut data = vec![0u8; 256];
+    let mut len = data.len() as u32;
+    // SAFETY: the key and value names are nul terminated and `len` is the size of `data`.
+    let status = unsafe {
+        RegGetValueW(
+            HKEY_LOCAL_MACHINE,
+            key.as_ptr(),
+            name.as_ptr(),
+            flags,
+            std::ptr::null_mut(),
+            data.as_mut_ptr().cast(),
+            &mut len,
+        )
+    };
+    if status != ERROR_SUCCESS {
+        return None;
+    }
+    data.truncate(len as usize);
+    Some(data)
+}
+
+/// Returns the string value of the given key in a property list.
+#[cfg_attr(not(target_os = "macos"), allow(dead_code))]
+fn plist_string<'a>(plist: &'a str, key: &str) -> Option<&'a str> {
+    let (_, value) = plist.split_once(&format!("<key>{key}</key>"))?;
+    let (_, value) = value.split_once("<string>")?;
+    let (value, _) = value.split_once("</string>")?;
+    Some(value.trim())
+}
+
+/// A virtual package as it is stored in the cache.
+#[derive(Debug, Serialize, Deserialize)]
+struct CachedVirtualPackage {
+    name: String,
+    version: String,
+    build_string: String,
+}
+
+/// The virtual packages of the host stored in [`VIRTUAL_PACKAGES_CACHE_FILE`].
+#[derive(Debug, Serialize, Deserialize)]
+struct VirtualPackagesCache {
+    host: HostIdentity,
+
+    /// When the packages were detected, in seconds since the unix epoch
+    detected_at: u64,
+
+    packages: Vec<CachedVirtualPackage>,
+}
+
+impl VirtualPackagesCache {
+    /// Reads the cache at the given path. Returns `None` if there is no cache, if it was created on
+    /// a different host or boot, or if it is older than [`VIRTUAL_PACKAGES_CACHE_TTL`].
+    fn read(
+        path: &Path,
+        host: &HostIdentity,
+        now: SystemTime,
+    ) -> Option<Vec<GenericVirtualPackage>> {
+        let contents = std::fs::read(path).ok()?;
+        let cache: Self = serde_json::from_slice(&contents).ok()?;
+        let age = now
+            .duration_since(UNIX_EPOCH + Duration::from_secs(cache.detected_at))
+            .ok()?;
+        if &cache.host != host || age > VIRTUAL_PACKAGES_CACHE_TTL {
+            return None;
+        }
+
+        cache
+            .packages
+            .into_iter()
+            .map(|package| {
+                Some(GenericVirtualPackage {
+                    name: package.name,
+                    version: Version::from_str(&package.version).ok()?,
+                    build_string: package.build_string,
+                })
+            })
+            .collect()
+    }
+
+    /// Writes the detected packages to the cache at the given path.
+    fn write(
+        path: &Path,
+        host: HostIdentity,
+        now: SystemTime,
+        packages: &[GenericVirtualPackage],
+    ) -> miette::Result<()> {
+        let cache = Self {
+            host,
+            detected_at: now.duration_since(UNIX_EPOCH).into_diagnostic()?.as_secs(),
+            packages: packages
+                .iter()
+                .map(|package| CachedVirtualPackage {
+                    name: package.name.clone(),
+                    version: package.version.to_string(),
+                    build_string: package.build_string.clone(),
+                })
+                .collect(),
+        };
+
+        // Write to a temporary file first so concurrent invocations never read a partial file.
+        let directory = path
+            .parent()
+            .ok_or_else(|| miette::miette!("{} has no parent", path.display()))?;
+        std::fs::create_dir_all(directory).into_diagnostic()?;
+        let mut file = tempfile::NamedTempFile::new_in(directory).into_diagnostic()?;
+        file.write_all(&serde_json::to_vec(&cache).into_diagnostic()?)
+            .into_diagnostic()?;
+        file.persist(path).into_diagnostic()?;
+        Ok(())
+    }
+}
+
+/// Returns the path of the file that caches the virtual packages of the host.
+fn virtual_packages_cache_path() -> Option<PathBuf> {
+    rattler::default_cache_dir()
+        .ok()
+        .map(|dir| dir.join(VIRTUAL_PACKAGES_CACHE_FILE))
+}
+
+/// Returns the virtual packages of the current host. Detecting them probes the system (e.g. loads
+/// the CUDA driver) which is slow, so the detected packages are cached in the pixi cache directory.
+/// The cache is reused on the same host and boot for [`VIRTUAL_PACKAGES_CACHE_TTL`], use
+/// [`clear_virtual_packages_cache`] to force a new detection.
+pub fn current_virtual_packages() -> miette::Result<Vec<GenericVirtualPackage>> {
+    let cache_path = virtual_packages_cache_path();
+    let host = HostIdentity::current();
+    let now = SystemTime::now();
+    if let Some(packages) = cache_path
+        .as_deref()
+        .and_then(|path| VirtualPackagesCache::read(path, &host, now))
+    {
+        return Ok(packages);
+    }
+
+    let packages = VirtualPackage::current()
+        .into_diagnostic()?
+        .iter()
+        .cloned()
+        .map(GenericVirtualPackage::from)
+        .collect::<Vec<_>>();
+
+    if let Some(path) = cache_path {
+        if let Err(err) = VirtualPackagesCache::write(&path, host, now, &packages) {
+            tracing::warn!("failed to write {}: {err}", path.display());
+        }
+    }
+
+    Ok(packages)
+}
+
+/// Removes the cached virtual packages of the host so the next call to
+/// [`current_virtual_packages`] detects them again.
+pub fn clear_virtual_packages_cache() -> miette::Result<()> {
+    let Some(path) = virtual_packages_cache_path() else {
+        return Ok(());
+    };
+    match std::fs::remove_file(path) {
+        Err(err) if err.kind() != std::io::ErrorKind::NotFound => Err(err).into_diagnostic(),
+        _ => Ok(()),
+    }
+}
+
 /// Verifies if the current platform satisfies the minimal virtual package requirements.
 pub fn verify_current_platform_has_required_virtual_packages(
     project: &Project,
 ) -> miette::Result<()> {
     let current_platform = Platform::current();
 
-    let system_virtual_packages = VirtualPackage::current()
-        .into_diagnostic()?
-        .iter()
-        .cloned()
-        .map(GenericVirtualPackage::from)
+    let system_virtual_packages = current_virtual_packages()?
+        .into_iter()
         .map(|vpkg| (vpkg.name.clone(), vpkg))
         .collect::<HashMap<_, _>>();
     let required_pkgs = project.virtual_packages(current_platform)?;
@@ -164,9 +434,13 @@ pub fn verify_current_platform_has_required_virtual_packages(
 
 #[cfg(test)]
 mod tests {
-    use crate::virtual_packages::get_minimal_virtual_packages;
+    use crate::virtual_packages::{
+        get_minimal_virtual_packages, HostIdentity, VirtualPackagesCache,
+        VIRTUAL_PACKAGES_CACHE_TTL,
+    };
     use insta::assert_debug_snapshot;
-    use rattler_conda_types::Platform;
+    use rattler_conda_types::{GenericVirtualPackage, Platform};
+    use std::time::{Duration, SystemTime};
 
     // Regression test on the virtual packages so there is not accidental changes
     #[test]
@@ -187,4 +461,64 @@ mod tests {
             assert_debug_snapshot!(snapshot_name, packages);
         }
     }
+
+    #[test]
+    fn test_virtual_packages_cache() {
+        let dir = tempfile::tempdir().unwrap();
+        let path = dir.path().join("virtual-packages.json");
+        let host = || HostIdentity {
+            version: String::from("0.1.0"),
+            platform: String::from("linux-64"),
+            machine_id: Some(String::from("machine")),
+            boot_id: Some(String::from("boot")),
+            os_version: None,
+            overrides: Default::default(),
+        };
+        let packages = vec![GenericVirtualPackage {
+            name: String::from("__cuda"),
+            version: "12.2".parse().unwrap(),
+            build_string: String::from("0"),
+        }];
+
+        let now = SystemTime::now();
+        assert!(VirtualPackagesCache::read(&path, &host(), now).is_none());
+        VirtualPackagesCache::write(&path, host(), now, &packages).unwrap();
+
+        let cached = VirtualPackagesCache::read(&path, &host(), now).unwrap();
+        assert_eq!(cached.len(), 1);
+        assert_eq!(cached[0].name, "__cuda");
+        assert_eq!(cached[0].version, packages[0].version);
+
+        // The cache is not used after a reboot or once it expired
+        let rebooted = HostIdentity {
+            boot_id: Some(String::from("other boot")),
+            ..host()
+        };
+        assert!(VirtualPackagesCache::read(&path, &rebooted, now).is_none());
+        let later = now + VIRTUAL_PACKAGES_CACHE_TTL + Duration::from_secs(1);
+        assert!(VirtualPackagesCache::read(&path, &host(), later).is_none());
+
+        // Or after an update of the operating system
+        let updated = HostIdentity {
+            os_version: Some(String::from("14.1 (23B74)")),
+            ..host()
+        };
+        assert!(VirtualPackagesCache::read(&path, &updated, now).is_none());
+    }
+
+    #[test]
+    fn test_plist_string() {
+        let plist = r#"<?xml version="1.0" encoding="UTF-8"?>
+<plist version="1.0">
+<dict>
+	<key>ProductBuildVersion</key>
+	<string>23B74</string>
+	<key>ProductVersion</key>
+	<string>14.1</string>
+</dict>
+</plist>"#;
+        assert_eq!(plist_string(plist, "ProductVersion"), Some("14.1"));
+        assert_eq!(plist_string(plist, "ProductBuildVersion"), Some("23B74"));
+        assert_eq!(plist_string(plist, "ProductName"), None);
+    }
 }
@@ -126,10 +126,11 @@ impl PixiControl {
     /// Run a command
     pub async fn run(&self, mut args: run::Args) -> miette::Result<RunOutput> {
         args.manifest_path = args.manifest_path.or_else(|| Some(self.manifest_path()));
+        let usage = args.lock_file_usage();
         let mut tasks = order_tasks(args.task, &self.project().unwrap())?;
 
         let project = self.project().unwrap();
-        let task_env = get_task_env(&project).await.unwrap();
+        let task_env = get_task_env(&project, usage).await.unwrap();
 
         while let Some((command, args)) = tasks.pop_back() {
             let script = create_script(command, args).await;
@@ -147,6 +148,10 @@ impl PixiControl {
     pub async fn install(&self) -> miette::Result<()> {
         pixi::cli::install::execute(Args {
             manifest_path: Some(self.manifest_path()),
+            frozen: false,
+            prefetch: false,
+            import_bundle: None,
+            export_bundle: None,
         })
         .await
     }